@@ -77,6 +77,10 @@ void __attribute__((constructor)) fs_init(void) {
             root_filename = get_filename(root_filepath);
 
         fs = open_fs(root);
+        if (!fs) {
+            fprintf(stderr, "Unable to open file system: %s\n", root);
+            exit(EXIT_FAILURE);
+        }
         fd_map = int_to_shallow_dictionary_create();
         dir_fd_map = shallow_to_shallow_dictionary_create();
     }
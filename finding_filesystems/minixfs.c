@@ -104,8 +104,14 @@ inode *minixfs_create_inode_for_path(file_system *fs, const char *path) {
     }
 
     inode_number ret_node_num = first_unused_inode(fs);
+    if(ret_node_num == -1){
+        free(parent_path);
+
+        return NULL;
+    }
     inode* ret_node = &(fs->inode_root[ret_node_num]);
     init_inode(parent_node, ret_node);
+    set_inode_used(fs, ret_node_num, 1);
     char* block = get_offset_char(fs, parent_node, parent_node->size);
 
     minixfs_dirent dirent;
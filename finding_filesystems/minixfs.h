@@ -142,6 +142,20 @@ typedef struct {
     inode *inode_root; /* Pointer to the beginning of an array of inodes */
     data_block
         *data_root; /* Pointer to the beginning of an array of data_blocks */
+    /**
+     *  In-memory mirror of the on-disk data map, one bit per block with a set
+     *  bit meaning free. Built by open_fs and kept in step by set_data_used.
+     */
+    uint64_t *free_map;
+    uint64_t free_map_words;
+    uint64_t data_cursor; /* Next-fit position for first_unused_data */
+    /**
+     *  Same idea for inodes: a set bit means nlink is 0. Built by open_fs
+     *  and kept in step by set_inode_used and free_inode.
+     */
+    uint64_t *free_inodes;
+    uint64_t free_inodes_words;
+    uint64_t inode_cursor; /* Next-fit position for first_unused_inode */
 } file_system;
 
 typedef struct {
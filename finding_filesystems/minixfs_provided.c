@@ -19,7 +19,9 @@ data_block_number add_data_block_to_inode(file_system *fs_pointer,
     int i;
     for (i = 0; i < NUM_DIRECT_BLOCKS; ++i) {
         if (node->direct[i] == -1) {
-            data_block_number first_data = first_unused_data(fs_pointer);
+            data_block_number previous = i ? node->direct[i - 1] : -1;
+            data_block_number first_data =
+                next_unused_data(fs_pointer, previous);
             if (first_data == -1) {
                 return -1;
             }
@@ -39,7 +41,14 @@ data_block_number add_data_block_to_indirect_block(file_system *fs_pointer,
     size_t i;
     for (i = 0; i < NUM_INDIRECT_BLOCKS; ++i) {
         if (blocks[i] == UNASSIGNED_NODE) {
-            data_block_number first_data = first_unused_data(fs_pointer);
+            // The first one goes after the indirect block itself, which
+            // blocks is the data of
+            data_block_number previous =
+                i ? blocks[i - 1]
+                  : (data_block_number)((data_block *)blocks -
+                                        fs_pointer->data_root);
+            data_block_number first_data =
+                next_unused_data(fs_pointer, previous);
             if (first_data == -1) {
                 return -1;
             }
@@ -57,7 +66,8 @@ inode_number add_single_indirect_block(file_system *fs_pointer, inode *node) {
 
     if (node->indirect != UNASSIGNED_NODE)
         return 0;
-    data_block_number first_data = first_unused_data(fs_pointer);
+    data_block_number first_data =
+        next_unused_data(fs_pointer, node->direct[NUM_DIRECT_BLOCKS - 1]);
     if (first_data == -1) {
         return -1;
     }
@@ -11,6 +11,50 @@
 #include <time.h>
 #include <unistd.h>
 
+static uint64_t *alloc_bitmap(uint64_t count, uint64_t *words) {
+    *words = (count + 63) / 64;
+    return calloc(*words ? *words : 1, sizeof(uint64_t));
+}
+
+static void set_bitmap(uint64_t *map, uint64_t index, int set) {
+    uint64_t bit = (uint64_t)1 << (index % 64);
+    if (set)
+        map[index / 64] |= bit;
+    else
+        map[index / 64] &= ~bit;
+}
+
+/**
+ * Packs the byte-per-block data map and the inode table's nlink counts into
+ * 64-bit words so the allocators can skip 64 used entries per test.
+ * Bits past dblock_count / inode_count are never set, and neither is the
+ * root inode's. Returns -1, with nothing left allocated, if memory ran out.
+ */
+static int build_free_maps(file_system *fs) {
+    uint64_t dblock_count = fs->meta->dblock_count;
+    fs->free_map = alloc_bitmap(dblock_count, &fs->free_map_words);
+    if (!fs->free_map)
+        return -1;
+    fs->data_cursor = 0;
+    char *data_map = GET_DATA_MAP(fs->meta);
+    for (uint64_t i = 0; i < dblock_count; ++i)
+        if (!data_map[i])
+            set_bitmap(fs->free_map, i, 1);
+
+    uint64_t inode_count = fs->meta->inode_count;
+    fs->free_inodes = alloc_bitmap(inode_count, &fs->free_inodes_words);
+    if (!fs->free_inodes) {
+        free(fs->free_map);
+        fs->free_map = NULL;
+        return -1;
+    }
+    fs->inode_cursor = 1;
+    for (uint64_t i = 1; i < inode_count; ++i)
+        if (fs->inode_root[i].nlink == 0)
+            set_bitmap(fs->free_inodes, i, 1);
+    return 0;
+}
+
 file_system *open_fs(const char *path) {
     if (!path) {
         return NULL;
@@ -37,9 +81,18 @@ file_system *open_fs(const char *path) {
     close(fd);
     superblock *metadata = (void *)file;
     file_system *my_fs = malloc(sizeof(*my_fs));
+    if (!my_fs) {
+        munmap(file, (size_t)file_stat.st_size);
+        return NULL;
+    }
     my_fs->meta = (void *)file;
     my_fs->inode_root = (void *)(file + sizeof(superblock));
     my_fs->data_root = (void *)(my_fs->inode_root + metadata->inode_count);
+    if (build_free_maps(my_fs) == -1) {
+        munmap(file, (size_t)file_stat.st_size);
+        free(my_fs);
+        return NULL;
+    }
 
     return my_fs;
 }
@@ -49,12 +102,16 @@ void close_fs(file_system **fs_pointer) {
     assert(*fs_pointer);
     superblock *meta = (*fs_pointer)->meta;
     munmap(meta, meta->size);
+    free((*fs_pointer)->free_map);
+    free((*fs_pointer)->free_inodes);
     free(*fs_pointer);
     *fs_pointer = NULL;
 }
 
 void free_inode(file_system *fs_pointer, inode *node) {
     node->nlink = 0;
+    set_inode_used(fs_pointer, (inode_number)(node - fs_pointer->inode_root),
+                   0);
     data_block_number *block_array = node->direct;
     for (int i = 0; i < NUM_DIRECT_BLOCKS; ++i)
         if (block_array[i] != UNASSIGNED_NODE)
@@ -82,6 +139,18 @@ void set_data_used(file_system *fs_pointer, data_block_number data_number,
         return;
     }
     GET_DATA_MAP(fs_pointer->meta)[data_number] = used;
+    if ((uint64_t)data_number / 64 < fs_pointer->free_map_words)
+        set_bitmap(fs_pointer->free_map, data_number, !used);
+}
+
+void set_inode_used(file_system *fs_pointer, inode_number inode_num,
+                    int used) {
+    if (inode_num <= 0 ||
+        (uint64_t)inode_num >= fs_pointer->meta->inode_count ||
+        (uint64_t)inode_num / 64 >= fs_pointer->free_inodes_words) {
+        return;
+    }
+    set_bitmap(fs_pointer->free_inodes, inode_num, !used);
 }
 
 data_block_number get_data_used(file_system *fs_pointer, int data_number) {
@@ -92,37 +161,57 @@ data_block_number get_data_used(file_system *fs_pointer, int data_number) {
     return GET_DATA_MAP(fs_pointer->meta)[data_number];
 }
 
+/**
+ * Returns the first set bit at or after start, wrapping around to the
+ * beginning of the map once. Whole words of used entries are skipped at a
+ * time.
+ */
+static int scan_bitmap(uint64_t *map, uint64_t words, uint64_t count,
+                       uint64_t start) {
+    if (words == 0)
+        return -1;
+    if (start >= count)
+        start = 0;
+
+    uint64_t word = start / 64;
+    uint64_t bits = map[word] & (~(uint64_t)0 << (start % 64));
+    for (uint64_t seen = 0; seen <= words; ++seen) {
+        if (bits)
+            return (int)(word * 64 + __builtin_ctzll(bits));
+        word = (word + 1) % words;
+        bits = map[word];
+    }
+    return -1;
+}
+
 inode_number first_unused_inode(file_system *fs_pointer) {
     assert(fs_pointer);
 
-    uint64_t i;
-    for (i = 1; i < INODES_NUMBER; ++i) {
-        int used = fs_pointer->inode_root[i].nlink;
-        if (used == 0) {
-            return (inode_number)i;
-        }
-    }
-    return -1;
+    inode_number found =
+        scan_bitmap(fs_pointer->free_inodes, fs_pointer->free_inodes_words,
+                    fs_pointer->meta->inode_count, fs_pointer->inode_cursor);
+    if (found != -1)
+        fs_pointer->inode_cursor = (uint64_t)found + 1;
+    return found;
 }
 
 data_block_number first_unused_data(file_system *fs_pointer) {
+    return next_unused_data(fs_pointer, UNASSIGNED_NODE);
+}
+
+data_block_number next_unused_data(file_system *fs_pointer,
+                                   data_block_number previous) {
     assert(fs_pointer);
 
-    uint64_t i;
-    uint64_t filled = 0;
-    uint64_t dblock_count = fs_pointer->meta->dblock_count;
-    while (filled < dblock_count) {
-        filled = 0;
-        for (i = 0; i < dblock_count; ++i) {
-            int used = get_data_used(fs_pointer, i);
-            if (!used && rand() % 2) {
-                return (data_block_number)i;
-            } else if (used) {
-                filled++;
-            }
-        }
-    }
-    return -1;
+    uint64_t start = fs_pointer->data_cursor;
+    if (previous >= 0)
+        start = (uint64_t)previous + 1;
+    data_block_number found =
+        scan_bitmap(fs_pointer->free_map, fs_pointer->free_map_words,
+                    fs_pointer->meta->dblock_count, start);
+    if (found != -1)
+        fs_pointer->data_cursor = (uint64_t)found + 1;
+    return found;
 }
 
 inode *parent_directory(file_system *fs, const char *path,
@@ -32,7 +32,7 @@ void minixfs_mkfs(char *args);
 /**
  *  Takes a valid file-filesystem and opens it while setting up the abstraction.
  *  Assumes that the file-filesystem was created by a call to minixfs_mkfs or
- *  otherwise has the same structure.
+ *  otherwise has the same structure. Returns NULL if memory runs out.
  */
 file_system *open_fs(const char *path);
 
@@ -77,6 +77,14 @@ void init_inode(inode *parent, inode *init);
  */
 void free_inode(file_system *fs_pointer, inode *node);
 
+/**
+ *  Marks an inode as taken (or free again) in the free-inode map.
+ *  Call it after init_inode on the number first_unused_inode returned.
+ *  No operation if you give an invalid inode number
+ */
+void set_inode_used(file_system *fs_pointer, inode_number inode_num,
+                    int used);
+
 /**
  *  Set a data block to be unused for future files
  */
@@ -85,15 +93,25 @@ void free_data_block(file_system *fs_pointer, data_block_number data_number);
 /**
  *  Returns the inode number of an unused inode
  *  -1 if there are no more inodes in the system
+ *  The inode stays free until set_inode_used marks it.
  */
 inode_number first_unused_inode(file_system *fs_pointer);
 
 /**
  *  Returns the data number of an unused inode
  *  -1 if there are no more data nodes
+ *  Searches next-fit from where the previous allocation left off.
  */
 data_block_number first_unused_data(file_system *fs_pointer);
 
+/**
+ *  Like first_unused_data, but starts looking right after previous so that
+ *  a file's blocks end up laid out one after another.
+ *  Pass UNASSIGNED_NODE when there is no previous block.
+ */
+data_block_number next_unused_data(file_system *fs_pointer,
+                                   data_block_number previous);
+
 /**
  *  Gets the inode of the parent directory and the name of the
  *  filename at the end (having a trailing slash is undefined behavior)
@@ -10,13 +10,27 @@
 #include <errno.h>
 #include <netdb.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/sendfile.h>
 
 #include "common.h"
 
 #define MY_EOF 1000
 
+// Requests a batch connection keeps in flight before it waits for their responses
+#define BATCH_PIPELINE_DEPTH 32
+#define BATCH_BUF_SIZE 65536
+// Pipe capacity asked for when splicing a GET payload, and the copy buffer size when splice can't be used
+#define GET_PIPE_SIZE (1024*1024)
+// Read size for uploads when sendfile can't be used
+#define PUT_CHUNK_SIZE (1024*1024)
+
 char **parse_args(int argc, char **argv);
 verb check_args(char **args);
+int connect_to_server(char* host, int port);
+int run_batch(char* host, int port, char* manifest, size_t numConns);
+int run_bench(char* host, int port, int argc, char** argv);
 
 typedef struct {
     char inputBuffer[MAX_BUF_SIZE];
@@ -32,12 +46,12 @@ static void handle_sigpipe()
   epipe = 1;
 }
 
-void send_all(char* buffer, size_t size, int sock) {
+static void send_all_flags(char* buffer, size_t size, int sock, int flags) {
     size_t bytes_sent = 0;
     do
     {
         int count;
-        count = send(sock, &buffer[bytes_sent], size - bytes_sent, 0);
+        count = send(sock, &buffer[bytes_sent], size - bytes_sent, flags);
         if(count < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK)
                 continue;
@@ -53,6 +67,10 @@ void send_all(char* buffer, size_t size, int sock) {
     } while (bytes_sent < size);
 }
 
+void send_all(char* buffer, size_t size, int sock) {
+    send_all_flags(buffer, size, sock, 0);
+}
+
 void start_read(ReadState* state, char* pBuffer, size_t bytes_left, int sock) {
     memcpy(state->inputBuffer, pBuffer, bytes_left);
     state->pNext = state->inputBuffer;
@@ -157,6 +175,41 @@ void handle_list_response(char* pBuffer, size_t bytes_left, int sock) {
     fprintf(stderr, "Received %zu bytes from server\n", count);
 }
 
+/**
+ * Prints the names of a LISTPAGE response as they arrive, up to the empty line that ends them, and then the
+ * cursor for the next page on stderr
+ */
+static void handle_listpage_response(char* pBuffer, size_t bytes_left, int sock) {
+    ReadState state;
+    start_read(&state, pBuffer, bytes_left, sock);
+    char buffer[MAX_BUF_SIZE];
+    read_line(&state, buffer, true);
+    print_response_status(&state, buffer);
+
+    size_t count = 0;
+    bool lineStart = true;
+    int c;
+    while((c = read_next(&state)) != MY_EOF && !(c == '\n' && lineStart)) {
+        putchar(c);
+        lineStart = c == '\n';
+        count += lineStart;
+    }
+    if(c == MY_EOF) {
+        print_too_little_data();
+        exit(1);
+    }
+    size_t cursor = read_size(&state);
+    c = read_next(&state);
+    if(c != MY_EOF && c != 0) {
+        print_received_too_much_data();
+        exit(1);
+    }
+
+    fprintf(stderr, "Received %zu names from server\n", count);
+    if(cursor)
+        fprintf(stderr, "Next page: --cursor %zu\n", cursor);
+}
+
 void handle_delete_response(char* pBuffer, size_t bytes_left, int sock) {
     ReadState state;
     start_read(&state, pBuffer, bytes_left, sock);
@@ -170,6 +223,19 @@ void handle_delete_response(char* pBuffer, size_t bytes_left, int sock) {
     }
 }
 
+static int write_fd_all(int fd, char* buffer, size_t size) {
+    while(size > 0) {
+        ssize_t count = write(fd, buffer, size);
+        if(count == -1 && errno == EINTR)
+            continue;
+        if(count <= 0)
+            return -1;
+        buffer += count;
+        size -= count;
+    }
+    return 0;
+}
+
 static void write_all(FILE* f, char* buffer, size_t size) {
     if(size == 0)
         return;
@@ -191,56 +257,218 @@ static void write_all(FILE* f, char* buffer, size_t size) {
     } while (bytes_sent < size);
 }
 
-void handle_get_response(char* pBuffer, size_t bytes_left, int sock, char* filename) {
-    ReadState state;
-    memset(&state, 0, sizeof(state));
-    start_read(&state, pBuffer, bytes_left, sock);
-    char buffer[81920] = "";
-    read_line(&state, buffer, true);
-    print_response_status(&state, buffer);
-    
-    FILE* output = fopen(filename, "wb");
-    if(output == NULL) {
-        fprintf(stderr, "Can't open %s for writing\n", filename);
-        exit(1);
+// Move the payload socket -> pipe -> file with splice, so it never passes through user space.
+// Returns the bytes moved, or -1 if splice can't be used for this socket and file and nothing was moved
+static ssize_t splice_payload(int sock, int fd, size_t size) {
+    int pipefd[2];
+    if(pipe(pipefd) == -1)
+        return -1;
+    fcntl(pipefd[1], F_SETPIPE_SZ, GET_PIPE_SIZE);
+
+    size_t moved = 0;
+    while(moved < size) {
+        size_t wanted = size - moved < GET_PIPE_SIZE ? size - moved : GET_PIPE_SIZE;
+        ssize_t in = splice(sock, NULL, pipefd[1], NULL, wanted, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(in == -1 && errno == EINTR)
+            continue;
+        if(in == -1 && moved == 0 && (errno == EINVAL || errno == ENOSYS)) {
+            close(pipefd[0]);
+            close(pipefd[1]);
+            return -1;
+        }
+        if(in <= 0) {
+            if(in == -1)
+                print_connection_closed();
+            break;
+        }
+        while(in > 0) {
+            ssize_t out = splice(pipefd[0], NULL, fd, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if(out == -1 && errno == EINTR)
+                continue;
+            if(out <= 0) {
+                print_error_message("Output write failed");
+                close(pipefd[0]);
+                close(pipefd[1]);
+                exit(1);
+            }
+            in -= out;
+            moved += out;
+        }
     }
-    size_t size = read_size(&state);
-    size_t readcount = 0;
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return moved;
+}
 
+// Write the size byte payload of a GET to filename from byte start on, anything already there past start is
+// dropped. The first `have` bytes were already read into pData
+static void receive_get_payload(int sock, char* filename, off_t start, size_t size, char* pData, size_t have) {
     fprintf(stderr, "Expecting %zu bytes from server\n", size);
+    if(have > size) {
+        print_received_too_much_data();
+        exit(1);
+    }
 
-    write_all(output, state.pNext, state.bytes_left);
-    readcount = state.bytes_left;
+    int fd = open(filename, O_WRONLY | O_CREAT | (start == 0 ? O_TRUNC : 0), 0644);
+    if(fd == -1 || (start > 0 && (ftruncate(fd, start) == -1 || lseek(fd, start, SEEK_SET) == -1))) {
+        fprintf(stderr, "Can't open %s for writing\n", filename);
+        exit(1);
+    }
+    if(have > 0 && write_fd_all(fd, pData, have) == -1) {
+        print_error_message("Output write failed");
+        exit(1);
+    }
+    size_t readcount = have;
 
-    while(1) {
-        
-        int count = read(state.sock, buffer, sizeof(buffer));
-        if(count == 0) {
-            state.end = true;
-            break;
+    ssize_t moved = splice_payload(sock, fd, size - readcount);
+    if(moved >= 0) {
+        readcount += moved;
+    } else {
+        // splice isn't available for this pair, copy through a large buffer instead
+        char* buffer = malloc(GET_PIPE_SIZE);
+        if(buffer == NULL) {
+            print_error_message("malloc failed");
+            exit(1);
         }
-        if(count == -1) {
-            print_connection_closed();
-            fclose(output);
+        while(readcount < size) {
+            ssize_t count = read(sock, buffer, GET_PIPE_SIZE);
+            if(count == -1 && errno == EINTR)
+                continue;
+            if(count == 0)
+                break;
+            if(count == -1) {
+                print_connection_closed();
+                close(fd);
+                exit(1);
+            }
+            if(readcount + count > size) {
+                print_received_too_much_data();
+                close(fd);
+                exit(1);
+            }
+            if(write_fd_all(fd, buffer, count) == -1) {
+                print_error_message("Output write failed");
+                exit(1);
+            }
+            readcount += count;
+        }
+        free(buffer);
+    }
+    close(fd);
+
+    if(readcount < size) {
+        print_too_little_data();
+    } else {
+        // The server must close right after the payload
+        char extra;
+        ssize_t count;
+        while((count = read(sock, &extra, 1)) == -1 && errno == EINTR)
+            ;
+        if(count > 0) {
+            print_received_too_much_data();
             exit(1);
         }
+    }
+    fprintf(stderr, "received %zu bytes from server\n", readcount);
+}
 
-        readcount += count;
-        if( readcount > size ) {
+// Take n bytes of the response, first from what was already read into *pData and then from the socket.
+// Returns false if the connection ends first
+static bool read_exact(int sock, char** pData, size_t* have, char* dst, size_t n) {
+    size_t got = *have < n ? *have : n;
+    memcpy(dst, *pData, got);
+    *pData += got;
+    *have -= got;
+    while(got < n) {
+        ssize_t count = read(sock, dst + got, n - got);
+        if(count == -1 && errno == EINTR)
+            continue;
+        if(count <= 0)
+            return false;
+        got += count;
+    }
+    return true;
+}
+
+// Write the LZ frames of a GETZ payload, size bytes once decompressed, to filename
+static void receive_frames(int sock, char* filename, size_t size, char* pData, size_t have) {
+    fprintf(stderr, "Expecting %zu bytes from server\n", size);
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    char* frame = malloc(LZ_FRAME_HEADER + LZ_FRAME_SIZE);
+    char* out = malloc(LZ_FRAME_SIZE);
+    if(fd == -1 || frame == NULL || out == NULL) {
+        fprintf(stderr, "Can't open %s for writing\n", filename);
+        exit(1);
+    }
+
+    size_t received = 0, wire = 0;
+    while(true) {
+        uint32_t raw, coded;
+        if(!read_exact(sock, &pData, &have, frame, LZ_FRAME_HEADER))
+            break;
+        memcpy(&raw, frame, 4);
+        memcpy(&coded, frame + 4, 4);
+        if(raw > LZ_FRAME_SIZE || coded > raw || (raw == 0) != (coded == 0)) {
+            print_invalid_response();
+            exit(1);
+        }
+        wire += LZ_FRAME_HEADER + coded;
+        if(raw == 0)
+            break;
+        if(!read_exact(sock, &pData, &have, frame + LZ_FRAME_HEADER, coded))
+            break;
+        char* data = frame + LZ_FRAME_HEADER;
+        if(coded < raw) {
+            if(lz_decompress((uint8_t*)data, coded, (uint8_t*)out, raw) != (ssize_t)raw) {
+                print_invalid_response();
+                exit(1);
+            }
+            data = out;
+        }
+        if(received + raw > size) {
             print_received_too_much_data();
-            fclose(output);
             exit(1);
         }
-        write_all(output, buffer, count);
-        
+        if(write_fd_all(fd, data, raw) == -1) {
+            print_error_message("Output write failed");
+            exit(1);
+        }
+        received += raw;
     }
-        
-    if( readcount < size ) {
+    close(fd);
+    free(frame);
+    free(out);
+
+    if(received < size)
         print_too_little_data();
+    fprintf(stderr, "received %zu bytes from server, %zu compressed\n", received, wire);
+}
+
+void handle_get_response(char* pBuffer, size_t bytes_left, int sock, char* filename, off_t start, bool compressed) {
+    // The first read almost always holds the whole "OK\n" and size, take them straight from it
+    if(bytes_left >= 3 + sizeof(size_t) && !memcmp(pBuffer, "OK\n", 3)) {
+        fprintf(stderr, "STATUS_OK\n");
+        size_t size;
+        memcpy(&size, &pBuffer[3], sizeof(size_t));
+        if(compressed)
+            receive_frames(sock, filename, size, &pBuffer[3 + sizeof(size_t)], bytes_left - 3 - sizeof(size_t));
+        else
+            receive_get_payload(sock, filename, start, size, &pBuffer[3 + sizeof(size_t)], bytes_left - 3 - sizeof(size_t));
+        return;
     }
 
-    fprintf(stderr, "received %zu bytes from server\n", readcount);
-    fclose(output);
+    // Error responses and headers split across reads
+    ReadState state;
+    memset(&state, 0, sizeof(state));
+    start_read(&state, pBuffer, bytes_left, sock);
+    char buffer[MAX_BUF_SIZE] = "";
+    read_line(&state, buffer, true);
+    print_response_status(&state, buffer);
+    size_t size = read_size(&state);
+    if(compressed)
+        receive_frames(sock, filename, size, state.pNext, state.bytes_left);
+    else
+        receive_get_payload(sock, filename, start, size, state.pNext, state.bytes_left);
 }
 
 void handle_put_response(char* pBuffer, size_t bytes_left, int sock) {
@@ -321,65 +549,121 @@ void create_message(char* buffer, char* verb_as_char, char* filename){
         sprintf(buffer, "%s\n", verb_as_char);
 }
 
-void send_file(char* filename, int sock) {
+/**
+ * Uploads filename for a PUT. The request line in header and the 8 byte size go out in one send flagged
+ * MSG_MORE, so they share a segment with the start of the file. The file itself is streamed with sendfile
+ * straight from the page cache, with a plain read/send loop if sendfile can't be used.
+ * A PUTFROM resuming at start still announces the whole size but only sends the bytes from start on.
+ */
+void send_file(char* filename, int sock, char* header, size_t headerLen, off_t start) {
     struct stat file_info;
-    stat(filename, &file_info);
-
-    fprintf(stderr, "File size: %zu\n", file_info.st_size);
-    
-    FILE* f = fopen(filename, "rb");
-    if(f == NULL) {
+    int fd = open(filename, O_RDONLY);
+    if(fd == -1 || fstat(fd, &file_info) == -1) {
         fprintf(stderr, "Can't open file %s\n", filename);
         exit(1);
     }
+    size_t size = file_info.st_size;
+    fprintf(stderr, "File size: %zu\n", size);
 
-    size_t bytes_written = 0;
     char buffer[MAX_BUF_SIZE];
-    memcpy(buffer, &file_info.st_size, sizeof(size_t));
-    send_all(buffer, sizeof(size_t), sock);
-    
-    do
-    {
-        size_t count = fread(buffer, 1, MAX_BUF_SIZE, f);
-        if(count == 0 || ferror(f)) {
+    memcpy(buffer, header, headerLen);
+    memcpy(&buffer[headerLen], &size, sizeof(size_t));
+    send_all_flags(buffer, headerLen + sizeof(size_t), sock, size > 0 ? MSG_MORE : 0);
+
+    off_t offset = start;
+    while((size_t)offset < size) {
+        ssize_t count = sendfile(sock, fd, &offset, size - offset);
+        if(count == -1 && errno == EINTR)
+            continue;
+        if(count == -1 && offset == start && (errno == EINVAL || errno == ENOSYS))
+            break;
+        if(count == -1) {
+            print_connection_closed();
+            exit(1);
+        }
+        if(count == 0) {
             fprintf(stderr, "error reading file");
-            fclose(f);
             exit(1);
         }
-        send_all(buffer, count, sock);
-        bytes_written += count;
-    } while (bytes_written < (size_t)file_info.st_size);
-    fclose(f);
+    }
 
-    fprintf(stderr, "Sent %zu bytes of file\n", bytes_written);
-}
+    if((size_t)offset < size) {
+        char* chunk = malloc(PUT_CHUNK_SIZE);
+        if(chunk == NULL || lseek(fd, offset, SEEK_SET) == -1) {
+            print_error_message("malloc failed");
+            exit(1);
+        }
+        while((size_t)offset < size) {
+            ssize_t count = read(fd, chunk, PUT_CHUNK_SIZE);
+            if(count == -1 && errno == EINTR)
+                continue;
+            if(count <= 0) {
+                fprintf(stderr, "error reading file");
+                exit(1);
+            }
+            send_all(chunk, count, sock);
+            offset += count;
+        }
+        free(chunk);
+    }
+    close(fd);
 
-int main(int argc, char **argv) {
-    char *host = strtok(argv[1], ":");
-    char *strport = strtok(NULL, ":");
+    fprintf(stderr, "Sent %zu bytes of file\n", (size_t)(offset - start));
+}
 
-    signal(SIGPIPE, handle_sigpipe);
-    
-    if (strport == NULL) {
-        print_client_help();
-        return -1;
-    }
-    int port = atoi(strport);
-    char* verb_as_char = argv[2];
-    verb _verb = check_args(argv);
-    char* firstFile = NULL;
-    char* secondFile = NULL;
-    if(argc > 3){
-        firstFile = argv[3];
-        secondFile = argv[3];
+/**
+ * Uploads filename for a PUTZ: the request line and the size, then the file as LZ frames, compressed a chunk
+ * at a time as it is read, and the end frame.
+ */
+static void send_file_compressed(char* filename, int sock, char* header, size_t headerLen) {
+    struct stat file_info;
+    int fd = open(filename, O_RDONLY);
+    char* chunk = malloc(PUT_CHUNK_SIZE);
+    char* frame = malloc(LZ_FRAME_HEADER + LZ_FRAME_SIZE);
+    if(fd == -1 || fstat(fd, &file_info) == -1 || chunk == NULL || frame == NULL) {
+        fprintf(stderr, "Can't open file %s\n", filename);
+        exit(1);
     }
-    if(argc > 4){
-        secondFile = argv[4];
+    size_t size = file_info.st_size;
+    fprintf(stderr, "File size: %zu\n", size);
+
+    char buffer[MAX_BUF_SIZE];
+    memcpy(buffer, header, headerLen);
+    memcpy(&buffer[headerLen], &size, sizeof(size_t));
+    send_all_flags(buffer, headerLen + sizeof(size_t), sock, MSG_MORE);
+
+    size_t sent = 0, wire = 0;
+    while(sent < size) {
+        ssize_t count = read(fd, chunk, PUT_CHUNK_SIZE);
+        if(count == -1 && errno == EINTR)
+            continue;
+        if(count <= 0) {
+            fprintf(stderr, "error reading file");
+            exit(1);
+        }
+        for(ssize_t done = 0; done < count; ) {
+            size_t len = count - done < LZ_FRAME_SIZE ? count - done : LZ_FRAME_SIZE;
+            size_t frameLen = lz_frame((uint8_t*)chunk + done, len, (uint8_t*)frame);
+            send_all(frame, frameLen, sock);
+            wire += frameLen;
+            done += len;
+        }
+        sent += count;
     }
+    size_t frameLen = lz_frame(NULL, 0, (uint8_t*)frame);
+    send_all(frame, frameLen, sock);
+    wire += frameLen;
+    close(fd);
+    free(chunk);
+    free(frame);
 
+    fprintf(stderr, "Sent %zu bytes of file, %zu compressed\n", sent, wire);
+}
+
+// Resolve host and open a TCP connection to it. Returns the socket, or -1 after printing the error
+int connect_to_server(char* host, int port) {
     int sock = 0;
     struct sockaddr_in serv_addr;
-    char buffer[MAX_BUF_SIZE] = {0};
 
     // Creating a socket
     if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
@@ -440,10 +724,1029 @@ int main(int argc, char **argv) {
         return -1;
     }
 
-    create_message(buffer, verb_as_char, firstFile);
-    send_all(buffer, strlen(buffer), sock);
-    if(_verb == PUT){
-        send_file(secondFile, sock);
+    return sock;
+}
+
+// One operation from a batch manifest
+typedef struct {
+    verb op;
+    char* remote;           // Name on the server, NULL for LIST and KEEPALIVE
+    char* local;            // Local file for GET and PUT
+} BatchOp;
+
+enum {
+    RESPONSE_STATUS = 4001, // Waiting for the "OK\n" or "ERROR\n" line
+    RESPONSE_ERROR_MESSAGE, // Waiting for the line following "ERROR\n"
+    RESPONSE_SIZE,          // Waiting for the 8 byte size of a GET or LIST payload
+    RESPONSE_BODY,          // Copying the payload out
+};
+
+// A persistent, non blocking connection that pipelines the requests of a batch
+typedef struct {
+    int sock;
+    BatchOp* ops;
+    size_t numOps;
+    size_t nextToSend;          // Next op whose request has not been queued yet
+    size_t nextToFinish;        // Op whose response is being read
+    size_t failed;              // Ops that were answered with an error
+
+    char out[BATCH_BUF_SIZE];   // Request bytes the socket has not taken yet
+    size_t outLen;
+    size_t outPos;
+    FILE* putFile;              // File of the PUT currently being streamed out
+    size_t putLeft;             // Bytes of that file still to queue
+
+    char in[BATCH_BUF_SIZE];    // Received bytes that are not parsed yet
+    size_t inLen;
+    size_t inPos;
+    int responseState;
+    size_t bodyLeft;            // Payload bytes of the current response still to come
+    FILE* getFile;              // Where the current GET payload goes
+
+    size_t bytesOut;            // Bytes sent and received on the connection, for the throughput report
+    size_t bytesIn;
+} BatchConn;
+
+static const char* verb_names[] = { "GET", "PUT", "DELETE", "LIST", "KEEPALIVE", "STATS",
+                                     "GETRANGE", "PUTFROM", "PARTIAL", "GETZ", "PUTZ", "LISTPAGE" };
+
+/**
+ * Reads a batch manifest, one operation per line:
+ *   GET <remote> <local>
+ *   PUT <remote> <local>
+ *   DELETE <remote>
+ *   LIST
+ * Blank lines and lines starting with '#' are skipped. A KEEPALIVE is put in front so the
+ * server keeps the connection open. Returns the number of ops, or -1 if the manifest is invalid.
+ */
+static ssize_t parse_manifest(char* manifest, BatchOp** pOps) {
+    FILE* f = strcmp(manifest, "-") ? fopen(manifest, "r") : stdin;
+    if(f == NULL) {
+        fprintf(stderr, "Can't open manifest %s\n", manifest);
+        return -1;
+    }
+
+    size_t count = 1, cap = 64;
+    BatchOp* ops = calloc(cap, sizeof(BatchOp));
+    ops[0].op = KEEPALIVE;
+
+    char* line = NULL;
+    size_t lineCap = 0;
+    size_t lineNo = 0;
+    while(getline(&line, &lineCap, f) != -1) {
+        lineNo++;
+        char* command = strtok(line, " \t\r\n");
+        if(command == NULL || command[0] == '#')
+            continue;
+        char* remote = strtok(NULL, " \t\r\n");
+        char* local = strtok(NULL, " \t\r\n");
+
+        BatchOp op = { V_UNKNOWN, NULL, NULL };
+        if(!strcmp(command, "GET") && remote && local)
+            op.op = GET;
+        else if(!strcmp(command, "PUT") && remote && local)
+            op.op = PUT;
+        else if(!strcmp(command, "DELETE") && remote && !local)
+            op.op = DELETE;
+        else if(!strcmp(command, "LIST") && !remote)
+            op.op = LIST;
+
+        struct stat file_info;
+        if(op.op == PUT && stat(local, &file_info) == -1) {
+            fprintf(stderr, "%s:%zu: can't read %s\n", manifest, lineNo, local);
+            op.op = V_UNKNOWN;
+        }
+        if(op.op == V_UNKNOWN) {
+            fprintf(stderr, "%s:%zu: invalid operation\n", manifest, lineNo);
+            count = 0;
+            break;
+        }
+
+        op.remote = remote ? strdup(remote) : NULL;
+        op.local = local ? strdup(local) : NULL;
+        if(count == cap) {
+            cap *= 2;
+            ops = realloc(ops, cap * sizeof(BatchOp));
+        }
+        ops[count++] = op;
+    }
+    free(line);
+    if(f != stdin)
+        fclose(f);
+
+    if(count == 0) {
+        free(ops);
+        return -1;
+    }
+    *pOps = ops;
+    return count;
+}
+
+// Queue request headers and PUT payloads into the output buffer, staying within the pipeline depth
+static void batch_fill_output(BatchConn* conn) {
+    if(conn->outPos == conn->outLen) {
+        conn->outPos = 0;
+        conn->outLen = 0;
+    }
+
+    while(conn->outLen < BATCH_BUF_SIZE) {
+        if(conn->putFile != NULL) {
+            size_t wanted = BATCH_BUF_SIZE - conn->outLen;
+            if(wanted > conn->putLeft)
+                wanted = conn->putLeft;
+            size_t count = fread(&conn->out[conn->outLen], 1, wanted, conn->putFile);
+            if(count == 0) {
+                fprintf(stderr, "error reading file\n");
+                exit(1);
+            }
+            conn->outLen += count;
+            conn->putLeft -= count;
+            if(conn->putLeft == 0) {
+                fclose(conn->putFile);
+                conn->putFile = NULL;
+            }
+            continue;
+        }
+
+        if(conn->nextToSend == conn->numOps || conn->nextToSend - conn->nextToFinish >= BATCH_PIPELINE_DEPTH)
+            break;
+
+        BatchOp* op = &conn->ops[conn->nextToSend];
+        size_t remoteLen = op->remote ? strlen(op->remote) : 0;
+        // Room for the verb, the name, the newline and a size
+        if(BATCH_BUF_SIZE - conn->outLen < remoteLen + 16 + sizeof(size_t))
+            break;
+
+        char* pOut = &conn->out[conn->outLen];
+        if(op->remote)
+            pOut += sprintf(pOut, "%s %s\n", verb_names[op->op], op->remote);
+        else
+            pOut += sprintf(pOut, "%s\n", verb_names[op->op]);
+
+        if(op->op == PUT) {
+            struct stat file_info;
+            FILE* f = fopen(op->local, "rb");
+            if(f == NULL || fstat(fileno(f), &file_info) == -1) {
+                fprintf(stderr, "Can't open file %s\n", op->local);
+                exit(1);
+            }
+            size_t size = file_info.st_size;
+            memcpy(pOut, &size, sizeof(size_t));
+            pOut += sizeof(size_t);
+            if(size > 0) {
+                conn->putFile = f;
+                conn->putLeft = size;
+            } else {
+                fclose(f);
+            }
+        }
+        conn->outLen = pOut - conn->out;
+        conn->nextToSend++;
+    }
+}
+
+static void batch_finish_op(BatchConn* conn, char* error) {
+    BatchOp* op = &conn->ops[conn->nextToFinish];
+    if(conn->getFile != NULL) {
+        fclose(conn->getFile);
+        conn->getFile = NULL;
+    }
+    if(error != NULL) {
+        conn->failed++;
+        fprintf(stderr, "%s %s: %s\n", verb_names[op->op], op->remote ? op->remote : "", error);
+    } else if(op->op != KEEPALIVE) {
+        fprintf(stderr, "%s %s: OK\n", verb_names[op->op], op->remote ? op->remote : "");
+    }
+    conn->nextToFinish++;
+    conn->responseState = RESPONSE_STATUS;
+}
+
+// Parse as many responses as the received bytes allow. Returns false if the server sent something invalid
+static bool batch_parse_responses(BatchConn* conn) {
+    while(conn->nextToFinish < conn->nextToSend) {
+        BatchOp* op = &conn->ops[conn->nextToFinish];
+        char* start = &conn->in[conn->inPos];
+        size_t available = conn->inLen - conn->inPos;
+        char* nl;
+
+        switch(conn->responseState) {
+            case RESPONSE_STATUS:
+                nl = memchr(start, '\n', available);
+                if(nl == NULL)
+                    return available < BATCH_BUF_SIZE;
+                if(nl - start == 2 && !memcmp(start, "OK", 2)) {
+                    conn->inPos += 3;
+                    if(op->op == GET || op->op == LIST)
+                        conn->responseState = RESPONSE_SIZE;
+                    else
+                        batch_finish_op(conn, NULL);
+                } else if(nl - start == 5 && !memcmp(start, "ERROR", 5)) {
+                    conn->inPos += 6;
+                    conn->responseState = RESPONSE_ERROR_MESSAGE;
+                } else {
+                    print_invalid_response();
+                    return false;
+                }
+                break;
+            case RESPONSE_ERROR_MESSAGE:
+                nl = memchr(start, '\n', available);
+                if(nl == NULL)
+                    return available < BATCH_BUF_SIZE;
+                *nl = '\0';
+                conn->inPos += nl - start + 1;
+                batch_finish_op(conn, start);
+                break;
+            case RESPONSE_SIZE:
+                if(available < sizeof(size_t))
+                    return true;
+                memcpy(&conn->bodyLeft, start, sizeof(size_t));
+                conn->inPos += sizeof(size_t);
+                if(op->op == GET) {
+                    conn->getFile = fopen(op->local, "wb");
+                    if(conn->getFile == NULL)
+                        fprintf(stderr, "Can't open %s for writing\n", op->local);
+                }
+                conn->responseState = RESPONSE_BODY;
+                if(conn->bodyLeft == 0)
+                    batch_finish_op(conn, NULL);
+                break;
+            case RESPONSE_BODY: {
+                size_t take = available < conn->bodyLeft ? available : conn->bodyLeft;
+                if(take == 0)
+                    return true;
+                if(op->op == LIST)
+                    write_all(stdout, start, take);
+                else if(conn->getFile != NULL)
+                    write_all(conn->getFile, start, take);
+                conn->inPos += take;
+                conn->bodyLeft -= take;
+                if(conn->bodyLeft == 0)
+                    batch_finish_op(conn, conn->getFile || op->op == LIST ? NULL : "Can't write local file");
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+// Ops on the same remote file must stay in order, so they always go to the same connection
+static size_t batch_connection_for(BatchOp* op, size_t numConns) {
+    if(op->remote == NULL)
+        return 0;
+    uint32_t hash = 2166136261u;   // FNV-1a
+    for(const char* p = op->remote; *p; p++) {
+        hash ^= (unsigned char)*p;
+        hash *= 16777619u;
+    }
+    return hash % numConns;
+}
+
+// Send what is queued and read what has arrived. Returns false once the connection is unusable
+static bool batch_service(BatchConn* conn, short revents) {
+    if(revents & POLLOUT) {
+        ssize_t count = send(conn->sock, &conn->out[conn->outPos], conn->outLen - conn->outPos, MSG_NOSIGNAL);
+        if(count == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            print_connection_closed();
+            return false;
+        }
+        if(count > 0) {
+            conn->outPos += count;
+            conn->bytesOut += count;
+        }
+    }
+
+    if(revents & (POLLIN | POLLHUP | POLLERR)) {
+        if(conn->inPos > 0) {
+            memmove(conn->in, &conn->in[conn->inPos], conn->inLen - conn->inPos);
+            conn->inLen -= conn->inPos;
+            conn->inPos = 0;
+        }
+        ssize_t count = recv(conn->sock, &conn->in[conn->inLen], BATCH_BUF_SIZE - conn->inLen, 0);
+        if(count == 0 || (count == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            print_connection_closed();
+            return false;
+        }
+        if(count > 0) {
+            conn->inLen += count;
+            conn->bytesIn += count;
+            if(!batch_parse_responses(conn))
+                return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Runs every operation in the manifest over numConns persistent, non blocking connections polled together.
+ * Ops are spread over the connections by remote name, and on each connection requests are pipelined up to
+ * BATCH_PIPELINE_DEPTH ahead of the responses. Prints the aggregate throughput. Returns the exit code for the client.
+ */
+int run_batch(char* host, int port, char* manifest, size_t numConns) {
+    BatchOp* ops = NULL;
+    ssize_t numOps = parse_manifest(manifest, &ops);
+    if(numOps < 0)
+        return 1;
+    if(numConns < 1)
+        numConns = 1;
+    // No point in connections that would get nothing to do
+    if(numConns > (size_t)numOps - 1)
+        numConns = numOps > 1 ? numOps - 1 : 1;
+
+    // Every connection gets its own KEEPALIVE in front of its share of the ops
+    BatchConn* conns = calloc(numConns, sizeof(BatchConn));
+    struct pollfd* pfds = calloc(numConns, sizeof(struct pollfd));
+    for(size_t c=0; c < numConns; c++) {
+        conns[c].ops = calloc(numOps, sizeof(BatchOp));
+        conns[c].ops[conns[c].numOps++] = ops[0];
+        conns[c].responseState = RESPONSE_STATUS;
+        conns[c].sock = -1;
+    }
+    for(ssize_t i=1; i < numOps; i++) {
+        BatchConn* conn = &conns[batch_connection_for(&ops[i], numConns)];
+        conn->ops[conn->numOps++] = ops[i];
+    }
+
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    size_t live = 0;
+    for(size_t c=0; c < numConns; c++) {
+        conns[c].sock = connect_to_server(host, port);
+        if(conns[c].sock < 0)
+            continue;
+        fcntl(conns[c].sock, F_SETFL, fcntl(conns[c].sock, F_GETFL, 0) | O_NONBLOCK);
+        live++;
+    }
+
+    while(live > 0) {
+        for(size_t c=0; c < numConns; c++) {
+            BatchConn* conn = &conns[c];
+            pfds[c].fd = -1;
+            pfds[c].events = 0;
+            if(conn->sock < 0)
+                continue;
+            if(conn->nextToFinish == conn->numOps) {
+                close(conn->sock);
+                conn->sock = -1;
+                live--;
+                continue;
+            }
+            batch_fill_output(conn);
+            pfds[c].fd = conn->sock;
+            pfds[c].events = POLLIN | (conn->outPos < conn->outLen ? POLLOUT : 0);
+        }
+        if(live == 0)
+            break;
+
+        if(poll(pfds, numConns, -1) == -1) {
+            if(errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        for(size_t c=0; c < numConns; c++) {
+            if(pfds[c].fd < 0 || pfds[c].revents == 0)
+                continue;
+            if(!batch_service(&conns[c], pfds[c].revents)) {
+                close(conns[c].sock);
+                conns[c].sock = -1;
+                live--;
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+
+    // The KEEPALIVEs in front are not counted
+    size_t failed = 0, unanswered = 0, bytesIn = 0, bytesOut = 0;
+    for(size_t c=0; c < numConns; c++) {
+        BatchConn* conn = &conns[c];
+        failed += conn->failed;
+        unanswered += conn->numOps - (conn->nextToFinish ? conn->nextToFinish : 1);
+        bytesIn += conn->bytesIn;
+        bytesOut += conn->bytesOut;
+        if(conn->sock >= 0)
+            close(conn->sock);
+        if(conn->putFile)
+            fclose(conn->putFile);
+        if(conn->getFile)
+            fclose(conn->getFile);
+        free(conn->ops);
+    }
+    double seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+    if(seconds <= 0)
+        seconds = 1e-9;
+    fprintf(stderr, "Batch finished: %zd operations, %zu failed, %zu unanswered\n", numOps - 1, failed, unanswered);
+    fprintf(stderr, "Transferred %.1f MB sent, %.1f MB received in %.3f s over %zu connections: "
+            "%.1f MB/s, %.0f ops/s\n", bytesOut / 1e6, bytesIn / 1e6, seconds, numConns,
+            (bytesIn + bytesOut) / 1e6 / seconds, (numOps - 1) / seconds);
+    int result = (failed || unanswered) ? 1 : 0;
+
+    for(ssize_t i=0; i < numOps; i++) {
+        free(ops[i].remote);
+        free(ops[i].local);
+    }
+    free(ops);
+    free(conns);
+    free(pfds);
+    return result;
+}
+
+// Load generator: each connection keeps one request in flight and records its latency by verb
+#define BENCH_MAX_SIZES 16
+#define BENCH_MAX_NAME 64
+
+typedef struct {
+    size_t size;
+    unsigned weight;
+} BenchSize;
+
+typedef struct {
+    size_t connections;
+    double seconds;
+    size_t filesPerConn;            // Files each connection PUTs before the clock starts and then works on
+    unsigned mix[LIST + 1];         // Weight of each verb, indexed GET..LIST
+    BenchSize sizes[BENCH_MAX_SIZES];
+    size_t numSizes;
+    char* payload;                  // Random bytes the PUTs are cut from, as large as the largest size
+} BenchConfig;
+
+typedef struct {
+    int sock;
+    unsigned seed;
+    size_t warmLeft;                // Files still to PUT before the timed run
+    bool busy;                      // A request is in flight
+    verb op;
+    struct timespec began;
+
+    char header[BENCH_MAX_NAME + 16 + sizeof(size_t)];
+    size_t headerLen;
+    size_t headerPos;
+    size_t putSize;
+    size_t putPos;
+
+    char in[BATCH_BUF_SIZE];
+    size_t inLen;
+    int responseState;
+    size_t bodyLeft;
+    bool failed;                    // The response in progress is an ERROR
+    bool missing;                   // ... and says the file does not exist
+} BenchConn;
+
+typedef struct {
+    histogram_t latency[LIST + 1];  // In nanoseconds
+    size_t requests[LIST + 1];
+    size_t errors[LIST + 1];
+    size_t missing;                 // GETs and DELETEs of a file another DELETE already removed
+    size_t bytesIn;
+    size_t bytesOut;
+    bool recording;
+} BenchStats;
+
+// "64", "4k", "1m" and "1g" are byte counts. Returns false if text is not one
+static bool parse_byte_count(const char* text, size_t* pSize) {
+    char* end = NULL;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if(errno || end == text)
+        return false;
+    switch(tolower((unsigned char)*end)) {
+        case 'g': value <<= 10; // fall through
+        case 'm': value <<= 10; // fall through
+        case 'k': value <<= 10; end++; break;
+        case '\0': break;
+        default: return false;
+    }
+    *pSize = value;
+    return *end == '\0';
+}
+
+// Parses "get=70,put=20,list=5,delete=5" into config->mix
+static bool parse_bench_mix(char* text, BenchConfig* config) {
+    memset(config->mix, 0, sizeof(config->mix));
+    for(char* item = strtok(text, ","); item; item = strtok(NULL, ",")) {
+        char* eq = strchr(item, '=');
+        if(eq == NULL)
+            return false;
+        *eq = '\0';
+        verb v = V_UNKNOWN;
+        for(verb i = GET; i <= LIST; i++)
+            if(!strcasecmp(item, verb_names[i]))
+                v = i;
+        if(v == V_UNKNOWN)
+            return false;
+        config->mix[v] = strtoul(eq + 1, NULL, 10);
+    }
+    return config->mix[GET] + config->mix[PUT] + config->mix[DELETE] + config->mix[LIST] > 0;
+}
+
+// Parses "4k:60,64k:30,1m:10", file sizes with their weights, into config->sizes
+static bool parse_bench_sizes(char* text, BenchConfig* config) {
+    config->numSizes = 0;
+    for(char* item = strtok(text, ","); item; item = strtok(NULL, ",")) {
+        if(config->numSizes == BENCH_MAX_SIZES)
+            return false;
+        BenchSize* size = &config->sizes[config->numSizes++];
+        char* colon = strchr(item, ':');
+        size->weight = 1;
+        if(colon) {
+            *colon = '\0';
+            size->weight = strtoul(colon + 1, NULL, 10);
+        }
+        if(!parse_byte_count(item, &size->size) || size->weight == 0)
+            return false;
+    }
+    return config->numSizes > 0;
+}
+
+static size_t bench_pick_size(BenchConfig* config, BenchConn* conn) {
+    unsigned total = 0;
+    for(size_t i=0; i < config->numSizes; i++)
+        total += config->sizes[i].weight;
+    unsigned pick = rand_r(&conn->seed) % total;
+    for(size_t i=0; i < config->numSizes; i++) {
+        if(pick < config->sizes[i].weight)
+            return config->sizes[i].size;
+        pick -= config->sizes[i].weight;
+    }
+    return config->sizes[0].size;
+}
+
+// Queue the next request on conn: the warm up PUTs first, then verbs drawn from the mix
+static void bench_start_request(BenchConfig* config, BenchConn* conn) {
+    size_t file;
+    if(conn->warmLeft > 0) {
+        conn->op = PUT;
+        file = --conn->warmLeft;
+    } else {
+        unsigned total = config->mix[GET] + config->mix[PUT] + config->mix[DELETE] + config->mix[LIST];
+        unsigned pick = rand_r(&conn->seed) % total;
+        conn->op = GET;
+        while(pick >= config->mix[conn->op]) {
+            pick -= config->mix[conn->op];
+            conn->op++;
+        }
+        file = rand_r(&conn->seed) % config->filesPerConn;
+    }
+
+    // Each connection works on files of its own, so its requests never race another connection's
+    if(conn->op == LIST)
+        conn->headerLen = sprintf(conn->header, "LIST\n");
+    else
+        conn->headerLen = sprintf(conn->header, "%s bench-%d-%d-%zu\n", verb_names[conn->op],
+                                  (int)getpid(), conn->sock, file);
+    conn->putSize = 0;
+    if(conn->op == PUT) {
+        conn->putSize = bench_pick_size(config, conn);
+        memcpy(&conn->header[conn->headerLen], &conn->putSize, sizeof(size_t));
+        conn->headerLen += sizeof(size_t);
+    }
+    conn->headerPos = 0;
+    conn->putPos = 0;
+    conn->responseState = RESPONSE_STATUS;
+    conn->failed = false;
+    conn->missing = false;
+    conn->busy = true;
+    clock_gettime(CLOCK_MONOTONIC, &conn->began);
+}
+
+static void bench_finish_request(BenchConn* conn, BenchStats* stats) {
+    conn->busy = false;
+    if(!stats->recording)
+        return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t elapsed = (int64_t)(now.tv_sec - conn->began.tv_sec) * 1000000000 + (now.tv_nsec - conn->began.tv_nsec);
+    histogram_record(&stats->latency[conn->op], elapsed > 0 ? (uint64_t)elapsed : 0);
+    stats->requests[conn->op]++;
+    if(conn->missing)
+        stats->missing++;
+    else if(conn->failed)
+        stats->errors[conn->op]++;
+}
+
+// Parse what has been received of the response in flight. Returns false if it is invalid
+static bool bench_parse_response(BenchConn* conn, BenchStats* stats) {
+    size_t pos = 0;
+    while(conn->busy && pos < conn->inLen) {
+        char* start = &conn->in[pos];
+        size_t available = conn->inLen - pos;
+        char* nl = NULL;
+        if(conn->responseState == RESPONSE_STATUS || conn->responseState == RESPONSE_ERROR_MESSAGE) {
+            nl = memchr(start, '\n', available);
+            if(nl == NULL)
+                break;
+        }
+
+        switch(conn->responseState) {
+            case RESPONSE_STATUS:
+                if(nl - start == 2 && !memcmp(start, "OK", 2)) {
+                    if(conn->op == GET || conn->op == LIST)
+                        conn->responseState = RESPONSE_SIZE;
+                    else
+                        bench_finish_request(conn, stats);
+                } else if(nl - start == 5 && !memcmp(start, "ERROR", 5)) {
+                    conn->failed = true;
+                    conn->responseState = RESPONSE_ERROR_MESSAGE;
+                } else {
+                    print_invalid_response();
+                    return false;
+                }
+                pos += nl - start + 1;
+                break;
+            case RESPONSE_ERROR_MESSAGE:
+                conn->missing = (size_t)(nl - start + 1) == strlen(err_no_such_file) &&
+                                !memcmp(start, err_no_such_file, nl - start);
+                pos += nl - start + 1;
+                bench_finish_request(conn, stats);
+                break;
+            case RESPONSE_SIZE:
+                if(available < sizeof(size_t)) {
+                    memmove(conn->in, start, available);
+                    conn->inLen = available;
+                    return true;
+                }
+                memcpy(&conn->bodyLeft, start, sizeof(size_t));
+                pos += sizeof(size_t);
+                conn->responseState = RESPONSE_BODY;
+                if(conn->bodyLeft == 0)
+                    bench_finish_request(conn, stats);
+                break;
+            case RESPONSE_BODY: {
+                // The payload itself is thrown away
+                size_t take = available < conn->bodyLeft ? available : conn->bodyLeft;
+                pos += take;
+                conn->bodyLeft -= take;
+                if(conn->bodyLeft == 0)
+                    bench_finish_request(conn, stats);
+                break;
+            }
+        }
+    }
+    if(pos < conn->inLen && !conn->busy) {
+        print_received_too_much_data();
+        return false;
+    }
+    memmove(conn->in, &conn->in[pos], conn->inLen - pos);
+    conn->inLen -= pos;
+    return true;
+}
+
+static bool bench_service(BenchConfig* config, BenchConn* conn, BenchStats* stats, short revents) {
+    if(revents & POLLOUT) {
+        ssize_t count = 0;
+        if(conn->headerPos < conn->headerLen) {
+            count = send(conn->sock, &conn->header[conn->headerPos], conn->headerLen - conn->headerPos,
+                         MSG_NOSIGNAL | (conn->putSize > 0 ? MSG_MORE : 0));
+            if(count > 0)
+                conn->headerPos += count;
+        } else if(conn->putPos < conn->putSize) {
+            count = send(conn->sock, &config->payload[conn->putPos], conn->putSize - conn->putPos, MSG_NOSIGNAL);
+            if(count > 0)
+                conn->putPos += count;
+        }
+        if(count == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            print_connection_closed();
+            return false;
+        }
+        if(count > 0)
+            stats->bytesOut += count;
+    }
+
+    if(revents & (POLLIN | POLLHUP | POLLERR)) {
+        ssize_t count = recv(conn->sock, &conn->in[conn->inLen], BATCH_BUF_SIZE - conn->inLen, 0);
+        if(count == 0 || (count == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            print_connection_closed();
+            return false;
+        }
+        if(count > 0) {
+            conn->inLen += count;
+            stats->bytesIn += count;
+            return bench_parse_response(conn, stats);
+        }
+    }
+    return true;
+}
+
+/**
+ * Drives the connections until every one has drained its requests. With a deadline new requests keep being
+ * started until it passes, without one only the warm up PUTs are sent. Returns the connections still usable.
+ */
+static size_t bench_drive(BenchConfig* config, BenchConn* conns, struct pollfd* pfds, BenchStats* stats,
+                          struct timespec* deadline) {
+    size_t live = 0;
+    for(size_t c=0; c < config->connections; c++)
+        if(conns[c].sock >= 0)
+            live++;
+
+    while(live > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        bool more = deadline && (now.tv_sec < deadline->tv_sec ||
+                                 (now.tv_sec == deadline->tv_sec && now.tv_nsec < deadline->tv_nsec));
+        size_t waiting = 0;
+        for(size_t c=0; c < config->connections; c++) {
+            BenchConn* conn = &conns[c];
+            pfds[c].fd = -1;
+            pfds[c].events = 0;
+            if(conn->sock < 0)
+                continue;
+            if(!conn->busy && (conn->warmLeft > 0 || more))
+                bench_start_request(config, conn);
+            if(!conn->busy)
+                continue;
+            pfds[c].fd = conn->sock;
+            pfds[c].events = POLLIN | (conn->headerPos < conn->headerLen || conn->putPos < conn->putSize ? POLLOUT : 0);
+            waiting++;
+        }
+        if(waiting == 0)
+            break;
+
+        // Wake up at least every 100ms to notice the deadline
+        if(poll(pfds, config->connections, 100) == -1) {
+            if(errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        for(size_t c=0; c < config->connections; c++) {
+            if(pfds[c].fd < 0 || pfds[c].revents == 0)
+                continue;
+            if(!bench_service(config, &conns[c], stats, pfds[c].revents)) {
+                close(conns[c].sock);
+                conns[c].sock = -1;
+                live--;
+            }
+        }
+    }
+    return live;
+}
+
+static void bench_report(BenchConfig* config, BenchStats* stats, double seconds) {
+    size_t requests = 0, errors = 0;
+    for(verb v = GET; v <= LIST; v++) {
+        requests += stats->requests[v];
+        errors += stats->errors[v];
+    }
+    printf("%zu requests in %.3f s over %zu connections: %.0f req/s, %.1f MB/s (%.1f MB sent, %.1f MB received)\n",
+           requests, seconds, config->connections, requests / seconds, (stats->bytesIn + stats->bytesOut) / 1e6 / seconds,
+           stats->bytesOut / 1e6, stats->bytesIn / 1e6);
+    printf("%zu errors, %zu requests for files already deleted\n", errors, stats->missing);
+    printf("%-7s %10s %8s %10s %10s %10s %10s %10s\n", "verb", "requests", "errors",
+           "mean us", "p50 us", "p99 us", "p999 us", "max us");
+    for(verb v = GET; v <= LIST; v++) {
+        histogram_t* h = &stats->latency[v];
+        if(histogram_count(h) == 0)
+            continue;
+        printf("%-7s %10zu %8zu %10.1f %10.1f %10.1f %10.1f %10.1f\n", verb_names[v], stats->requests[v],
+               stats->errors[v], histogram_mean(h) / 1e3, histogram_quantile(h, 0.5) / 1e3,
+               histogram_quantile(h, 0.99) / 1e3, histogram_quantile(h, 0.999) / 1e3, histogram_max(h) / 1e3);
+    }
+}
+
+/**
+ * Benchmarks the server with a closed loop of requests over concurrent persistent connections:
+ *   BENCH [-c connections] [-d seconds] [-f files per connection] [-m get=70,put=20,delete=5,list=5]
+ *         [-s 4k:60,64k:30,1m:10]
+ * Every connection first PUTs its files, then for the given time keeps sending requests drawn from the mix,
+ * with PUT sizes drawn from the weighted sizes. Prints req/s, MB/s and latency percentiles per verb.
+ */
+int run_bench(char* host, int port, int argc, char** argv) {
+    BenchConfig config;
+    memset(&config, 0, sizeof(config));
+    config.connections = 16;
+    config.seconds = 10;
+    config.filesPerConn = 8;
+    char defaultMix[] = "get=70,put=20,delete=5,list=5";
+    char defaultSizes[] = "4k:60,64k:30,1m:10";
+    char* mix = defaultMix;
+    char* sizes = defaultSizes;
+
+    int opt;
+    optind = 1;
+    while((opt = getopt(argc, argv, "c:d:f:m:s:")) != -1) {
+        switch(opt) {
+            case 'c': config.connections = strtoul(optarg, NULL, 10); break;
+            case 'd': config.seconds = atof(optarg); break;
+            case 'f': config.filesPerConn = strtoul(optarg, NULL, 10); break;
+            case 'm': mix = optarg; break;
+            case 's': sizes = optarg; break;
+            default:
+                fprintf(stderr, "./client <host>:<port> BENCH [-c connections] [-d seconds] [-f files] "
+                        "[-m get=70,put=20,delete=5,list=5] [-s 4k:60,64k:30,1m:10]\n");
+                return 1;
+        }
+    }
+    if(!parse_bench_mix(mix, &config) || !parse_bench_sizes(sizes, &config) ||
+       config.connections < 1 || config.filesPerConn < 1 || config.seconds <= 0) {
+        fprintf(stderr, "Invalid benchmark options\n");
+        return 1;
+    }
+
+    size_t largest = 0;
+    for(size_t i=0; i < config.numSizes; i++)
+        if(config.sizes[i].size > largest)
+            largest = config.sizes[i].size;
+    config.payload = malloc(largest > 0 ? largest : 1);
+    if(config.payload == NULL) {
+        print_error_message("malloc failed");
+        return 1;
+    }
+    unsigned seed = time(NULL);
+    for(size_t i=0; i < largest; i++)
+        config.payload[i] = rand_r(&seed);
+
+    BenchConn* conns = calloc(config.connections, sizeof(BenchConn));
+    struct pollfd* pfds = calloc(config.connections, sizeof(struct pollfd));
+    BenchStats* stats = calloc(1, sizeof(BenchStats));
+    for(size_t c=0; c < config.connections; c++) {
+        BenchConn* conn = &conns[c];
+        conn->sock = connect_to_server(host, port);
+        if(conn->sock < 0)
+            continue;
+        conn->seed = seed + c;
+        conn->warmLeft = config.filesPerConn;
+        // The server keeps a connection open once it has seen KEEPALIVE
+        send_all("KEEPALIVE\n", 10, conn->sock);
+        char ok[3];
+        if(recv(conn->sock, ok, 3, MSG_WAITALL) != 3 || memcmp(ok, "OK\n", 3)) {
+            fprintf(stderr, "Server refused KEEPALIVE\n");
+            close(conn->sock);
+            conn->sock = -1;
+            continue;
+        }
+        fcntl(conn->sock, F_SETFL, fcntl(conn->sock, F_GETFL, 0) | O_NONBLOCK);
+    }
+
+    fprintf(stderr, "Warming up with %zu files per connection\n", config.filesPerConn);
+    bench_drive(&config, conns, pfds, stats, NULL);
+
+    memset(stats, 0, sizeof(*stats));
+    stats->recording = true;
+    struct timespec started, finished, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    deadline = started;
+    deadline.tv_sec += (time_t)config.seconds;
+    deadline.tv_nsec += (long)((config.seconds - (time_t)config.seconds) * 1e9);
+    if(deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    size_t live = bench_drive(&config, conns, pfds, stats, &deadline);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+
+    double seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+    bench_report(&config, stats, seconds > 0 ? seconds : 1e-9);
+    int result = live == config.connections ? 0 : 1;
+    if(result)
+        fprintf(stderr, "%zu connections were lost\n", config.connections - live);
+
+    for(size_t c=0; c < config.connections; c++)
+        if(conns[c].sock >= 0)
+            close(conns[c].sock);
+    free(config.payload);
+    free(conns);
+    free(pfds);
+    free(stats);
+    return result;
+}
+
+/**
+ * Asks the server how much of an interrupted upload of remote it kept, on a connection of its own.
+ * Returns 0 if there is nothing to resume from
+ */
+static size_t query_partial(char* host, int port, char* remote) {
+    int sock = connect_to_server(host, port);
+    if(sock < 0)
+        exit(1);
+    char buffer[MAX_BUF_SIZE];
+    int len = snprintf(buffer, sizeof(buffer), "PARTIAL %s\n", remote);
+    send_all(buffer, len, sock);
+    shutdown(sock, SHUT_WR);
+
+    size_t have = 0;
+    ssize_t count;
+    while(have < 3 + sizeof(size_t) &&
+          ((count = read(sock, &buffer[have], sizeof(buffer) - have)) > 0 || (count == -1 && errno == EINTR)))
+        if(count > 0)
+            have += count;
+    close(sock);
+
+    size_t size = 0;
+    if(have >= 3 + sizeof(size_t) && !memcmp(buffer, "OK\n", 3))
+        memcpy(&size, &buffer[3], sizeof(size_t));
+    return size;
+}
+
+int main(int argc, char **argv) {
+    char *host = strtok(argv[1], ":");
+    char *strport = strtok(NULL, ":");
+
+    signal(SIGPIPE, handle_sigpipe);
+    
+    if (strport == NULL) {
+        print_client_help();
+        return -1;
+    }
+    int port = atoi(strport);
+    if(argc > 2 && !strcmp(argv[2], "BATCH")) {
+        if(argc < 4) {
+            fprintf(stderr, "./client <host>:<port> BATCH <manifest|-> [connections]\n");
+            return 1;
+        }
+        return run_batch(host, port, argv[3], argc > 4 ? strtoul(argv[4], NULL, 10) : 1);
+    }
+    if(argc > 2 && !strcmp(argv[2], "BENCH"))
+        return run_bench(host, port, argc - 2, argv + 2);
+    char* verb_as_char = argv[2];
+    verb _verb = check_args(argv);
+    char* firstFile = NULL;
+    char* secondFile = NULL;
+    if(argc > 3){
+        firstFile = argv[3];
+        secondFile = argv[3];
+    }
+    if(argc > 4){
+        secondFile = argv[4];
+    }
+    // After the local file, GET and PUT take --resume to pick up an interrupted transfer,
+    // or --compress to send the payload compressed
+    bool resume = false, compress = false;
+    for(int i=5; i < argc && (_verb == GET || _verb == PUT); i++) {
+        if(!strcmp(argv[i], "--resume")) {
+            resume = true;
+        } else if(!strcmp(argv[i], "--compress")) {
+            compress = true;
+        } else {
+            print_client_help();
+            exit(1);
+        }
+    }
+    if(resume && compress) {
+        fprintf(stderr, "--resume and --compress can't be combined\n");
+        exit(1);
+    }
+    // LIST takes --prefix, --limit and --cursor to ask for one page of the listing with LISTPAGE
+    char* prefix = "";
+    size_t limit = 0, cursor = 0;
+    bool paged = false;
+    for(int i=3; i < argc && _verb == LIST; i += 2) {
+        if(i + 1 == argc) {
+            print_client_help();
+            exit(1);
+        }
+        if(!strcmp(argv[i], "--prefix"))
+            prefix = argv[i + 1];
+        else if(!strcmp(argv[i], "--limit"))
+            limit = strtoull(argv[i + 1], NULL, 10);
+        else if(!strcmp(argv[i], "--cursor"))
+            cursor = strtoull(argv[i + 1], NULL, 10);
+        else {
+            print_client_help();
+            exit(1);
+        }
+        paged = true;
+    }
+
+    char buffer[MAX_BUF_SIZE] = {0};
+    off_t start = 0;
+    int len = 0;
+    if(resume && _verb == GET) {
+        // Only the bytes past what the local file already holds are fetched
+        struct stat file_info;
+        if(stat(secondFile, &file_info) == 0)
+            start = file_info.st_size;
+        len = snprintf(buffer, sizeof(buffer), "GETRANGE %lld 0 %s\n", (long long)start, firstFile);
+    } else if(resume && _verb == PUT) {
+        struct stat file_info;
+        start = query_partial(host, port, firstFile);
+        if(stat(secondFile, &file_info) == -1 || start > file_info.st_size)
+            start = 0;
+        fprintf(stderr, "Resuming upload at %lld\n", (long long)start);
+        len = snprintf(buffer, sizeof(buffer), "PUTFROM %lld %s\n", (long long)start, firstFile);
+    } else if(compress) {
+        len = snprintf(buffer, sizeof(buffer), "%s %s\n", verb_names[_verb == GET ? GETZ : PUTZ], firstFile);
+    } else if(paged) {
+        len = snprintf(buffer, sizeof(buffer), "LISTPAGE %zu %zu %s\n", cursor, limit, prefix);
+    } else {
+        create_message(buffer, verb_as_char, firstFile);
+    }
+    if(len < 0 || (size_t)len >= sizeof(buffer)) {
+        fprintf(stderr, "Request line too long\n");
+        exit(1);
+    }
+
+    int sock = connect_to_server(host, port);
+    if (sock < 0)
+        return -1;
+
+    if(_verb == PUT && compress){
+        send_file_compressed(secondFile, sock, buffer, strlen(buffer));
+    } else if(_verb == PUT){
+        send_file(secondFile, sock, buffer, strlen(buffer), start);
+    } else {
+        send_all(buffer, strlen(buffer), sock);
     }
 
     if ( shutdown(sock, 1) == -1 )
@@ -462,7 +1765,11 @@ int main(int argc, char **argv) {
         return -1;
     }
 
-    if(_verb == LIST) {
+    if(paged) {
+        handle_listpage_response(buffer, recvCount, sock);
+        exit(0);
+    }
+    if(_verb == LIST || _verb == STATS) {
         handle_list_response(buffer, recvCount, sock);
         exit(0);
     }
@@ -472,7 +1779,7 @@ int main(int argc, char **argv) {
         exit(0);
     }
     if(_verb == GET) {
-        handle_get_response(buffer, recvCount, sock, secondFile);
+        handle_get_response(buffer, recvCount, sock, secondFile, start, compress);
         exit(0);
     }
     if(_verb == PUT) {
@@ -505,6 +1812,10 @@ verb check_args(char **args) {
         return LIST;
     }
 
+    if (strcmp(command, "STATS") == 0) {
+        return STATS;
+    }
+
     if (strcmp(command, "GET") == 0) {
         if (args[3] != NULL) {
             return GET;
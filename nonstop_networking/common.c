@@ -1,5 +1,12 @@
 #include "common.h"
 
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <unistd.h>
+
 
 //------------------------------------------------------------------------------
 /*
@@ -26,17 +33,32 @@ void hashtable_ts_init (my_hash_table_t * hashtblP,
   for (i = 0; i < HASH_TABLE_SIZE; i++) {
     hashtblP->nodes[i]=NULL;
   }
+  for (i = 0; i < HASH_TABLE_LOCK_STRIPES; i++)
+    pthread_mutex_init(&hashtblP->locks[i], NULL);
 
   hashtblP->name = strdup(tablename);
 }
 
+//------------------------------------------------------------------------------
+/*
+   Each bucket is guarded by one of a set of striped mutexes, so threads working on different sockets rarely
+   wait for each other. The data pointers handed out are not protected, that is up to the caller.
+*/
+static pthread_mutex_t *hashtable_ts_lock (my_hash_table_t * hashtblP, uint32_t hash)
+{
+  pthread_mutex_t *lock = &hashtblP->locks[hash % HASH_TABLE_LOCK_STRIPES];
+
+  pthread_mutex_lock(lock);
+  return lock;
+}
+
 //------------------------------------------------------------------------------
 /*
    Adding a new element
    To make sure the hash value is not bigger than size, the result of the user provided hash function is used modulo size.
 */
-hashtable_rc_t
-hashtable_ts_insert (
+static hashtable_rc_t
+hashtable_insert_unlocked (
   my_hash_table_t * hashtblP,
   uint32_t keyP,
   void *dataP)
@@ -82,7 +104,7 @@ hashtable_ts_insert (
   }
 
   hashtblP->nodes[hash] = node;
-  hashtblP->num_elements++;
+  __atomic_add_fetch(&hashtblP->num_elements, 1, __ATOMIC_RELAXED);
   //printf("%s(key 0x%x data %p) next %p return HASH_TABLE_OK\n", __FUNCTION__, keyP, dataP, node->next);
   return HASH_TABLE_OK;
 }
@@ -92,8 +114,8 @@ hashtable_ts_insert (
    To free_wrapper an element from the hash table, we just search for it in the linked list for that hash value,
    and free_wrapper it if it is found. If it was not found, it is an error and -1 is returned.
 */
-hashtable_rc_t
-hashtable_ts_free (
+static hashtable_rc_t
+hashtable_free_unlocked (
   my_hash_table_t * hashtblP,
   const uint32_t keyP)
 {
@@ -123,7 +145,7 @@ hashtable_ts_free (
 //      printf("%s, %d, free(node);\n", __FILE__, __LINE__);
       free(node);
       node=NULL;
-      hashtblP->num_elements--;
+      __atomic_sub_fetch(&hashtblP->num_elements, 1, __ATOMIC_RELAXED);
       //printf("%s(key 0x%x) return OK\n", __FUNCTION__, keyP);
       return HASH_TABLE_OK;
     }
@@ -141,8 +163,8 @@ hashtable_ts_free (
    Searching for an element is easy. We just search through the linked list for the corresponding hash value.
    NULL is returned if we didn't find it.
 */
-hashtable_rc_t
-hashtable_ts_get (
+static hashtable_rc_t
+hashtable_get_unlocked (
   my_hash_table_t * hashtblP,
   const uint32_t keyP,
   void **dataP)
@@ -173,3 +195,1179 @@ hashtable_ts_get (
 
   return HASH_TABLE_KEY_NOT_EXISTS;
 }
+
+//------------------------------------------------------------------------------
+/*
+   Removing an element without freeing it. The node is unlinked and the data is handed back to the caller,
+   which is then responsible for it (the server uses this to recycle sessions).
+*/
+static hashtable_rc_t
+hashtable_remove_unlocked (
+  my_hash_table_t * hashtblP,
+  const uint32_t keyP,
+  void **dataP)
+{
+  my_hash_node_t                     *node,
+                                         *prevnode = NULL;
+  uint32_t                                 hash = 0;
+
+  *dataP = NULL;
+  if (!hashtblP) {
+    return HASH_TABLE_BAD_PARAMETER_HASHTABLE;
+  }
+
+  hash = hashtblP->hashfunc(keyP);
+  node = hashtblP->nodes[hash];
+
+  while (node) {
+    if (node->key == keyP) {
+      if (prevnode)
+        prevnode->next = node->next;
+      else
+        hashtblP->nodes[hash] = node->next;
+
+      *dataP = node->data;
+      free(node);
+      __atomic_sub_fetch(&hashtblP->num_elements, 1, __ATOMIC_RELAXED);
+      return HASH_TABLE_OK;
+    }
+
+    prevnode = node;
+    node = node->next;
+  }
+
+  return HASH_TABLE_KEY_NOT_EXISTS;
+}
+
+//------------------------------------------------------------------------------
+// The public operations take the bucket's stripe lock around the unlocked ones above
+
+hashtable_rc_t hashtable_ts_insert (my_hash_table_t * hashtblP, uint32_t keyP, void *dataP)
+{
+  if (!hashtblP)
+    return HASH_TABLE_BAD_PARAMETER_HASHTABLE;
+
+  pthread_mutex_t *lock = hashtable_ts_lock(hashtblP, hashtblP->hashfunc(keyP));
+  hashtable_rc_t rc = hashtable_insert_unlocked(hashtblP, keyP, dataP);
+  pthread_mutex_unlock(lock);
+  return rc;
+}
+
+hashtable_rc_t hashtable_ts_free (my_hash_table_t * hashtblP, const uint32_t keyP)
+{
+  if (!hashtblP)
+    return HASH_TABLE_BAD_PARAMETER_HASHTABLE;
+
+  pthread_mutex_t *lock = hashtable_ts_lock(hashtblP, hashtblP->hashfunc(keyP));
+  hashtable_rc_t rc = hashtable_free_unlocked(hashtblP, keyP);
+  pthread_mutex_unlock(lock);
+  return rc;
+}
+
+hashtable_rc_t hashtable_ts_get (my_hash_table_t * hashtblP, const uint32_t keyP, void **dataP)
+{
+  *dataP = NULL;
+  if (!hashtblP)
+    return HASH_TABLE_BAD_PARAMETER_HASHTABLE;
+
+  pthread_mutex_t *lock = hashtable_ts_lock(hashtblP, hashtblP->hashfunc(keyP));
+  hashtable_rc_t rc = hashtable_get_unlocked(hashtblP, keyP, dataP);
+  pthread_mutex_unlock(lock);
+  return rc;
+}
+
+hashtable_rc_t hashtable_ts_remove (my_hash_table_t * hashtblP, const uint32_t keyP, void **dataP)
+{
+  *dataP = NULL;
+  if (!hashtblP)
+    return HASH_TABLE_BAD_PARAMETER_HASHTABLE;
+
+  pthread_mutex_t *lock = hashtable_ts_lock(hashtblP, hashtblP->hashfunc(keyP));
+  hashtable_rc_t rc = hashtable_remove_unlocked(hashtblP, keyP, dataP);
+  pthread_mutex_unlock(lock);
+  return rc;
+}
+
+//------------------------------------------------------------------------------
+/*
+   File catalog
+   Entries live in a dense array so LIST can walk them without touching the index. The index is a linear probing
+   table of entry positions; removal uses backward shifting so no tombstones are left behind.
+   An entry's home slot is taken from the top bits of its hash, so walking the slots visits the entries in hash
+   order, whatever the table size. catalog_scan uses that for cursors that survive inserts, removals and growth.
+*/
+#define CATALOG_INITIAL_SLOTS 64
+
+static uint32_t catalog_hash (const char *nameP)
+{
+  uint32_t hash = 2166136261u;   // FNV-1a
+
+  while (*nameP) {
+    hash ^= (unsigned char)*nameP++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+void catalog_init (catalog_t * catalogP)
+{
+  memset(catalogP, 0, sizeof(*catalogP));
+}
+
+void catalog_destroy (catalog_t * catalogP)
+{
+  for (size_t i = 0; i < catalogP->num_entries; i++)
+    free(catalogP->entries[i].name);
+  free(catalogP->entries);
+  free(catalogP->slots);
+  memset(catalogP, 0, sizeof(*catalogP));
+}
+
+static size_t catalog_home (catalog_t * catalogP, uint32_t hash)
+{
+  return hash >> (32 - __builtin_ctzl(catalogP->num_slots));
+}
+
+// Returns the slot holding nameP, or the empty slot where it would go
+static size_t catalog_probe (catalog_t * catalogP, const char *nameP, uint32_t hash)
+{
+  size_t mask = catalogP->num_slots - 1;
+  size_t slot = catalog_home(catalogP, hash);
+
+  while (catalogP->slots[slot]) {
+    catalog_entry_t *entry = &catalogP->entries[catalogP->slots[slot] - 1];
+    if (entry->hash == hash && !strcmp(entry->name, nameP))
+      break;
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+static int catalog_rehash (catalog_t * catalogP, size_t num_slots)
+{
+  uint32_t *slots = calloc(num_slots, sizeof(uint32_t));
+
+  if (!slots)
+    return -1;
+
+  free(catalogP->slots);
+  catalogP->slots = slots;
+  catalogP->num_slots = num_slots;
+  for (size_t i = 0; i < catalogP->num_entries; i++) {
+    size_t slot = catalog_probe(catalogP, catalogP->entries[i].name, catalogP->entries[i].hash);
+    catalogP->slots[slot] = i + 1;
+  }
+  return 0;
+}
+
+catalog_entry_t *catalog_find (catalog_t * catalogP, const char *nameP)
+{
+  if (!catalogP->num_entries)
+    return NULL;
+
+  size_t slot = catalog_probe(catalogP, nameP, catalog_hash(nameP));
+  if (!catalogP->slots[slot])
+    return NULL;
+  return &catalogP->entries[catalogP->slots[slot] - 1];
+}
+
+/*
+   Insert nameP, or update the metadata if it is already in the catalog. Returns NULL if memory ran out.
+*/
+catalog_entry_t *catalog_put (catalog_t * catalogP, const char *nameP,
+    size_t sizeP, time_t mtimeP)
+{
+  // Keep the load factor at or below one half
+  if ((catalogP->num_entries + 1) * 2 > catalogP->num_slots) {
+    size_t num_slots = catalogP->num_slots ? catalogP->num_slots * 2 : CATALOG_INITIAL_SLOTS;
+    if (catalog_rehash(catalogP, num_slots))
+      return NULL;
+  }
+
+  uint32_t hash = catalog_hash(nameP);
+  size_t slot = catalog_probe(catalogP, nameP, hash);
+  catalog_entry_t *entry;
+
+  if (catalogP->slots[slot]) {
+    entry = &catalogP->entries[catalogP->slots[slot] - 1];
+  } else {
+    if (catalogP->num_entries == catalogP->entries_cap) {
+      size_t cap = catalogP->entries_cap ? catalogP->entries_cap * 2 : CATALOG_INITIAL_SLOTS;
+      catalog_entry_t *entries = realloc(catalogP->entries, cap * sizeof(catalog_entry_t));
+      if (!entries)
+        return NULL;
+      catalogP->entries = entries;
+      catalogP->entries_cap = cap;
+    }
+    char *name = strdup(nameP);
+    if (!name)
+      return NULL;
+
+    entry = &catalogP->entries[catalogP->num_entries];
+    entry->name = name;
+    entry->hash = hash;
+    entry->cache = NULL;
+    entry->index = 0;
+    entry->blob = NULL;
+    catalogP->slots[slot] = ++catalogP->num_entries;
+  }
+
+  entry->size = sizeP;
+  entry->mtime = mtimeP;
+  return entry;
+}
+
+hashtable_rc_t catalog_remove (catalog_t * catalogP, const char *nameP)
+{
+  if (!catalogP->num_entries)
+    return HASH_TABLE_KEY_NOT_EXISTS;
+
+  size_t mask = catalogP->num_slots - 1;
+  size_t slot = catalog_probe(catalogP, nameP, catalog_hash(nameP));
+  if (!catalogP->slots[slot])
+    return HASH_TABLE_KEY_NOT_EXISTS;
+
+  size_t index = catalogP->slots[slot] - 1;
+  free(catalogP->entries[index].name);
+
+  // Backward shift the rest of the probe run into the hole
+  size_t hole = slot;
+  size_t next = (hole + 1) & mask;
+  while (catalogP->slots[next]) {
+    size_t home = catalog_home(catalogP, catalogP->entries[catalogP->slots[next] - 1].hash);
+    if (((next - home) & mask) >= ((next - hole) & mask)) {
+      catalogP->slots[hole] = catalogP->slots[next];
+      hole = next;
+    }
+    next = (next + 1) & mask;
+  }
+  catalogP->slots[hole] = 0;
+
+  // Move the last entry into the freed position of the dense array
+  size_t last = catalogP->num_entries - 1;
+  if (index != last) {
+    catalogP->entries[index] = catalogP->entries[last];
+    size_t moved = catalog_probe(catalogP, catalogP->entries[index].name, catalogP->entries[index].hash);
+    catalogP->slots[moved] = index + 1;
+  }
+  catalogP->num_entries--;
+  return HASH_TABLE_OK;
+}
+
+size_t catalog_size (catalog_t * catalogP)
+{
+  return catalogP->num_entries;
+}
+
+catalog_entry_t *catalog_at (catalog_t * catalogP, size_t indexP)
+{
+  return &catalogP->entries[indexP];
+}
+
+/*
+   Call visitP for the entries whose hash is at or after cursorP and in the same home slot, then return the cursor
+   of the next slot. Start at 0 and call again with the returned cursor until it is CATALOG_SCAN_END. Every entry
+   that is in the catalog for the whole scan is visited exactly once, even if others are added or removed or the
+   table grows between calls. visitP must not change the catalog.
+*/
+uint64_t catalog_scan (catalog_t * catalogP, uint64_t cursorP,
+    void (*visitP) (catalog_entry_t *, void *), void *argP)
+{
+  if (!catalogP->num_entries || cursorP >= CATALOG_SCAN_END)
+    return CATALOG_SCAN_END;
+
+  size_t mask = catalogP->num_slots - 1;
+  unsigned shift = 32 - __builtin_ctzl(catalogP->num_slots);
+  size_t home = cursorP >> shift;
+
+  // Entries for this home sit in the probe run that starts there, the run ends at the first empty slot
+  for (size_t slot = home; catalogP->slots[slot]; slot = (slot + 1) & mask) {
+    catalog_entry_t *entry = &catalogP->entries[catalogP->slots[slot] - 1];
+    if (catalog_home(catalogP, entry->hash) == home && entry->hash >= cursorP)
+      visitP(entry, argP);
+  }
+  return (uint64_t)(home + 1) << shift;
+}
+
+
+//------------------------------------------------------------------------------
+/*
+   Sharded catalog
+   A name lives in the shard picked by the low bits of its hash, the catalog in there uses the top bits, so the
+   shards spread evenly. Adding or removing a name is reported to the snapshots being read while the shard is
+   still write locked. A snapshot that has not walked past the name yet records whether it was stored before, the
+   first time it changes. The walk skips recorded names and sends the ones that were stored at the end, so it sees
+   the catalog as it was when the snapshot was taken, while only holding one shard's read lock at a time for a
+   bufferful of names. The records take memory in proportion to the changes made during the walk, not the
+   catalog size.
+*/
+struct catalog_snapshot_s {
+  sharded_catalog_t *owner;
+  catalog_snapshot_t *next;
+  pthread_mutex_t lock;         // Guards changed and the walk position
+  catalog_t changed;            // Names changed ahead of the walk, size is 1 if the name was stored at the snapshot
+  bool failed;                  // A change could not be recorded, the snapshot is no longer consistent
+  unsigned shard;               // Walk position: the shard and the catalog_scan cursor in it
+  uint64_t cursor;
+  size_t tail;                  // Once every shard is done, the next entry of changed to send
+};
+
+// Gathers "name\n" lines for sharded_catalog_list and catalog_snapshot_read
+typedef struct {
+  char *buffer;
+  size_t size;
+  size_t used;
+  const char *prefix;
+  size_t prefix_len;
+  size_t count;                 // Names gathered
+  catalog_t *skip;              // Names to leave out, NULL for none
+  bool full;                    // A name did not fit
+} catalog_fill_t;
+
+static void catalog_fill_visit (catalog_entry_t * entryP, void *argP)
+{
+  catalog_fill_t *fill = argP;
+
+  if (fill->full || strncmp(entryP->name, fill->prefix, fill->prefix_len))
+    return;
+  if (fill->skip && catalog_find(fill->skip, entryP->name))
+    return;
+
+  size_t len = strlen(entryP->name);
+  if (fill->used + len + 1 > fill->size) {
+    fill->full = true;
+    return;
+  }
+  memcpy(&fill->buffer[fill->used], entryP->name, len);
+  fill->buffer[fill->used + len] = '\n';
+  fill->used += len + 1;
+  fill->count++;
+}
+
+// Walk shardP from *cursorP into fill a whole home slot at a time, while the slots fit and limitP allows
+static void catalog_fill_shard (catalog_shard_t * shardP, uint64_t * cursorP, catalog_fill_t * fill, size_t limitP)
+{
+  while (*cursorP != CATALOG_SCAN_END && (limitP == 0 || fill->count < limitP)) {
+    size_t used = fill->used;
+    size_t count = fill->count;
+    uint64_t next = catalog_scan(&shardP->catalog, *cursorP, catalog_fill_visit, fill);
+    if (fill->full) {
+      fill->used = used;
+      fill->count = count;
+      return;
+    }
+    *cursorP = next;
+  }
+}
+
+void sharded_catalog_init (sharded_catalog_t * catalogP)
+{
+  memset(catalogP, 0, sizeof(*catalogP));
+  for (unsigned i = 0; i < CATALOG_SHARDS; i++) {
+    catalog_shard_t *shard = &catalogP->shards[i];
+    pthread_rwlock_init(&shard->lock, NULL);
+    catalog_init(&shard->catalog);
+    shard->index = i;
+    shard->owner = catalogP;
+  }
+  pthread_rwlock_init(&catalogP->snapshots_lock, NULL);
+}
+
+void sharded_catalog_destroy (sharded_catalog_t * catalogP)
+{
+  for (unsigned i = 0; i < CATALOG_SHARDS; i++) {
+    catalog_destroy(&catalogP->shards[i].catalog);
+    pthread_rwlock_destroy(&catalogP->shards[i].lock);
+  }
+  pthread_rwlock_destroy(&catalogP->snapshots_lock);
+}
+
+void catalog_shard_lock (catalog_shard_t * shardP, bool writeP)
+{
+  if (writeP)
+    pthread_rwlock_wrlock(&shardP->lock);
+  else
+    pthread_rwlock_rdlock(&shardP->lock);
+}
+
+void catalog_shard_unlock (catalog_shard_t * shardP)
+{
+  pthread_rwlock_unlock(&shardP->lock);
+}
+
+// Lock and return the shard nameP belongs in
+catalog_shard_t *sharded_catalog_lock (sharded_catalog_t * catalogP, const char *nameP, bool writeP)
+{
+  catalog_shard_t *shard = &catalogP->shards[catalog_hash(nameP) & (CATALOG_SHARDS - 1)];
+
+  catalog_shard_lock(shard, writeP);
+  return shard;
+}
+
+// Called with shardP write locked, once nameP has been added to it or removed from it
+static void catalog_shard_changed (catalog_shard_t * shardP, const char *nameP, bool storedP)
+{
+  sharded_catalog_t *owner = shardP->owner;
+  uint32_t hash = catalog_hash(nameP);
+
+  pthread_rwlock_rdlock(&owner->snapshots_lock);
+  if (storedP)
+    shardP->name_bytes -= strlen(nameP) + 1;
+  else
+    shardP->name_bytes += strlen(nameP) + 1;
+  for (catalog_snapshot_t *snapshot = owner->snapshots; snapshot; snapshot = snapshot->next) {
+    pthread_mutex_lock(&snapshot->lock);
+    bool passed = snapshot->shard > shardP->index || (snapshot->shard == shardP->index && hash < snapshot->cursor);
+    if (!passed && !catalog_find(&snapshot->changed, nameP) && !catalog_put(&snapshot->changed, nameP, storedP, 0))
+      snapshot->failed = true;
+    pthread_mutex_unlock(&snapshot->lock);
+  }
+  pthread_rwlock_unlock(&owner->snapshots_lock);
+}
+
+/*
+   catalog_put for a write locked shard. Commits to one name are serialized by the lock, so of two PUTs racing
+   for a name the one that commits last wins.
+*/
+catalog_entry_t *catalog_shard_put (catalog_shard_t * shardP, const char *nameP,
+    size_t sizeP, time_t mtimeP)
+{
+  size_t before = catalog_size(&shardP->catalog);
+  catalog_entry_t *entry = catalog_put(&shardP->catalog, nameP, sizeP, mtimeP);
+
+  if (entry && catalog_size(&shardP->catalog) != before)
+    catalog_shard_changed(shardP, nameP, false);
+  return entry;
+}
+
+// catalog_remove for a write locked shard
+hashtable_rc_t catalog_shard_remove (catalog_shard_t * shardP, const char *nameP)
+{
+  hashtable_rc_t rc = catalog_remove(&shardP->catalog, nameP);
+
+  if (rc == HASH_TABLE_OK)
+    catalog_shard_changed(shardP, nameP, true);
+  return rc;
+}
+
+size_t sharded_catalog_size (sharded_catalog_t * catalogP)
+{
+  size_t size = 0;
+
+  for (unsigned i = 0; i < CATALOG_SHARDS; i++) {
+    catalog_shard_lock(&catalogP->shards[i], false);
+    size += catalog_size(&catalogP->shards[i].catalog);
+    catalog_shard_unlock(&catalogP->shards[i]);
+  }
+  return size;
+}
+
+/*
+   Fill bufferP with "name\n" lines for the names starting with prefixP, walking the shards in turn from *cursorP
+   (0 to start, the high half picks the shard and the low half is the catalog_scan cursor in it). Stops when the
+   next home slot does not fit or *countP, which counts the names, reaches limitP (0 for no limit), and moves
+   *cursorP past what was sent. It is SHARDED_CATALOG_END once the walk is complete. Like catalog_scan, a name
+   stored for the whole walk is sent once. Returns the bytes used, or -1 with errno EMSGSIZE if a slot does not
+   fit in sizeP at all.
+*/
+ssize_t sharded_catalog_list (sharded_catalog_t * catalogP, uint64_t * cursorP, const char *prefixP,
+    size_t limitP, size_t * countP, char *bufferP, size_t sizeP)
+{
+  catalog_fill_t fill = { bufferP, sizeP, 0, prefixP, strlen(prefixP), *countP, NULL, false };
+
+  while (*cursorP < SHARDED_CATALOG_END && !fill.full && (limitP == 0 || fill.count < limitP)) {
+    catalog_shard_t *shard = &catalogP->shards[*cursorP >> 32];
+    uint64_t cursor = *cursorP & (CATALOG_SCAN_END - 1);
+    catalog_shard_lock(shard, false);
+    catalog_fill_shard(shard, &cursor, &fill, limitP);
+    catalog_shard_unlock(shard);
+    *cursorP = ((uint64_t)shard->index << 32) + cursor;   // The end of one shard is the start of the next
+  }
+  *countP = fill.count;
+  if (fill.full && fill.used == 0) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  return fill.used;
+}
+
+// Take a snapshot to read with catalog_snapshot_read. *bytesP is set to the number of bytes it will read.
+// Returns NULL if memory ran out
+catalog_snapshot_t *sharded_catalog_snapshot (sharded_catalog_t * catalogP, size_t * bytesP)
+{
+  catalog_snapshot_t *snapshot = calloc(1, sizeof(catalog_snapshot_t));
+
+  if (!snapshot)
+    return NULL;
+  snapshot->owner = catalogP;
+  pthread_mutex_init(&snapshot->lock, NULL);
+  catalog_init(&snapshot->changed);
+
+  pthread_rwlock_wrlock(&catalogP->snapshots_lock);
+  *bytesP = 0;
+  for (unsigned i = 0; i < CATALOG_SHARDS; i++)
+    *bytesP += catalogP->shards[i].name_bytes;
+  snapshot->next = catalogP->snapshots;
+  catalogP->snapshots = snapshot;
+  pthread_rwlock_unlock(&catalogP->snapshots_lock);
+  return snapshot;
+}
+
+/*
+   Fill bufferP with the next "name\n" lines of the snapshot. Returns the bytes used and 0 at the end, or -1 with
+   errno EMSGSIZE if the next home slot does not fit in sizeP at all, or ENOMEM if a change could not be
+   recorded and the snapshot can't be completed.
+*/
+ssize_t catalog_snapshot_read (catalog_snapshot_t * snapshotP, char *bufferP, size_t sizeP)
+{
+  catalog_fill_t fill = { bufferP, sizeP, 0, "", 0, 0, &snapshotP->changed, false };
+
+  while (snapshotP->shard < CATALOG_SHARDS && !fill.full) {
+    catalog_shard_t *shard = &snapshotP->owner->shards[snapshotP->shard];
+    catalog_shard_lock(shard, false);
+    pthread_mutex_lock(&snapshotP->lock);
+    catalog_fill_shard(shard, &snapshotP->cursor, &fill, 0);
+    if (snapshotP->cursor == CATALOG_SCAN_END) {
+      snapshotP->shard++;
+      snapshotP->cursor = 0;
+    }
+    pthread_mutex_unlock(&snapshotP->lock);
+    catalog_shard_unlock(shard);
+  }
+
+  // Then the names that were stored but changed before the walk got to them. With every shard walked, no more
+  // changes are recorded
+  pthread_mutex_lock(&snapshotP->lock);
+  while (snapshotP->shard == CATALOG_SHARDS && !fill.full && snapshotP->tail < catalog_size(&snapshotP->changed)) {
+    catalog_entry_t *entry = catalog_at(&snapshotP->changed, snapshotP->tail);
+    if (entry->size) {
+      size_t len = strlen(entry->name);
+      if (fill.used + len + 1 > fill.size) {
+        fill.full = true;
+        break;
+      }
+      memcpy(&fill.buffer[fill.used], entry->name, len);
+      fill.buffer[fill.used + len] = '\n';
+      fill.used += len + 1;
+    }
+    snapshotP->tail++;
+  }
+  bool failed = snapshotP->failed;
+  pthread_mutex_unlock(&snapshotP->lock);
+
+  if (failed) {
+    errno = ENOMEM;
+    return -1;
+  }
+  if (fill.full && fill.used == 0) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  return fill.used;
+}
+
+void catalog_snapshot_release (catalog_snapshot_t * snapshotP)
+{
+  sharded_catalog_t *owner = snapshotP->owner;
+
+  pthread_rwlock_wrlock(&owner->snapshots_lock);
+  catalog_snapshot_t **link = &owner->snapshots;
+  while (*link != snapshotP)
+    link = &(*link)->next;
+  *link = snapshotP->next;
+  pthread_rwlock_unlock(&owner->snapshots_lock);
+
+  catalog_destroy(&snapshotP->changed);
+  pthread_mutex_destroy(&snapshotP->lock);
+  free(snapshotP);
+}
+
+
+//------------------------------------------------------------------------------
+// Latency histogram
+
+static size_t histogram_index (uint64_t valueP)
+{
+  if (valueP < HISTOGRAM_SUB_COUNT)
+    return valueP;
+  unsigned exponent = 63 - __builtin_clzll(valueP);
+  unsigned shift = exponent - HISTOGRAM_SUB_BITS;
+  return (size_t)(shift + 1) * HISTOGRAM_SUB_COUNT + ((valueP >> shift) & (HISTOGRAM_SUB_COUNT - 1));
+}
+
+// Largest value that lands in bucket indexP
+static uint64_t histogram_bucket_top (size_t indexP)
+{
+  if (indexP < HISTOGRAM_SUB_COUNT)
+    return indexP;
+  unsigned shift = indexP / HISTOGRAM_SUB_COUNT - 1;
+  uint64_t sub = HISTOGRAM_SUB_COUNT + indexP % HISTOGRAM_SUB_COUNT;
+  return ((sub + 1) << shift) - 1;
+}
+
+void histogram_record (histogram_t * histP, uint64_t valueP)
+{
+  __atomic_fetch_add(&histP->counts[histogram_index(valueP)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&histP->sum, valueP, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&histP->max, __ATOMIC_RELAXED);
+  while (valueP > max &&
+         !__atomic_compare_exchange_n(&histP->max, &max, valueP, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+  // total goes last so a reader never sees more values than there are bucket counts for
+  __atomic_fetch_add(&histP->total, 1, __ATOMIC_RELEASE);
+}
+
+/*
+   Value at or below which quantileP (0 to 1) of the recorded values fall, reported as the top of
+   its bucket but never above the largest value seen. Returns 0 if nothing was recorded.
+*/
+uint64_t histogram_quantile (histogram_t * histP, double quantileP)
+{
+  uint64_t total = __atomic_load_n(&histP->total, __ATOMIC_ACQUIRE);
+  if (!total)
+    return 0;
+
+  uint64_t rank = (uint64_t)(quantileP * total + 0.5);
+  if (rank < 1)
+    rank = 1;
+  if (rank > total)
+    rank = total;
+
+  uint64_t max = __atomic_load_n(&histP->max, __ATOMIC_RELAXED);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += __atomic_load_n(&histP->counts[i], __ATOMIC_RELAXED);
+    if (seen >= rank) {
+      uint64_t top = histogram_bucket_top(i);
+      return top < max ? top : max;
+    }
+  }
+  return max;
+}
+
+uint64_t histogram_count (histogram_t * histP)
+{
+  return __atomic_load_n(&histP->total, __ATOMIC_ACQUIRE);
+}
+
+uint64_t histogram_mean (histogram_t * histP)
+{
+  uint64_t total = histogram_count(histP);
+  return total ? __atomic_load_n(&histP->sum, __ATOMIC_RELAXED) / total : 0;
+}
+
+uint64_t histogram_max (histogram_t * histP)
+{
+  return __atomic_load_n(&histP->max, __ATOMIC_RELAXED);
+}
+
+
+//------------------------------------------------------------------------------
+// SHA-256
+
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHA256_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block (sha256_t * ctxP, const uint8_t * blockP)
+{
+  uint32_t w[64];
+
+  for (int i = 0; i < 16; i++)
+    w[i] = (uint32_t)blockP[i * 4] << 24 | (uint32_t)blockP[i * 4 + 1] << 16 |
+           (uint32_t)blockP[i * 4 + 2] << 8 | blockP[i * 4 + 3];
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = SHA256_ROR(w[i - 15], 7) ^ SHA256_ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = SHA256_ROR(w[i - 2], 17) ^ SHA256_ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = ctxP->state[0], b = ctxP->state[1], c = ctxP->state[2], d = ctxP->state[3];
+  uint32_t e = ctxP->state[4], f = ctxP->state[5], g = ctxP->state[6], h = ctxP->state[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t t1 = h + (SHA256_ROR(e, 6) ^ SHA256_ROR(e, 11) ^ SHA256_ROR(e, 25)) + ((e & f) ^ (~e & g)) +
+                  sha256_k[i] + w[i];
+    uint32_t t2 = (SHA256_ROR(a, 2) ^ SHA256_ROR(a, 13) ^ SHA256_ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  ctxP->state[0] += a;
+  ctxP->state[1] += b;
+  ctxP->state[2] += c;
+  ctxP->state[3] += d;
+  ctxP->state[4] += e;
+  ctxP->state[5] += f;
+  ctxP->state[6] += g;
+  ctxP->state[7] += h;
+}
+
+void sha256_init (sha256_t * ctxP)
+{
+  static const uint32_t initial[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+
+  memcpy(ctxP->state, initial, sizeof(initial));
+  ctxP->length = 0;
+  ctxP->blockLen = 0;
+}
+
+void sha256_update (sha256_t * ctxP, const void *dataP, size_t sizeP)
+{
+  const uint8_t *data = dataP;
+
+  ctxP->length += sizeP;
+  if (ctxP->blockLen > 0) {
+    size_t take = 64 - ctxP->blockLen < sizeP ? 64 - ctxP->blockLen : sizeP;
+    memcpy(&ctxP->block[ctxP->blockLen], data, take);
+    ctxP->blockLen += take;
+    data += take;
+    sizeP -= take;
+    if (ctxP->blockLen < 64)
+      return;
+    sha256_block(ctxP, ctxP->block);
+    ctxP->blockLen = 0;
+  }
+  // Whole blocks are hashed straight from the caller's buffer
+  for (; sizeP >= 64; data += 64, sizeP -= 64)
+    sha256_block(ctxP, data);
+  memcpy(ctxP->block, data, sizeP);
+  ctxP->blockLen = sizeP;
+}
+
+void sha256_final (sha256_t * ctxP, uint8_t digestP[SHA256_DIGEST_SIZE])
+{
+  uint64_t bits = ctxP->length * 8;
+
+  ctxP->block[ctxP->blockLen++] = 0x80;
+  if (ctxP->blockLen > 56) {
+    memset(&ctxP->block[ctxP->blockLen], 0, 64 - ctxP->blockLen);
+    sha256_block(ctxP, ctxP->block);
+    ctxP->blockLen = 0;
+  }
+  memset(&ctxP->block[ctxP->blockLen], 0, 56 - ctxP->blockLen);
+  for (int i = 0; i < 8; i++)
+    ctxP->block[56 + i] = bits >> (56 - i * 8);
+  sha256_block(ctxP, ctxP->block);
+
+  for (int i = 0; i < 8; i++) {
+    digestP[i * 4] = ctxP->state[i] >> 24;
+    digestP[i * 4 + 1] = ctxP->state[i] >> 16;
+    digestP[i * 4 + 2] = ctxP->state[i] >> 8;
+    digestP[i * 4 + 3] = ctxP->state[i];
+  }
+}
+
+
+//------------------------------------------------------------------------------
+/*
+   LZ77 codec
+   Greedy single probe matching through a hash of the next four bytes, written as LZ4 block sequences: a token
+   with the literal and match lengths, the literals, a 16 bit offset and the rest of the match length.
+   As in LZ4 the last five bytes are always literals and no match starts in the last twelve.
+*/
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+
+static uint32_t lz_read32 (const uint8_t * p)
+{
+  uint32_t value;
+
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+// Write a length's continuation bytes after its 15 in the token. Returns NULL if it doesn't fit
+static uint8_t *lz_put_length (uint8_t * op, const uint8_t * end, size_t lengthP)
+{
+  for (; lengthP >= 255; lengthP -= 255) {
+    if (op >= end)
+      return NULL;
+    *op++ = 255;
+  }
+  if (op >= end)
+    return NULL;
+  *op++ = lengthP;
+  return op;
+}
+
+static uint8_t *lz_sequence (uint8_t * op, const uint8_t * end, const uint8_t * literals, size_t literalLen,
+    size_t offset, size_t matchLen)
+{
+  if (op >= end)
+    return NULL;
+  uint8_t *token = op++;
+  *token = (literalLen < 15 ? literalLen : 15) << 4;
+  if (literalLen >= 15 && !(op = lz_put_length(op, end, literalLen - 15)))
+    return NULL;
+  if ((size_t)(end - op) < literalLen)
+    return NULL;
+  memcpy(op, literals, literalLen);
+  op += literalLen;
+  if (matchLen == 0)
+    return op;
+
+  if (end - op < 2)
+    return NULL;
+  *op++ = offset;
+  *op++ = offset >> 8;
+  matchLen -= LZ_MIN_MATCH;
+  *token |= matchLen < 15 ? matchLen : 15;
+  if (matchLen >= 15 && !(op = lz_put_length(op, end, matchLen - 15)))
+    return NULL;
+  return op;
+}
+
+/*
+   Compress sizeP bytes, at most LZ_FRAME_SIZE so every offset fits in 16 bits. Returns the compressed size,
+   or 0 if it would not fit in capP bytes
+*/
+size_t lz_compress (const uint8_t * srcP, size_t sizeP, uint8_t * dstP, size_t capP)
+{
+  uint32_t table[1 << LZ_HASH_BITS] = { 0 };    // Position + 1 of the last four bytes with each hash
+  const uint8_t *end = dstP + capP;
+  uint8_t *op = dstP;
+  size_t anchor = 0;
+
+  if (sizeP > LZ_MATCH_LIMIT) {
+    size_t limit = sizeP - LZ_MATCH_LIMIT;
+    size_t matchEnd = sizeP - LZ_LAST_LITERALS;
+    size_t ip = 0;
+    while (ip < limit) {
+      uint32_t sequence = lz_read32(&srcP[ip]);
+      uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+      size_t candidate = table[hash];
+      table[hash] = ip + 1;
+      if (candidate == 0 || lz_read32(&srcP[candidate - 1]) != sequence) {
+        ip++;
+        continue;
+      }
+      candidate--;
+
+      size_t matchLen = LZ_MIN_MATCH;
+      while (ip + matchLen < matchEnd && srcP[candidate + matchLen] == srcP[ip + matchLen])
+        matchLen++;
+      op = lz_sequence(op, end, &srcP[anchor], ip - anchor, ip - candidate, matchLen);
+      if (op == NULL)
+        return 0;
+      ip += matchLen;
+      anchor = ip;
+    }
+  }
+
+  op = lz_sequence(op, end, &srcP[anchor], sizeP - anchor, 0, 0);
+  return op ? (size_t)(op - dstP) : 0;
+}
+
+/*
+   Decompress into at most capP bytes. Returns the decompressed size, or -1 if the input is malformed
+*/
+ssize_t lz_decompress (const uint8_t * srcP, size_t sizeP, uint8_t * dstP, size_t capP)
+{
+  size_t ip = 0, op = 0;
+
+  while (ip < sizeP) {
+    uint8_t token = srcP[ip++];
+    size_t literalLen = token >> 4;
+    if (literalLen == 15) {
+      uint8_t more;
+      do {
+        if (ip >= sizeP)
+          return -1;
+        more = srcP[ip++];
+        literalLen += more;
+      } while (more == 255);
+    }
+    if (literalLen > sizeP - ip || literalLen > capP - op)
+      return -1;
+    memcpy(&dstP[op], &srcP[ip], literalLen);
+    ip += literalLen;
+    op += literalLen;
+    if (ip == sizeP)
+      break;
+
+    if (sizeP - ip < 2)
+      return -1;
+    size_t offset = srcP[ip] | (size_t)srcP[ip + 1] << 8;
+    ip += 2;
+    if (offset == 0 || offset > op)
+      return -1;
+    size_t matchLen = token & 15;
+    if (matchLen == 15) {
+      uint8_t more;
+      do {
+        if (ip >= sizeP)
+          return -1;
+        more = srcP[ip++];
+        matchLen += more;
+      } while (more == 255);
+    }
+    matchLen += LZ_MIN_MATCH;
+    if (matchLen > capP - op)
+      return -1;
+    // Matches may overlap what they produce, so copy forwards a byte at a time
+    for (size_t i = 0; i < matchLen; i++, op++)
+      dstP[op] = dstP[op - offset];
+  }
+  return op;
+}
+
+/*
+   Build the frame for sizeP bytes (at most LZ_FRAME_SIZE) in frameP, which has room for
+   LZ_FRAME_HEADER + LZ_FRAME_SIZE bytes. Returns the size of the whole frame
+*/
+size_t lz_frame (const uint8_t * srcP, size_t sizeP, uint8_t * frameP)
+{
+  size_t coded = sizeP ? lz_compress(srcP, sizeP, frameP + LZ_FRAME_HEADER, sizeP - 1) : 0;
+
+  if (coded == 0) {
+    // Incompressible, or the end of the payload
+    coded = sizeP;
+    if (sizeP)
+      memcpy(frameP + LZ_FRAME_HEADER, srcP, sizeP);
+  }
+  for (int i = 0; i < 4; i++) {
+    frameP[i] = sizeP >> (i * 8);
+    frameP[4 + i] = coded >> (i * 8);
+  }
+  return LZ_FRAME_HEADER + coded;
+}
+
+
+//------------------------------------------------------------------------------
+// Asynchronous logger
+
+#define LOG_RING_ENTRIES 1024       // Records per thread, a power of two
+#define LOG_LINE_MAX 240            // Longer messages are truncated
+#define LOG_WRITE_BATCH 65536       // Bytes collected before a write to stderr
+#define LOG_IDLE_USEC 2000          // Writer thread sleep when every ring is empty
+
+typedef struct {
+  struct timespec time;
+  log_level_t level;
+  uint16_t len;
+  char text[LOG_LINE_MAX];
+} log_record_t;
+
+/*
+   Single producer, single consumer ring. The owning thread only moves tail, the writer thread only moves head.
+*/
+typedef struct log_ring {
+  log_record_t records[LOG_RING_ENTRIES];
+  uint64_t head;
+  uint64_t tail;
+  uint64_t dropped;         // Messages lost to a full ring or the rate limit
+  double tokens;            // Rate limiter, owner thread only
+  struct timespec refilled;
+  struct log_ring *next;
+} log_ring_t;
+
+static struct {
+  pthread_mutex_t lock;     // Guards rings, taken once per thread when its ring is attached
+  log_ring_t *rings;
+  pthread_t thread;
+  int running;
+  log_level_t level;
+  unsigned rate;
+  uint64_t reported_dropped;
+} logger = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, LOG_DEBUG, 0, 0 };
+
+static __thread log_ring_t *log_ring_self;
+
+static const char *log_level_names[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+
+int log_parse_level (const char *nameP, log_level_t * levelP)
+{
+  for (int i = LOG_ERROR; i <= LOG_DEBUG; i++) {
+    if (!strcasecmp(nameP, log_level_names[i])) {
+      *levelP = i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static log_ring_t *log_ring_attach (void)
+{
+  log_ring_t *ring = calloc(1, sizeof(log_ring_t));
+  if (!ring)
+    return NULL;
+  ring->tokens = logger.rate;
+  clock_gettime(CLOCK_MONOTONIC, &ring->refilled);
+
+  pthread_mutex_lock(&logger.lock);
+  ring->next = logger.rings;
+  __atomic_store_n(&logger.rings, ring, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&logger.lock);
+  log_ring_self = ring;
+  return ring;
+}
+
+// Token bucket refilled at logger.rate per second, holding at most a second's worth
+static int log_take_token (log_ring_t * ringP)
+{
+  if (!logger.rate)
+    return 1;
+  if (ringP->tokens < 1) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - ringP->refilled.tv_sec) + (now.tv_nsec - ringP->refilled.tv_nsec) / 1e9;
+    ringP->refilled = now;
+    ringP->tokens += elapsed * logger.rate;
+    if (ringP->tokens > logger.rate)
+      ringP->tokens = logger.rate;
+    if (ringP->tokens < 1)
+      return 0;
+  }
+  ringP->tokens -= 1;
+  return 1;
+}
+
+void log_message (log_level_t levelP, const char *formatP, ...)
+{
+  if (levelP > logger.level)
+    return;
+
+  va_list args;
+  log_ring_t *ring = NULL;
+  if (__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE))
+    ring = log_ring_self ? log_ring_self : log_ring_attach();
+
+  if (!ring) {
+    va_start(args, formatP);
+    vfprintf(stderr, formatP, args);
+    va_end(args);
+    fputc('\n', stderr);
+    return;
+  }
+
+  uint64_t tail = ring->tail;
+  if ((levelP != LOG_ERROR && !log_take_token(ring)) ||
+      tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == LOG_RING_ENTRIES) {
+    __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  log_record_t *record = &ring->records[tail & (LOG_RING_ENTRIES - 1)];
+  clock_gettime(CLOCK_REALTIME, &record->time);
+  record->level = levelP;
+  va_start(args, formatP);
+  int len = vsnprintf(record->text, LOG_LINE_MAX, formatP, args);
+  va_end(args);
+  if (len < 0)
+    len = 0;
+  record->len = len < LOG_LINE_MAX ? len : LOG_LINE_MAX - 1;
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void log_write_out (const char *bufferP, size_t sizeP)
+{
+  while (sizeP > 0) {
+    ssize_t count = write(STDERR_FILENO, bufferP, sizeP);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count <= 0)
+      return;
+    bufferP += count;
+    sizeP -= count;
+  }
+}
+
+// Move everything queued in the rings to stderr. Returns the number of records written
+static size_t log_drain (char *bufferP)
+{
+  size_t used = 0, records = 0;
+  uint64_t dropped = 0;
+
+  for (log_ring_t *ring = __atomic_load_n(&logger.rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++, records++) {
+      log_record_t *record = &ring->records[head & (LOG_RING_ENTRIES - 1)];
+      if (used + LOG_LINE_MAX + 64 > LOG_WRITE_BATCH) {
+        log_write_out(bufferP, used);
+        used = 0;
+      }
+      struct tm tm;
+      localtime_r(&record->time.tv_sec, &tm);
+      used += snprintf(&bufferP[used], LOG_WRITE_BATCH - used, "%02d:%02d:%02d.%06ld %-5s %.*s\n",
+                       tm.tm_hour, tm.tm_min, tm.tm_sec, record->time.tv_nsec / 1000,
+                       log_level_names[record->level], (int)record->len, record->text);
+      // Hand each record back as soon as it is copied, so the owner can reuse the slot
+      __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    }
+    dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+  }
+
+  if (dropped != logger.reported_dropped) {
+    used += snprintf(&bufferP[used], LOG_WRITE_BATCH - used, "log: %" PRIu64 " messages dropped\n",
+                     dropped - logger.reported_dropped);
+    logger.reported_dropped = dropped;
+  }
+  log_write_out(bufferP, used);
+  return records;
+}
+
+static void *log_writer(void *argP)
+{
+  (void)argP;
+  char *buffer = malloc(LOG_WRITE_BATCH);
+  if (!buffer)
+    return NULL;
+
+  while (__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE)) {
+    if (!log_drain(buffer)) {
+      struct timespec idle = { 0, LOG_IDLE_USEC * 1000 };
+      nanosleep(&idle, NULL);
+    }
+  }
+  // Producers may have queued a last few messages before they saw running drop
+  log_drain(buffer);
+  free(buffer);
+  return NULL;
+}
+
+/*
+   Start the background writer. Messages above levelP are discarded. Returns -1 if the thread can't be started,
+   logging then stays synchronous.
+*/
+int log_start (log_level_t levelP, unsigned rateP)
+{
+  logger.level = levelP;
+  logger.rate = rateP;
+  if (logger.running)
+    return 0;
+
+  __atomic_store_n(&logger.running, 1, __ATOMIC_RELEASE);
+  if (pthread_create(&logger.thread, NULL, log_writer, NULL)) {
+    __atomic_store_n(&logger.running, 0, __ATOMIC_RELEASE);
+    return -1;
+  }
+  atexit(log_stop);
+  return 0;
+}
+
+// Flush what is queued and stop the writer thread. Later messages are written synchronously
+void log_stop (void)
+{
+  if (!__atomic_exchange_n(&logger.running, 0, __ATOMIC_ACQ_REL))
+    return;
+  pthread_join(logger.thread, NULL);
+}
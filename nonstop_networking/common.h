@@ -1,24 +1,40 @@
 #pragma once
+#include <pthread.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <sys/types.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
 
 
 #define LOG(...)                      \
     if(verbose_flag == 1)                 \
         do {                              \
-            fprintf(stderr, __VA_ARGS__); \
-            fprintf(stderr, "\n");        \
+            log_message(LOG_INFO, __VA_ARGS__); \
         } while (0);
 
+// Log levels, most severe first
+typedef enum { LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG } log_level_t;
+
+// Messages are written straight to stderr until log_start is called. After that each thread formats
+// its messages into its own ring buffer and a background thread writes them out in batches, so logging
+// never blocks the caller. A full ring drops messages, and so does the per thread rate limit
+// (messages per second, 0 for none, LOG_ERROR is exempt). Dropped counts are reported in the log.
+void log_message (log_level_t levelP, const char *formatP, ...) __attribute__((format(printf, 2, 3)));
+int log_start (log_level_t levelP, unsigned rateP);
+void log_stop (void);
+int log_parse_level (const char *nameP, log_level_t * levelP);
+
 #define MAX_BUF_SIZE 2048
 
 #define HASH_TABLE_SIZE           10000
+// Buckets share this many mutexes, bucket i is guarded by locks[i % HASH_TABLE_LOCK_STRIPES]
+#define HASH_TABLE_LOCK_STRIPES   64
 
-typedef enum { GET, PUT, DELETE, LIST, V_UNKNOWN } verb;
+typedef enum { GET, PUT, DELETE, LIST, KEEPALIVE, STATS, GETRANGE, PUTFROM, PARTIAL, GETZ, PUTZ, LISTPAGE, V_UNKNOWN } verb;
 
 typedef enum { OK, ERROR } status;
 
@@ -47,6 +63,7 @@ typedef struct
 {
     uint32_t num_elements;
     my_hash_node_t *nodes[HASH_TABLE_SIZE];
+    pthread_mutex_t locks[HASH_TABLE_LOCK_STRIPES];
     uint32_t      (*hashfunc)(const uint32_t);
     char *name;
 } my_hash_table_t;
@@ -59,6 +76,124 @@ hashtable_rc_t hashtable_ts_insert (my_hash_table_t * hashtblP,
 hashtable_rc_t hashtable_ts_free (my_hash_table_t * hashtblP, const uint32_t keyP);
 hashtable_rc_t hashtable_ts_get (my_hash_table_t * hashtblP,
       const uint32_t keyP, void **dataP);
+hashtable_rc_t hashtable_ts_remove (my_hash_table_t * hashtblP,
+      const uint32_t keyP, void **dataP);
+
+// Catalog of stored files: an open addressing hash index over a dense entry array.
+// Lookups, inserts and removals are O(1) on average, and the dense array can be walked directly for LIST.
+typedef struct {
+    char *name;
+    uint32_t hash;
+    size_t size;            // Size of the stored file in bytes
+    time_t mtime;           // Time the file was last written
+    void *cache;            // Owner data attached to the entry (the server's GET cache), NULL when unused
+    uint64_t index;         // Offset of the entry's record in the server's persistent index, 0 when it has none
+    void *blob;             // Owner data: the blob the entry refers to in the server's dedup store, NULL when unused
+} catalog_entry_t;
+
+typedef struct {
+    catalog_entry_t *entries;   // Dense array of entries, removal moves the last entry into the hole
+    size_t num_entries;
+    size_t entries_cap;
+    uint32_t *slots;            // Index + 1 into entries, 0 marks an empty slot. Size is a power of two
+    size_t num_slots;
+} catalog_t;
+
+void catalog_init (catalog_t * catalogP);
+void catalog_destroy (catalog_t * catalogP);
+catalog_entry_t *catalog_find (catalog_t * catalogP, const char *nameP);
+catalog_entry_t *catalog_put (catalog_t * catalogP, const char *nameP,
+      size_t sizeP, time_t mtimeP);
+hashtable_rc_t catalog_remove (catalog_t * catalogP, const char *nameP);
+size_t catalog_size (catalog_t * catalogP);
+catalog_entry_t *catalog_at (catalog_t * catalogP, size_t indexP);
+// Cursor returned by catalog_scan once the whole catalog has been visited. Cursors are positions in hash order
+#define CATALOG_SCAN_END ((uint64_t)1 << 32)
+uint64_t catalog_scan (catalog_t * catalogP, uint64_t cursorP,
+      void (*visitP) (catalog_entry_t *, void *), void *argP);
+
+// Catalog for use from several threads: names are spread over shards by hash, each a catalog behind its own
+// rwlock. Look names up with the shard read locked and change them with it write locked, through
+// catalog_shard_put and catalog_shard_remove so that snapshots taken for LIST stay consistent.
+#define CATALOG_SHARDS 16
+// sharded_catalog_list cursor once every shard has been walked
+#define SHARDED_CATALOG_END ((uint64_t)CATALOG_SHARDS << 32)
+
+typedef struct catalog_snapshot_s catalog_snapshot_t;
+typedef struct sharded_catalog_s sharded_catalog_t;
+
+typedef struct {
+    pthread_rwlock_t lock;
+    catalog_t catalog;
+    size_t name_bytes;          // strlen + 1 summed over the names, the size of a LIST of the shard
+    unsigned index;             // Position in owner->shards
+    sharded_catalog_t *owner;
+} catalog_shard_t;
+
+struct sharded_catalog_s {
+    catalog_shard_t shards[CATALOG_SHARDS];
+    pthread_rwlock_t snapshots_lock;    // Read locked to report a change, write locked to take or release a snapshot
+    catalog_snapshot_t *snapshots;      // Snapshots being read
+};
+
+void sharded_catalog_init (sharded_catalog_t * catalogP);
+void sharded_catalog_destroy (sharded_catalog_t * catalogP);
+catalog_shard_t *sharded_catalog_lock (sharded_catalog_t * catalogP, const char *nameP, bool writeP);
+void catalog_shard_lock (catalog_shard_t * shardP, bool writeP);
+void catalog_shard_unlock (catalog_shard_t * shardP);
+catalog_entry_t *catalog_shard_put (catalog_shard_t * shardP, const char *nameP,
+      size_t sizeP, time_t mtimeP);
+hashtable_rc_t catalog_shard_remove (catalog_shard_t * shardP, const char *nameP);
+size_t sharded_catalog_size (sharded_catalog_t * catalogP);
+ssize_t sharded_catalog_list (sharded_catalog_t * catalogP, uint64_t * cursorP, const char *prefixP,
+      size_t limitP, size_t * countP, char *bufferP, size_t sizeP);
+catalog_snapshot_t *sharded_catalog_snapshot (sharded_catalog_t * catalogP, size_t * bytesP);
+ssize_t catalog_snapshot_read (catalog_snapshot_t * snapshotP, char *bufferP, size_t sizeP);
+void catalog_snapshot_release (catalog_snapshot_t * snapshotP);
+
+// Latency histogram in the style of HdrHistogram: each power of two is split into 2^HISTOGRAM_SUB_BITS
+// linear buckets, so any recorded value is reported within about 6% over the whole 64 bit range.
+// Recording only uses relaxed atomic adds, it can be read while other threads record into it.
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;         // Number of recorded values
+    uint64_t sum;           // Sum of recorded values, for the mean
+    uint64_t max;           // Largest recorded value
+} histogram_t;
+
+void histogram_record (histogram_t * histP, uint64_t valueP);
+uint64_t histogram_quantile (histogram_t * histP, double quantileP);
+uint64_t histogram_count (histogram_t * histP);
+uint64_t histogram_mean (histogram_t * histP);
+uint64_t histogram_max (histogram_t * histP);
+
+// SHA-256 (FIPS 180-4), fed incrementally
+#define SHA256_DIGEST_SIZE 32
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;        // Bytes hashed so far
+    uint8_t block[64];
+    size_t blockLen;
+} sha256_t;
+
+void sha256_init (sha256_t * ctxP);
+void sha256_update (sha256_t * ctxP, const void *dataP, size_t sizeP);
+void sha256_final (sha256_t * ctxP, uint8_t digestP[SHA256_DIGEST_SIZE]);
+
+// LZ77 block codec, in the LZ4 block format. GETZ and PUTZ payloads are sent as a series of frames: a 4 byte
+// uncompressed length and a 4 byte coded length (little endian), then the coded bytes. A frame whose coded
+// length equals its uncompressed length is stored as is. A frame with an uncompressed length of 0 ends the payload
+#define LZ_FRAME_SIZE 65536
+#define LZ_FRAME_HEADER 8
+
+size_t lz_compress (const uint8_t * srcP, size_t sizeP, uint8_t * dstP, size_t capP);
+ssize_t lz_decompress (const uint8_t * srcP, size_t sizeP, uint8_t * dstP, size_t capP);
+size_t lz_frame (const uint8_t * srcP, size_t sizeP, uint8_t * frameP);
 
 void send_all(char* buffer, size_t size, int sock);
 
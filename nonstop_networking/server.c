@@ -3,10 +3,12 @@
 #include <sys/stat.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <errno.h>
 #include <assert.h>
+#include <ctype.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
@@ -14,15 +16,43 @@
 #include <signal.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <inttypes.h>
+#include <limits.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#endif
 
 #include "common.h"
 #include "format.h"
-#include "vector.h"
 
 #define BASE_FOLDER "test"
 
 #define MAXEVENTS 64
 
+// PUT payloads are received in large batches into one page aligned buffer and written straight to the file with pwrite.
+// The server is single threaded and each batch is written out before the next recv, so every upload shares the buffer
+#define PUT_BUFFER_SIZE (1024*1024)
+// Block size that offsets and lengths are kept aligned to when writing with O_DIRECT
+#define PUT_DIRECT_ALIGN 4096
+
+// GET cache: default capacity, and the share of it a single file may take
+#define GET_CACHE_DEFAULT_SIZE (64*1024*1024)
+#define GET_CACHE_OBJECT_DIVISOR 8
+
+// io_uring engine sizing: submission queue entries, and the registered buffer slots (one per connection)
+#define RING_ENTRIES 1024
+#define RING_SLOTS 1024
+#define RING_SLOT_SIZE (BUFSIZ*2)
+
 enum {
 // This indicates that a stream we are reading has come to an end, and the client has stopped sending data
     STREAM_END = 1001,
@@ -58,36 +88,236 @@ enum {
     STATE_SENDING_GET,
     STATE_READING_PUT_SIZE,
     STATE_READING_PUT_DATA,
+    STATE_READING_PUT_FRAMES,   // PUTZ payload, decompressed frame by frame from the stream buffer
     STATE_WRITING_LIST,
+    STATE_COMMITTING,           // PUT complete, waiting for the group commit at the end of the loop iteration
     STATE_INTERNAL_ERROR,
     STATE_DONE
 };
 
 
-typedef struct {
+// Header and filename buffers start small and are grown on demand, most requests are a short verb and filename
+#define SESSION_BUF_INITIAL 128
+// Largest header we accept, anything longer is a bad request
+#define SESSION_INPUT_MAX (BUFSIZ*2)
+// Buffers that grew past this are given back when the session is released, so the pool does not pin large buffers
+#define SESSION_BUF_KEEP 1024
+// Maximum number of idle sessions kept on the freelist
+#define SESSION_POOL_MAX_FREE 4096
+
+// Directory under base_temp_dir that keeps interrupted uploads until they are resumed with PUTFROM
+#define PARTIAL_DIR ".partial"
+// Directory under base_temp_dir where PUTs are written until they are complete and renamed into place
+#define INCOMING_DIR ".incoming"
+// Index of the stored files in a persistent data directory
+#define INDEX_FILE ".index"
+// Directory under base_temp_dir holding the contents of deduplicated files, named by their SHA-256
+#define BLOB_DIR ".blobs"
+
+// LIST and LISTPAGE gather names into a buffer of this size and send it whenever it fills
+#define LIST_CHUNK_SIZE 65536
+// A GET is read from disk and sent in pieces of this size
+#define SEND_CHUNK_SIZE 65536
+
+// Bytes a connection may read per turn of the event loop before the others get theirs
+#define READ_QUANTUM_DEFAULT (256*1024)
+
+// Requests of each verb --bench-parser sends when it isn't given a number
+#define PARSER_BENCH_REQUESTS 20000
+
+// Timer wheel: one slot per second. Deadlines further out than the wheel are checked again when they come round
+#define WHEEL_SLOTS 256
+
+typedef struct Session Session;
+typedef struct CacheObject CacheObject;
+
+struct Session {
     Stream stream;          // Used to buffer both input and output from the stream. Please note we do not read and write at the same time. Always read, then write
     int state;                // Current state of the session -- what is it doing/
-    char input[BUFSIZ*2];     // When reading the header, it is loaded in here.
-    char filename[BUFSIZ];  // Filename for command
+    char* input;            // When reading the header, it is loaded in here. Always kept '\0' terminated
+    size_t inputCap;        // Allocated size of input
+    char* filename;         // Filename for command
+    size_t filenameCap;     // Allocated size of filename
     size_t inputPos;        // When reading the header this is the next position to put the next character
-    FILE* fd;                // For file based operations, GET and PUT this is the file we are reading or writing
+    int fd;                 // For PUT this is the file we are writing, -1 when no file is open
+    bool putDirect;         // The PUT file was opened with O_DIRECT
+    char* putTail;          // With O_DIRECT, received bytes that do not fill a whole aligned block yet
+    size_t putTailLen;      // Number of bytes in putTail
+    size_t putOffset;       // Next file offset to write PUT data at
     int status;             // Status of the session is either SESSION_WAIT meaning it is waiting for more data
                             // to read or write, SESSION_END where it is ended or SESSION_ERROR if it is in error
-    char* listData;            // When we get a LIST command we have to generate the full list and buffer in memory in case ongoing commands
-                            // in parallel change the list. So this is a malloced buffer containing that list
-    size_t listDataPos;        // When writing out list data in multiple buffer writes, this is position we have already writeen up to
     bool reading;           // IS this session currently reading from the socket or writing to it
+    bool keepAlive;         // The client sent KEEPALIVE, so requests keep coming on this connection until it closes
+
+    bool ranged;            // GETRANGE: only send rangeLength bytes from rangeOffset (0 length for the rest)
+    bool putResume;         // PUTFROM: the upload goes on from rangeOffset in the partial store
+    bool putHashing;        // The PUT is being hashed into putHash for the dedup store
+    bool compressed;        // GETZ or PUTZ: the payload goes as LZ frames
+    char* frame;            // PUTZ frame being received, LZ_FRAME_HEADER + LZ_FRAME_SIZE bytes
+    size_t frameLen;
+    sha256_t putHash;
+    size_t rangeOffset;
+    size_t rangeLength;
+
+    verb requestVerb;       // Request being timed for the metrics, V_UNKNOWN once it has been recorded
+    struct timespec requestStart;   // When its header was parsed
+    bool requestFailed;     // An ERROR response was sent for it
+
+    int ringSlot;           // io_uring engine: registered buffer owned by this connection, -1 with epoll
+    int getFd;              // File being sent for a GET, -1 when none
+    CacheObject* getCached; // Cached GET being sent, pinned until it has gone out
+    size_t getLeft;         // Bytes of the GET file still to be read
+    size_t getOffset;       // Next offset to read the GET file at
+    size_t ioPos;           // io_uring engine: bytes of the slot already sent or written
+    size_t ioLen;           // io_uring engine: bytes in the slot to be sent or written
+
+    char* out;              // Response bytes the socket has not taken yet. No more input is read until they have gone
+    size_t outCap;          // Allocated size of out
+    const char* outData;    // What is being sent: out, or the data of a pinned cache object
+    size_t outLen;          // Bytes of outData to send
+    size_t outPos;          // Bytes of outData already sent
+    bool outArmed;          // EPOLLOUT is armed, the socket was full
+    bool outFailed;         // The connection failed or timed out, the rest of the response is dropped
+    bool closeAfterSend;    // The client closed its side, the connection ends once the response has gone out
+
+    catalog_snapshot_t* listSnapshot;   // LIST being sent, released once all of it is in out
+    uint64_t listCursor;    // LISTPAGE being sent: where it goes on from, the names sent and the page size
+    size_t listCount;
+    size_t listLimit;
 
     size_t headersize;
 
     size_t totalBytesForPut;
-    size_t totalWritten;
-} Session;
+    size_t totalWritten;    // PUT payload bytes received so far, including any beyond totalBytesForPut
+
+    Session* nextFree;      // Link in the session pool freelist while the session is not in use
+
+    Session* readyPrev;     // Links in the scheduler's run queue while readyQueued
+    Session* readyNext;
+    bool readyQueued;       // Its turn ran out with input left, it reads again when the run queue comes round
+    bool throttled;         // It is in the run queue because its --client-rate bucket is empty
+    ssize_t deficit;        // Bytes it may still read this turn, below 0 when the last read overshot
+    double rateTokens;      // --client-rate: bytes it may read before it is throttled
+    struct timespec rateRefilled;   // When rateTokens was last topped up
+
+    Session* commitNext;    // Link in the group commit queue while the session is STATE_COMMITTING
+    const char* commitError;    // Group commit: why the PUT could not be stored, NULL to answer OK
+    bool closeAfterCommit;  // The client closed while its PUT was waiting for the group commit
+
+    Session* wheelPrev;     // Links in a timer wheel slot
+    Session* wheelNext;
+    int wheelSlot;          // Slot the session is waiting in, -1 when it is not on the wheel
+    uint64_t lastActivity;  // Wheel time bytes last moved on the connection
+    uint64_t requestBegan;  // Wheel time the first byte of the current header arrived
+};
+
+// Sessions are recycled through a freelist instead of being calloced for every connection
+typedef struct {
+    Session* freeList;      // Idle sessions ready to be handed out again
+    size_t freeCount;       // Number of sessions on the freelist
+    size_t created;         // Sessions allocated from the heap
+    size_t reused;          // Sessions handed out from the freelist
+    size_t inUse;           // Sessions currently attached to a socket
+    size_t peakInUse;       // Highest value inUse has reached
+    size_t bufferGrowths;   // Number of times a header or filename buffer had to be grown
+} SessionPool;
+
+// A cached GET response, the "OK\n" header and size followed by the file contents, so a hit is a single send.
+// Hangs off the file's catalog entry and sits on the cache's LRU list
+struct CacheObject {
+    char* name;             // Catalog key, used to detach the object from its entry on eviction
+    char* data;
+    size_t length;          // Header plus file bytes
+    CacheObject* prev;      // Towards the most recently used end
+    CacheObject* next;      // Towards the least recently used end
+    unsigned senders;       // Sessions sending straight from data, and lookups about to hand it out
+    bool dropped;           // Evicted or invalidated while it was being sent, freed when the last sender is done
+};
+
+// lock guards the list, the counters and the objects' senders and dropped. It is taken with the file's shard
+// lock held, never the other way round, and an object's entry->cache only changes under a shard write lock
+typedef struct {
+    pthread_mutex_t lock;
+    CacheObject* head;      // Most recently used
+    CacheObject* tail;      // Least recently used, evicted first
+    size_t bytes;           // Bytes held by all cached objects
+    size_t capacity;        // Limit for bytes, 0 disables the cache. Set before the server starts
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+} GetCache;
+
+// Server wide counters. Updated with relaxed atomic adds so they can be read (and later updated) from
+// other threads without a lock. Latencies are in nanoseconds, from the parsed header to the finished response
+typedef struct {
+    histogram_t latency[LIST + 1];  // Indexed by verb, GET to LIST
+    uint64_t requests[LIST + 1];
+    uint64_t errors[LIST + 1];      // Requests answered with ERROR
+    uint64_t badRequests;           // Headers that could not be parsed
+    uint64_t bytesIn;               // Bytes received from clients
+    uint64_t bytesOut;              // Bytes sent to clients
+    uint64_t sendStalls;            // Sends that returned EAGAIN and had to be retried
+    uint64_t accepted;              // Connections accepted
+    uint64_t timedOut;              // Sessions closed by an idle, header or write deadline
+    uint64_t acceptPauses;          // Times accepting stopped because max connections was reached
+    uint64_t turnsYielded;          // Connections that used up their turn with input left over
+    uint64_t rateThrottled;         // Times a connection had to wait for its --client-rate bucket
+    struct timespec started;
+} Metrics;
+
+#define METRIC_ADD(field, n) __atomic_fetch_add(&(field), (n), __ATOMIC_RELAXED)
+#define METRIC_GET(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+// Sessions waiting for their deadline, hashed by deadline second. Activity only updates lastActivity, the
+// deadline is worked out again when the session's slot comes round, so a busy connection costs nothing here
+typedef struct {
+    Session* slots[WHEEL_SLOTS];
+    uint64_t now;           // Seconds since the server started, advanced by the timer
+    int timerFd;
+} TimerWheel;
+
+// Input for the parser harness: what session_recv hands out in place of a socket read
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+    size_t position;        // Bytes handed out so far
+    const uint8_t* cuts;    // Read sizes, used in turn. 0 means EAGAIN, no cuts means as much as is asked for
+    size_t numCuts;
+    size_t nextCut;
+    bool stalled;           // The last read was an EAGAIN, the next one always makes progress
+} ParserInput;
 
-static char base_temp_dir[BUFSIZ];
-static vector* directory = NULL;
+static char base_temp_dir[PATH_MAX];     // A directory path, so what is joined under it fits in BUFSIZ buffers
+static sharded_catalog_t directory;
 static my_hash_table_t sock_to_session_hashtable;
+static SessionPool session_pool;
+static Metrics metrics;
+static const char* err_bad_range = "Bad range\n";
+static TimerWheel wheel;
+static GetCache get_cache = { .lock = PTHREAD_MUTEX_INITIALIZER, .capacity = GET_CACHE_DEFAULT_SIZE };
+static char* put_buffer = NULL;
+static int direct_io_flag = 0;
+static const char* data_dir = NULL;     // Keep the files here across restarts instead of in a fresh temp directory
+static int dedup_flag = 0;
+static int fsync_flag = 0;          // PUTs are on disk before they are answered
+static int group_commit_flag = 0;   // Sync the PUTs completing in one loop iteration together
+static size_t read_quantum = READ_QUANTUM_DEFAULT;  // Bytes per connection per turn
+static size_t client_rate = 0;      // Bytes per second a connection may send, 0 for no limit
+static int io_uring_flag = 0;
+static bool ring_active = false;    // The io_uring engine is running, GET files are then opened and streamed by the ring
 static int verbose_flag = 1;
+static log_level_t log_level = LOG_INFO;
+static unsigned log_rate = 0;      // Per thread log messages per second, 0 for no limit
+static int listen_backlog = SOMAXCONN;
+static size_t max_connections = 0;  // 0 for no limit
+static unsigned idle_timeout = 60;  // Seconds without any bytes moving before a connection is closed, 0 for never
+static unsigned header_timeout = 10;    // Seconds a request header may take to arrive, 0 for no limit
+static unsigned write_timeout = 30; // Seconds a response may wait for the client to make room, 0 for no limit
+static int listen_fd = -1;
+static int epoll_fd = -1;
+static int signal_fd = -1;          // SIGINT, SIGTERM and SIGHUP, read by the event loop
+static bool accept_paused = false;  // max_connections was reached and the listener is not being drained
+static ParserInput* parser_input = NULL;    // Set while the parser harness drives a session, see parser_run
 
 // Flush the rest of the write buffer to the socket, and clear it out, however, don't block. This can return STREAM_END, STREAM_PENDING, STREAM_ERROR or STREAM_OK
 int Stream_Send(Stream* stream);
@@ -99,53 +329,92 @@ void Stream_Reset(Stream* stream, int socket);
 bool Stream_has_more(Stream* stream);
 
 Session* Session_create(int sock);
+void Session_release(Session* session);
+void Session_nextRequest(Session* session);
+bool session_reserve(char** pBuffer, size_t* pCap, size_t needed);
+bool session_input_append(Session* session, const char* data, size_t len);
+void session_pool_report(void);
+void wheel_schedule(Session* session);
+static void index_close(void);
+static void index_sync(void);
+static void sched_dequeue(Session* session);
+static double rate_burst(void);
+static void store_commit(const char* name, size_t size, uint64_t inode, void* blob);
+static hashtable_rc_t store_forget(const char* name, bool* pShared);
+void wheel_cancel(Session* session);
+static void wheel_reschedule(Session* session);
+void metrics_request_done(Session* session);
+void session_start_stats(Session* session);
+void session_start_partial(Session* session);
+void get_cache_report(void);
+void get_cache_invalidate(const char* name);
 void session_start_list(Session *session);
+void session_start_listpage(Session *session, size_t cursor, size_t limit);
 void session_start_get(Session* session);
-void session_start_put(Session* session, size_t cmdLen);
+void session_start_put(Session* session);
 
 bool continue_reading_header(Session* session);
+bool continue_writing(Session* session);
 bool continue_sending_get(Session* session);
+bool continue_writing_list(Session* session);
 bool continue_reading_put(Session* session);
+bool continue_reading_put_frames(Session* session);
 void session_start_delete(Session *session);
-bool TryParse(Session* session, char* cmd, bool hasFilename);
+verb parse_header(Session* session);
 int Session_processNext(Session* session);
 void write_short_string(Session* session, char* str);
 
 void insert_size_into_mem(char* pBuffer, size_t size);
-void send_all(char* buffer, size_t size, int sock);
-void write_all(FILE* f, char* buffer, size_t size);
+void session_send(Session* session, const char* data, size_t len);
+static void session_out_reset(Session* session);
+static char* session_out_space(Session* session, size_t needed);
+static void session_queue(Session* session, const char* data, size_t len);
+static bool session_flush(Session* session);
+static bool session_writing(Session* session);
+static void response_release(Session* session);
+ssize_t continue_receiving_put(Session* session, size_t limit);
+int put_store(Session* session, char* data, size_t size);
+int put_finish(Session* session);
+int pwrite_all(int fd, char* buffer, size_t size, off_t offset);
 int remove_directory(const char *path);
 int set_sighandler(sighandler_t sig_usr);
-int exist_in_vector(vector* vector, char *filename);
 
 typedef void (*sighandler_t) (int);
 
 static void print_usage(const char* progname)
 {
-  fprintf(stderr, "Usage: %s <port>\n", progname);
+  fprintf(stderr, "Usage: %s <port> [--noverbose] [--direct-io] [--io-uring] [--cache-size <bytes>]\n"
+                  "       [--log-level <error|warn|info|debug>] [--log-rate <messages per second>]\n"
+                  "       [--backlog <n>] [--max-connections <n>] [--idle-timeout <s>] [--header-timeout <s>]\n"
+                  "       [--write-timeout <s>] [--data-dir <path>] [--dedup] [--fsync] [--group-commit]\n"
+                  "       [--read-quantum <bytes>] [--client-rate <bytes per second>]\n"
+                  "       %s --bench-parser [requests per verb]\n", progname, progname);
 }
 
+// Only SIGPIPE and SIGCHLD get here, and both are ignored. The shutdown signals are read from signal_fd
 static void sig_usr_un(int signo)
 {
-  if (signo == SIGCHLD || signo == SIGPIPE)
-    return;
+  (void)signo;
+}
 
+// A shutdown signal was read from signal_fd. This runs on the event loop rather than in a handler, so the
+// reports, the index and the log writer can take their locks
+static void server_shutdown(int signo)
+{
   LOG("nbnserver: Signal %d received.\n", signo);
-  
-  remove_directory(base_temp_dir);
+
+  session_pool_report();
+  get_cache_report();
+  if(data_dir)
+    index_close();
+  else
+    remove_directory(base_temp_dir);
   LOG("nbnserver: Finished.\n");
   exit(0);
-
-  return;
 }
 
 int set_sighandler(sighandler_t sig_usr)
 {
-  if (signal(SIGINT, sig_usr) == SIG_ERR ) {
-    LOG("No SIGINT signal handler can be installed.\n");
-    return -1;
-  }
-    
   if (signal(SIGPIPE, sig_usr) == SIG_ERR ) {
     LOG("No SIGPIPE signal handler can be installed.\n");
     return -1;
@@ -156,32 +425,21 @@ int set_sighandler(sighandler_t sig_usr)
     return -1;
   }
 
-  if (signal(SIGTERM , sig_usr)  == SIG_ERR ) {
-    LOG("No SIGTERM signal handler can be installed.\n");
-    return -1;
-  }
-
-  if (signal(SIGHUP , sig_usr)  == SIG_ERR ) {
-    LOG("No SIGHUP signal handler can be installed.\n");
+  // Blocked before the log writer starts, so no thread takes them, and handed to the event loop instead
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGHUP);
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1 ||
+      (signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
+    LOG("No SIGINT, SIGTERM or SIGHUP signalfd can be set up.\n");
     return -1;
   }
 
   return 0;
 }
 
-int exist_in_vector(vector* vector, char *data)
-{
-    int ret = 0;
-    VECTOR_FOR_EACH(vector, item, {
-        if(!strcmp(data, item)) {
-            ret = 1;
-            break;
-        }
-    });
-    return ret;
-}
-
-
 int remove_directory(const char *path) {
    DIR *d = opendir(path);
    size_t path_len = strlen(path);
@@ -235,541 +493,3800 @@ static void send_header_response(Session *session, char *msgcode, const char *ms
 
     char errmsg[BUFSIZ];
     if(msg != NULL) {
-        sprintf(errmsg, "%s\n%s\n", msgcode, msg);
-        send_all(errmsg, strlen(errmsg), session->stream.socket);
+        // Most of the messages from format.c already end in a newline, don't send a second one
+        size_t len = strlen(msg);
+        sprintf(errmsg, "%s\n%s%s", msgcode, msg, (len > 0 && msg[len-1] == '\n') ? "" : "\n");
+        session_send(session, errmsg, strlen(errmsg));
     } else {
         sprintf(errmsg, "%s\n", msgcode);
-        send_all(errmsg, strlen(errmsg), session->stream.socket);
+        session_send(session, errmsg, strlen(errmsg));
     }
     
-    if( !strcmp(msgcode, "OK") ) {
+    if( !strcmp(msgcode, "OK") || msg == err_no_such_file ) {
+        // The request was well formed, so a persistent connection can go on to the next one
         session->state = STATE_DONE;
         session->status = STATUS_SESSION_END;
     } else {
         session->state = STATE_DONE;
         session->status = STATUS_SESSION_ERROR;
     }
+    if( strcmp(msgcode, "OK") )
+        session->requestFailed = true;
 }
 
-bool TryParse(Session* session, char* cmd, bool hasFilename) {
-    size_t cmdLen = strlen(cmd);
+// How each verb starts on the wire, indexed by the verb enum. Used to reject a partial header early
+static const char* verb_prefixes[] = { "GET ", "PUT ", "DELETE ", "LIST\n", "KEEPALIVE\n", "STATS\n",
+                                        "GETRANGE ", "PUTFROM ", "PARTIAL ", "GETZ ", "PUTZ ", "LISTPAGE " };
 
-    if(strncmp(session->input, cmd, cmdLen) != 0)
-        return false;
+// Could the partial header in input still turn into a valid request once more data arrives
+static bool header_prefix_valid(const char* input, size_t len) {
+    for(size_t i=0; i < sizeof(verb_prefixes)/sizeof(verb_prefixes[0]); i++) {
+        size_t prefixLen = strlen(verb_prefixes[i]);
+        if(!memcmp(input, verb_prefixes[i], len < prefixLen ? len : prefixLen))
+            return true;
+    }
+    return false;
+}
 
-    if(hasFilename) {
-        if(session->input[cmdLen] != ' ') {
-            fprintf(stderr, "Did not find newline at end of header\n");
-            send_header_response(session, "ERROR", err_bad_request);
-            return false;
-        }
-        char* nl = strchr(session->input, '\n');
-        if(nl == NULL) {
-            fprintf(stderr, "Did not find newline at end of header\n");
-            send_header_response(session, "ERROR", err_bad_request);
+// GETRANGE, PUTFROM and LISTPAGE carry their numbers in front of the filename, "<n> [<n>] name". Move count of
+// them into values and leave just the name in filename, which LISTPAGE may leave out. Returns false if they are
+// malformed
+static bool session_take_numbers(Session* session, int count, size_t* values, bool nameOptional)
+{
+    char* p = session->filename;
+    for(int i=0; i < count; i++) {
+        if(!isdigit((unsigned char)*p))
             return false;
-        }
-        char* filenameStart = &session->input[cmdLen+1];
-        strncpy(session->filename, filenameStart, nl - filenameStart);
-        session->filename[nl - filenameStart] = '\0';
-    } else {
-        if(session->input[cmdLen] != '\n') {
-            fprintf(stderr, "Did not find newline at end of header\n");
-            send_header_response(session, "ERROR", err_bad_request);
+        char* end = NULL;
+        errno = 0;
+        unsigned long long value = strtoull(p, &end, 10);
+        if(errno || (*end != ' ' && !(nameOptional && *end == '\0' && i == count - 1)))
             return false;
-        }
+        values[i] = value;
+        p = *end ? end + 1 : end;
     }
-        
+    if(*p == '\0' && !nameOptional)
+        return false;
+    // The same rule parse_header applies to the names of the other verbs
+    if(*p == '.')
+        return false;
+    memmove(session->filename, p, strlen(p) + 1);
     return true;
 }
 
-// Called when we get data and we are in the middle of reading the header
-bool continue_reading_header(Session* session) {
-    do
-    {
-        int c = Stream_GetNext(&session->stream);
-        if(c == STREAM_END) {
-            //send_short_string("Invalid request\n"); // TODO replace this with the correct string
-            //session->status = STATUS_SESSION_END;
-            break;
-        }
-        session->input[session->inputPos++] = c;
-        
-    } while(session->state == STATE_READING_HEADER);
-
-    if(TryParse(session, "LIST", false))
-        session_start_list(session);
-    else if(TryParse(session, "GET", true))
-        session_start_get(session);
-    else if(TryParse(session, "PUT", true))
-        session_start_put(session, 3);
-    else if(TryParse(session, "DELETE", true))
-        session_start_delete(session);
-    else if(session->state == STATE_READING_HEADER) {
-        int err = 0;
-        if(session->input[0] != 'G' && session->input[0] != 'P' && session->input[0] != 'L' && session->input[0] != 'D')
-            err = 1;
-        else if(session->inputPos >=3 && session->input[0] == 'G' && strncmp(session->input, "GET", 3) )
-            err = 1;
-        else if(session->inputPos >=3 && session->input[0] == 'P' && strncmp(session->input, "PUT", 3) )
-            err = 1;
-        else if(session->inputPos >=4 && session->input[0] == 'L' && strncmp(session->input, "LIST", 4) )
-            err = 1;
-        else if(session->inputPos >=6 && session->input[0] == 'D' && strncmp(session->input, "DELETE", 6) )
-            err = 1;
-
-        if(err) {
-            fprintf(stderr, "Unknown Request\n");
-            send_header_response(session, "ERROR", err_bad_request);
-            return false;
+// Returns false if the path doesn't fit in the buffer
+static bool partial_path(const char* name, char* buffer, size_t size)
+{
+    int len = snprintf(buffer, size, "%s/" PARTIAL_DIR "/%s", base_temp_dir, name);
+    return len >= 0 && (size_t)len < size;
+}
+
+/*
+   Dedup store
+   With --dedup a PUT is hashed with SHA-256 as it is written. Once it is complete the file becomes the blob
+   BLOB_DIR/<digest>, or is dropped if that blob already exists, and the catalog entry refers to the blob.
+   Blobs are counted by the entries that refer to them and unlinked when the last one goes.
+   The table and the counts are guarded by blob_store.lock, taken after any shard lock
+*/
+typedef struct Blob {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    size_t size;
+    uint32_t refs;
+    struct Blob* next;      // Chain in the blob table
+} Blob;
+
+typedef struct {
+    pthread_mutex_t lock;
+    Blob** buckets;
+    size_t numBuckets;      // Power of two
+    size_t count;
+    size_t bytes;           // Stored once for all the blobs
+    size_t referenced;      // What the names refer to, the difference is what dedup saved
+} BlobStore;
+
+static BlobStore blob_store = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Returns false if the path doesn't fit in the buffer
+static bool blob_path(const Blob* blob, char* buffer, size_t size)
+{
+    int len = snprintf(buffer, size, "%s/" BLOB_DIR "/", base_temp_dir);
+    if(len < 0 || (size_t)len + 2 * SHA256_DIGEST_SIZE >= size)
+        return false;
+    for(int i=0; i < SHA256_DIGEST_SIZE; i++, len += 2)
+        sprintf(&buffer[len], "%02x", blob->digest[i]);
+    return true;
+}
+
+static size_t blob_bucket(const uint8_t* digest, size_t numBuckets)
+{
+    uint64_t hash;
+    memcpy(&hash, digest, sizeof(hash));
+    return hash & (numBuckets - 1);
+}
+
+// blob_find, blob_add, blob_hold and blob_drop are called with blob_store.lock held
+static Blob* blob_find(const uint8_t* digest)
+{
+    if(blob_store.numBuckets == 0)
+        return NULL;
+    Blob* blob = blob_store.buckets[blob_bucket(digest, blob_store.numBuckets)];
+    while(blob && memcmp(blob->digest, digest, SHA256_DIGEST_SIZE))
+        blob = blob->next;
+    return blob;
+}
+
+// Add a blob with no references yet. Returns NULL if memory ran out
+static Blob* blob_add(const uint8_t* digest, size_t size)
+{
+    if(blob_store.count + 1 > blob_store.numBuckets) {
+        size_t numBuckets = blob_store.numBuckets ? blob_store.numBuckets * 2 : 1024;
+        Blob** buckets = calloc(numBuckets, sizeof(Blob*));
+        if(buckets == NULL)
+            return NULL;
+        for(size_t i=0; i < blob_store.numBuckets; i++) {
+            Blob* blob = blob_store.buckets[i];
+            while(blob) {
+                Blob* next = blob->next;
+                size_t bucket = blob_bucket(blob->digest, numBuckets);
+                blob->next = buckets[bucket];
+                buckets[bucket] = blob;
+                blob = next;
+            }
         }
+        free(blob_store.buckets);
+        blob_store.buckets = buckets;
+        blob_store.numBuckets = numBuckets;
     }
-    return false;//Session_has_more(&session->stream);
+
+    Blob* blob = calloc(1, sizeof(Blob));
+    if(blob == NULL)
+        return NULL;
+    memcpy(blob->digest, digest, SHA256_DIGEST_SIZE);
+    blob->size = size;
+    size_t bucket = blob_bucket(digest, blob_store.numBuckets);
+    blob->next = blob_store.buckets[bucket];
+    blob_store.buckets[bucket] = blob;
+    blob_store.count++;
+    blob_store.bytes += size;
+    return blob;
 }
 
-static void sending_put_response(Session* session, char *msgcode, const char *msg)
+static void blob_hold(Blob* blob)
 {
-    fclose(session->fd);
-    send_header_response(session, msgcode, msg);
-    int exist = exist_in_vector(directory, session->filename);
+    blob->refs++;
+    blob_store.referenced += blob->size;
+}
 
-    if( !strcmp(msgcode, "OK") ) {
-        if(!exist) {
-            vector_push_back(directory, strdup(session->filename));
-        }
+// Drop a reference, the blob and its file go with the last one
+static void blob_drop(Blob* blob)
+{
+    blob_store.referenced -= blob->size;
+    if(--blob->refs > 0)
+        return;
+
+    char path[BUFSIZ];
+    if(blob_path(blob, path, sizeof(path)))
+        unlink(path);
+    Blob** link = &blob_store.buckets[blob_bucket(blob->digest, blob_store.numBuckets)];
+    while(*link != blob)
+        link = &(*link)->next;
+    *link = blob->next;
+    blob_store.count--;
+    blob_store.bytes -= blob->size;
+    free(blob);
+}
+
+static void blob_release(Blob* blob)
+{
+    pthread_mutex_lock(&blob_store.lock);
+    blob_drop(blob);
+    pthread_mutex_unlock(&blob_store.lock);
+}
+
+// Turn the complete upload at path into a reference to its blob. Returns NULL if the file has to stay
+// where it is, because the blob could not be made. The lock is held across the rename, so two uploads of
+// the same bytes can't both make the blob
+static Blob* blob_adopt(Session* session, const char* path)
+{
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256_final(&session->putHash, digest);
+
+    pthread_mutex_lock(&blob_store.lock);
+    Blob* blob = blob_find(digest);
+    if(blob) {
+        // The same bytes are already stored
+        unlink(path);
     } else {
-        char fullpath[BUFSIZ];
-        snprintf(fullpath, sizeof(fullpath), "%s/%s", base_temp_dir, session->filename);
-        unlink(fullpath);
-        if(exist) {
-            for(size_t i=0; i < vector_size(directory); i++) {
-                char *diritem = vector_get(directory, i);
-                if( !strcmp(session->filename, diritem) ) {
-                    snprintf(fullpath, sizeof(fullpath), "%s/%s", base_temp_dir, session->filename);
-                    free(diritem);
-                    vector_erase(directory, i); 
-                    break;
-                }
-            }
+        blob = blob_add(digest, session->totalWritten);
+        if(blob == NULL) {
+            pthread_mutex_unlock(&blob_store.lock);
+            return NULL;
+        }
+        char target[BUFSIZ];
+        bool fits = blob_path(blob, target, sizeof(target));
+        if(!fits || rename(path, target) == -1) {
+            log_message(LOG_ERROR, "Can't store blob: %s", strerror(fits ? errno : ENAMETOOLONG));
+            blob_hold(blob);
+            blob_drop(blob);
+            pthread_mutex_unlock(&blob_store.lock);
+            return NULL;
         }
     }
+    blob_hold(blob);
+    pthread_mutex_unlock(&blob_store.lock);
+    return blob;
 }
 
-bool continue_reading_put(Session* session)
+// A PUTFROM goes on from bytes that were not hashed as they arrived, so hash them from the partial file first
+static bool put_hash_prefix(Session* session)
 {
-    if(session->state == STATE_READING_PUT_SIZE) {
-        do
-        {
-            int c = Stream_GetNext(&session->stream);
-            if(c == STREAM_END) {
-                break;
-            }
-            session->input[session->inputPos++] = c;
-            
-        } while(1);
-        
-        if(session->inputPos >= session->headersize + 8) {
-            char buffer[BUFSIZ] = "";
-            memcpy(&session->totalBytesForPut, &session->input[session->headersize], sizeof(size_t));
-            
-            LOG("PUT requested for '%s' with file size %zu bytes", session->filename, session->totalBytesForPut);
-            LOG("Reading binary data from request");
-    
-            snprintf(buffer, sizeof(buffer), "%s/%s", base_temp_dir, session->filename);
-            session->fd = fopen(buffer, "wb");
-            if(session->fd == NULL) {
-                fprintf(stderr, "%s\n", strerror(errno));
-                send_header_response(session, "ERROR", "An internal error ocurred");
-                return false;
-            }
-    
-            size_t nowWritingBytes = session->inputPos - session->headersize - 8;
-            if(nowWritingBytes > 0) {
-                write_all(session->fd, &session->input[session->headersize + 8], nowWritingBytes);
-                session->totalWritten = nowWritingBytes;
-            }
-            session->state = STATE_READING_PUT_DATA;
-        }
+    char buffer[65536];
+    size_t offset = 0;
+    while(offset < session->rangeOffset) {
+        size_t wanted = session->rangeOffset - offset < sizeof(buffer) ? session->rangeOffset - offset : sizeof(buffer);
+        ssize_t count = pread(session->fd, buffer, wanted, offset);
+        if(count <= 0)
+            return false;
+        sha256_update(&session->putHash, buffer, count);
+        offset += count;
     }
-    else {
-        write_all(session->fd, session->stream.buffer, session->stream.bytesInBuffer);
-        session->totalWritten += session->stream.bytesInBuffer;
+    return true;
+}
+
+// Where the contents of a stored file are: its own file, or the blob it refers to in the dedup store.
+// Returns false if the path doesn't fit in the buffer
+static bool stored_path(const char* name, char* buffer, size_t size)
+{
+    catalog_shard_t* shard = sharded_catalog_lock(&directory, name, false);
+    catalog_entry_t* entry = catalog_find(&shard->catalog, name);
+    bool fits;
+    if(entry && entry->blob) {
+        fits = blob_path(entry->blob, buffer, size);
+    } else {
+        int len = snprintf(buffer, size, "%s/%s", base_temp_dir, name);
+        fits = len >= 0 && (size_t)len < size;
     }
-    return false;
+    catalog_shard_unlock(shard);
+    return fits;
 }
 
-// Reset a stream to initial state with the socket passed in
-void Stream_Reset(Stream* stream, int socket) {
-    stream->socket = socket;
-    stream->position = 0;
-    stream->bytesInBuffer = 0;
-    stream->atEnd = false;
-    stream->inError = false;
+// Work out which bytes of a fileSize byte file a GET sends. Returns false if a GETRANGE starts past the end
+static bool get_range(Session* session, size_t fileSize, size_t* pStart, size_t* pCount)
+{
+    *pStart = 0;
+    *pCount = fileSize;
+    if(!session->ranged)
+        return true;
+    if(session->rangeOffset > fileSize)
+        return false;
+    *pStart = session->rangeOffset;
+    *pCount = fileSize - session->rangeOffset;
+    if(session->rangeLength > 0 && session->rangeLength < *pCount)
+        *pCount = session->rangeLength;
+    return true;
 }
 
-// Read the next character from the stream without blocking, or send back STREAM_END, STREAM_PENDING or STREAM_ERROR
-int Stream_GetNext(Stream* stream) {
-    assert(! stream->atEnd && ! stream->inError); // Shouldn't be called when the stream is no longer viable
-    if(stream->position < stream->bytesInBuffer) {
-        return stream->buffer[stream->position++];
+// Parse the complete header line in session->input (it ends with '\n') and copy out the filename.
+// Returns V_UNKNOWN if the header is malformed
+verb parse_header(Session* session) {
+    char* line = session->input;
+    char* nl = &session->input[session->inputPos - 1];
+    char* space = memchr(line, ' ', nl - line);
+    size_t verbLen = (space ? space : nl) - line;
+
+    verb v = V_UNKNOWN;
+    switch(verbLen) {
+        case 3:
+            if(!memcmp(line, "GET", 3))
+                v = GET;
+            else if(!memcmp(line, "PUT", 3))
+                v = PUT;
+            break;
+        case 4:
+            if(!memcmp(line, "LIST", 4))
+                v = LIST;
+            else if(!memcmp(line, "GETZ", 4))
+                v = GETZ;
+            else if(!memcmp(line, "PUTZ", 4))
+                v = PUTZ;
+            break;
+        case 5:
+            if(!memcmp(line, "STATS", 5))
+                v = STATS;
+            break;
+        case 6:
+            if(!memcmp(line, "DELETE", 6))
+                v = DELETE;
+            break;
+        case 7:
+            if(!memcmp(line, "PUTFROM", 7))
+                v = PUTFROM;
+            else if(!memcmp(line, "PARTIAL", 7))
+                v = PARTIAL;
+            break;
+        case 8:
+            if(!memcmp(line, "GETRANGE", 8))
+                v = GETRANGE;
+            else if(!memcmp(line, "LISTPAGE", 8))
+                v = LISTPAGE;
+            break;
+        case 9:
+            if(!memcmp(line, "KEEPALIVE", 9))
+                v = KEEPALIVE;
+            break;
     }
-    return STREAM_END;
-}
 
-// Write next character to buffer, and flush to stream if buffer is full. This can return STREAM_END, STREAM_PENDING, or STREAM_ERROR
-int Stream_WriteNext(Stream* stream, char c) {
-    assert(! stream->atEnd && ! stream->inError); // Shouldn't be called when the stream is no longer viable
-    if(stream->position == BUFSIZ) {
-        int result = 0;// = Stream_SendUntilBlock(stream);
-        if(result != STREAM_OK)
-            return result;
-        assert(stream->position = 0);
-        stream->buffer[stream->position++] = c;
+    bool hasFilename = v != LIST && v != KEEPALIVE && v != STATS;
+    if(v == V_UNKNOWN || hasFilename != (space != NULL))
+        return V_UNKNOWN;
+    // Names stay inside the storage directory and clear of the server's own dot files there, and can't be cut
+    // short by a '\0'
+    if(hasFilename && (space + 1 == nl || space[1] == '.' || memchr(space + 1, '/', nl - space - 1) ||
+                       memchr(space + 1, '\0', nl - space - 1)))
+        return V_UNKNOWN;
+
+    if(hasFilename) {
+        char* filenameStart = space + 1;
+        if(!session_reserve(&session->filename, &session->filenameCap, nl - filenameStart + 1))
+            return V_UNKNOWN;
+        memcpy(session->filename, filenameStart, nl - filenameStart);
+        session->filename[nl - filenameStart] = '\0';
     }
-    return STREAM_END;
+    return v;
 }
 
+// Called when we get data and we are in the middle of reading the header.
+// The received chunk is scanned for the newline with memchr and copied into input in one go
+bool continue_reading_header(Session* session) {
+    Stream* stream = &session->stream;
+    char* start = &stream->buffer[stream->position];
+    size_t available = stream->bytesInBuffer - stream->position;
+    char* nl = memchr(start, '\n', available);
+    size_t take = nl ? (size_t)(nl - start) + 1 : available;
 
-static int sending_get_response(Session* session) {
-    char *filename = session->filename;
-    int sock = session->stream.socket;
-    LOG("Get requested for '%s'", filename);
-    char buffer[BUFSIZ];
-    if(strlen(session->filename) == 0) {
-        fprintf(stderr, "Requested file not found\n");
-        send_header_response(session, "ERROR", err_no_such_file);
-        return false;
+    if(session->inputPos == 0) {
+        // The header deadline may come before the one the session is waiting on the wheel for
+        session->requestBegan = wheel.now;
+        wheel_reschedule(session);
     }
-    snprintf(buffer, sizeof(buffer), "%s/%s", base_temp_dir, filename);
-    struct stat file_info;
-    stat(buffer, &file_info);
-    FILE* f = fopen(buffer, "rb");
-    if(f == NULL) {
-        fprintf(stderr, "Requested file not found\n");
-        send_header_response(session, "ERROR", err_no_such_file);
-        return -1;
+    if(!session_input_append(session, start, take)) {
+        log_message(LOG_WARN, "Request header too long");
+        send_header_response(session, "ERROR", err_bad_request);
+        return false;
     }
-    // Set up the header
-    LOG("Writing header for response OK");
-    strcpy(buffer, "OK\n12345678"); // Note we will overwrite 12345678 with a size_t
-    char *pBuffer = buffer + strlen(buffer);
-    insert_size_into_mem(&buffer[3], file_info.st_size);
-    send_all(buffer, pBuffer - buffer, sock);
-    LOG("Writing payload for response OK");
-    size_t bytes_read = 0;
-    do
-    {
-        int count = fread(buffer, 1, BUFSIZ, f);
-        if(count <= 0) {
-            print_error_message("fread failed");
-            fclose(f);
-            session->state = STATE_INTERNAL_ERROR;
-            session->status = STATUS_SESSION_ERROR;
-            return -1;
-        }
-        bytes_read += count;
-        send_all(buffer, count, sock);
-    } while (bytes_read < (size_t)file_info.st_size);
-    fclose(f);
+    stream->position += take;
 
-    session->state = STATE_DONE;
-    session->status = STATUS_SESSION_END;
-
-    return 0;
-}
+    if(nl == NULL) {
+        if(!header_prefix_valid(session->input, session->inputPos)) {
+            log_message(LOG_WARN, "Unknown Request");
+            send_header_response(session, "ERROR", err_bad_request);
+        }
+        return false;
+    }
 
-void session_start_delete(Session *session)
-{
-    int result = 0;
-    char fullpath[BUFSIZ] = "";
-    
-    for(size_t i=0; i < vector_size(directory); i++) {
-        char *diritem = vector_get(directory, i);
-        if( !strcmp(session->filename, diritem) ) {
-            snprintf(fullpath, sizeof(fullpath), "%s/%s", base_temp_dir, session->filename);
-            free(diritem);
-            vector_erase(directory, i); 
+    verb v = parse_header(session);
+    if(v <= LIST || v == GETRANGE || v == PUTFROM || v == GETZ || v == PUTZ || v == LISTPAGE) {
+        // Ranged and compressed transfers are timed with the plain GET and PUT, and pages with LIST
+        session->requestVerb = v == GETRANGE || v == GETZ ? GET : v == PUTFROM || v == PUTZ ? PUT :
+                               v == LISTPAGE ? LIST : v;
+        session->requestFailed = false;
+        clock_gettime(CLOCK_MONOTONIC, &session->requestStart);
+    }
+    switch(v) {
+        case LIST:
+            session_start_list(session);
+            break;
+        case GET:
+            session_start_get(session);
+            break;
+        case PUT:
+            session_start_put(session);
+            break;
+        case DELETE:
+            session_start_delete(session);
+            break;
+        case KEEPALIVE:
+            session->keepAlive = true;
+            send_header_response(session, "OK", NULL);
+            break;
+        case STATS:
+            session_start_stats(session);
+            break;
+        case GETRANGE: {
+            size_t range[2];
+            if(!session_take_numbers(session, 2, range, false)) {
+                send_header_response(session, "ERROR", err_bad_request);
+                break;
+            }
+            session->ranged = true;
+            session->rangeOffset = range[0];
+            session->rangeLength = range[1];
+            session_start_get(session);
             break;
         }
+        case PUTFROM:
+            if(!session_take_numbers(session, 1, &session->rangeOffset, false)) {
+                send_header_response(session, "ERROR", err_bad_request);
+                break;
+            }
+            session->putResume = true;
+            session_start_put(session);
+            break;
+        case PARTIAL:
+            session_start_partial(session);
+            break;
+        case GETZ:
+            session->compressed = true;
+            session_start_get(session);
+            break;
+        case PUTZ:
+            session->compressed = true;
+            session_start_put(session);
+            break;
+        case LISTPAGE: {
+            size_t page[2];
+            if(!session_take_numbers(session, 2, page, true)) {
+                send_header_response(session, "ERROR", err_bad_request);
+                break;
+            }
+            session_start_listpage(session, page[0], page[1]);
+            break;
+        }
+        default:
+            METRIC_ADD(metrics.badRequests, 1);
+            log_message(LOG_WARN, "Unknown Request");
+            send_header_response(session, "ERROR", err_bad_request);
+            break;
     }
-    
-    result = unlink(fullpath);
-    if(result == 0) {
-        send_header_response(session, "OK", NULL);
-    } else {
-        send_header_response(session, "ERROR", err_no_such_file);
-    }
+    // A finished request may be followed by the next pipelined one, and PUTZ frames behind the header are
+    // taken from the stream buffer
+    return session->state == STATE_DONE ||
+           (session->state == STATE_READING_PUT_FRAMES && Stream_has_more(&session->stream));
 }
 
-void session_start_list(Session *session)
+static void sending_put_response(Session* session, char *msgcode, const char *msg);
+
+// Check the payload against the announced size and answer the PUT. Called at EOF, or on a persistent
+// connection as soon as the announced number of bytes has arrived
+static void finish_put(Session* session)
 {
-    char buffer[BUFSIZ];
-    
-    // Note we assume there is a vector called directory storing the directory of all files in the temp folder
-    // We do this as per instructions rather than reading the filesystem directly.
-    size_t sizeCount = 0;
-    VECTOR_FOR_EACH(directory, diritem, {
-        sizeCount += strlen(diritem) + 1; // +1 for the newline
-    });
-    
-    session->listData = calloc(1, sizeCount);
-    if(session->listData == NULL) {
-        print_error_message("calloc failed");
-        session->state = STATE_INTERNAL_ERROR;
-        session->status = STATUS_SESSION_ERROR;
-        return;
+    if(put_finish(session)) {
+        sending_put_response(session, "ERROR", "An internal error ocurred");
+    } else if(session->totalWritten < session->totalBytesForPut) {
+        print_too_little_data();
+        sending_put_response(session, "ERROR", err_bad_file_size);
+    } else if(session->totalWritten == session->totalBytesForPut) {
+        sending_put_response(session, "OK", NULL);
+    } else if(session->totalWritten > session->totalBytesForPut) {
+        print_received_too_much_data();
+        sending_put_response(session, "ERROR", err_bad_file_size);
     }
-    
-    char* end = session->listData;
-    VECTOR_FOR_EACH(directory, diritem, {
-        size_t len = strlen((char*)diritem);
-        strcpy(end, diritem);
-        end[len] = '\n';
-        end += len + 1;
-    });
-
-    // Set up the header
-    LOG("Writing header for response OK");
-    strcpy(buffer, "OK\n12345678"); // Note we will overwrite 12345678 with a size_t
-    char *pBuffer = buffer + strlen(buffer);
-    insert_size_into_mem(&buffer[3], sizeCount);
-    send_all(buffer, pBuffer - buffer, session->stream.socket);
-    LOG("Writing payload for response OK");
-    send_all(session->listData, sizeCount, session->stream.socket);
-    free(session->listData);
-    session->listData = NULL;
+}
 
-    session->state = STATE_DONE;
-    session->status = STATUS_SESSION_END;
+/*
+   Publishing a PUT
+   The payload goes to a temp file under INCOMING_DIR (the partial store for PUTFROM) and is renamed over the
+   stored file once it is complete, so a GET sees the old contents or the new ones but never part of an upload,
+   and a failed PUT leaves the stored file as it was. With --fsync the data is synced before the rename and the
+   directory after it, before OK is sent. --group-commit holds the PUTs that complete in one loop iteration and
+   settles them together: one syncfs for all their data and one directory sync for all their renames.
+*/
 
+// Where a PUT writes its payload until it is complete. Returns false if the path doesn't fit in the buffer
+static bool upload_path(Session* session, char* buffer, size_t size)
+{
+    if(session->putResume)
+        return partial_path(session->filename, buffer, size);
+    int len = snprintf(buffer, size, "%s/" INCOMING_DIR "/%d", base_temp_dir, session->stream.socket);
+    return len >= 0 && (size_t)len < size;
 }
 
-void session_start_get(Session* session) {
-    sending_get_response(session);
+// Flush the renames of published PUTs, and their index records, to disk
+static void put_sync_metadata(void)
+{
+    char path[BUFSIZ];
+    const char* dirs[] = { "", "/" BLOB_DIR };
+    for(int i=0; i < (dedup_flag ? 2 : 1); i++) {
+        snprintf(path, sizeof(path), "%s%s", base_temp_dir, dirs[i]);
+        int fd = open(path, O_RDONLY | O_DIRECTORY);
+        if(fd == -1 || fsync(fd) == -1)
+            log_message(LOG_ERROR, "Can't sync '%s': %s", path, strerror(errno));
+        if(fd != -1)
+            close(fd);
+    }
+    index_sync();
+}
+
+// Close the upload and move it into place if the PUT succeeded, or throw it away if it didn't.
+// *pMsgcode and *pMsg are changed to an internal error if the file can't be stored
+static void put_settle(Session* session, char** pMsgcode, const char** pMsg)
+{
+    close(session->fd);
+    session->fd = -1;
+
+    char fullpath[BUFSIZ];
+    char source[BUFSIZ];
+    char partial[BUFSIZ];
+    int len = snprintf(fullpath, sizeof(fullpath), "%s/%s", base_temp_dir, session->filename);
+    // A name too long for the paths can't be stored
+    bool named = len >= 0 && (size_t)len < sizeof(fullpath) && partial_path(session->filename, partial, sizeof(partial));
+    upload_path(session, source, sizeof(source));
+
+    if( !strcmp(*pMsgcode, "OK") && !named ) {
+        log_message(LOG_ERROR, "Can't store '%s': %s", session->filename, strerror(ENAMETOOLONG));
+        unlink(source);
+        *pMsgcode = "ERROR";
+        *pMsg = "An internal error ocurred";
+        return;
+    }
+    if( !strcmp(*pMsgcode, "OK") ) {
+        struct stat file_info;
+        uint64_t inode = stat(source, &file_info) ? 0 : file_info.st_ino;
+        Blob* blob = session->putHashing ? blob_adopt(session, source) : NULL;
+        if(blob == NULL && rename(source, fullpath) == -1) {
+            log_message(LOG_ERROR, "Can't store '%s': %s", session->filename, strerror(errno));
+            unlink(source);
+            *pMsgcode = "ERROR";
+            *pMsg = "An internal error ocurred";
+            return;
+        }
+        // A complete upload supersedes an interrupted one
+        if(!session->putResume)
+            unlink(partial);
+        // The stored file has been replaced, a cached copy is stale
+        get_cache_invalidate(session->filename);
+        store_commit(session->filename, session->totalWritten, inode, blob);
+        // An older version that was a file of its own
+        if(blob)
+            unlink(fullpath);
+        return;
+    }
+
+    // An upload that was cut short is kept in the partial store, so PUTFROM can go on from where it stopped
+    bool keepPartial = named && *pMsg == err_bad_file_size && session->totalWritten < session->totalBytesForPut &&
+                       session->putOffset > 0;
+    if(!keepPartial || (!session->putResume && rename(source, partial) == -1))
+        unlink(source);
+}
+
+// PUTs waiting for the group commit at the end of the loop iteration, in the order they completed
+static Session* commit_queue = NULL;
+static Session** commit_tail = &commit_queue;
+
+static void sending_put_response(Session* session, char *msgcode, const char *msg)
+{
+    if( !strcmp(msgcode, "OK") && group_commit_flag && !ring_active ) {
+        // put_commit_flush settles and answers it
+        session->state = STATE_COMMITTING;
+        session->commitError = NULL;
+        session->closeAfterCommit = false;
+        session->commitNext = NULL;
+        *commit_tail = session;
+        commit_tail = &session->commitNext;
+        return;
+    }
+    if( !strcmp(msgcode, "OK") && fsync_flag && fdatasync(session->fd) == -1 ) {
+        log_message(LOG_ERROR, "Can't sync '%s': %s", session->filename, strerror(errno));
+        msgcode = "ERROR";
+        msg = "An internal error ocurred";
+    }
+    put_settle(session, &msgcode, &msg);
+    if( !strcmp(msgcode, "OK") && fsync_flag )
+        put_sync_metadata();
+    send_header_response(session, msgcode, msg);
+}
+
+static void session_readable(int sock);
+static void end_session(int sock);
+static void client_closed(int sock, Session* session);
+
+// Settle and answer the PUTs parked in this loop iteration. One syncfs writes back the data of the whole batch
+// for about the cost of syncing one file. Each session then goes on with whatever it pipelined behind its PUT
+static void put_commit_flush(void)
+{
+    // Going on may complete more PUTs, they make up the next batch
+    while(commit_queue) {
+        Session* batch = commit_queue;
+        commit_queue = NULL;
+        commit_tail = &commit_queue;
+
+        bool synced = batch->commitNext && syncfs(batch->fd) == 0;
+        for(Session* session = batch; session; session = session->commitNext) {
+            if(!synced && fdatasync(session->fd) == -1) {
+                log_message(LOG_ERROR, "Can't sync '%s': %s", session->filename, strerror(errno));
+                session->commitError = "An internal error ocurred";
+            }
+        }
+        for(Session* session = batch; session; session = session->commitNext) {
+            char* msgcode = session->commitError ? "ERROR" : "OK";
+            const char* msg = session->commitError;
+            put_settle(session, &msgcode, &msg);
+            session->commitError = msg;
+        }
+        put_sync_metadata();
+
+        Session* next;
+        for(Session* session = batch; session; session = next) {
+            next = session->commitNext;
+            session->commitNext = NULL;
+            int sock = session->stream.socket;
+            send_header_response(session, session->commitError ? "ERROR" : "OK", session->commitError);
+            if(session->closeAfterCommit) {
+                client_closed(sock, session);
+                continue;
+            }
+            Session_processNext(session);
+            if(session->keepAlive && session->status == STATUS_SESSION_ERROR)
+                client_closed(sock, session);
+            else
+                session_readable(sock);
+        }
+    }
+}
+
+bool continue_reading_put(Session* session)
+{
+    if(session->state == STATE_READING_PUT_SIZE) {
+        // The size follows the header line in input, it may arrive split across reads
+        Stream* stream = &session->stream;
+        size_t have = session->inputPos - session->headersize;
+        size_t available = stream->bytesInBuffer - stream->position;
+        size_t take = sizeof(size_t) - have;
+        if(take > available)
+            take = available;
+        if(!session_input_append(session, &stream->buffer[stream->position], take)) {
+            send_header_response(session, "ERROR", err_bad_request);
+            return false;
+        }
+        stream->position += take;
+
+        if(session->inputPos >= session->headersize + 8) {
+            char buffer[BUFSIZ] = "";
+            memcpy(&session->totalBytesForPut, &session->input[session->headersize], sizeof(size_t));
+            
+            LOG("PUT requested for '%s' with file size %zu bytes", session->filename, session->totalBytesForPut);
+            LOG("Reading binary data from request");
+    
+            // The stored file is only replaced once the upload is complete, a resumed one carries on in the partial store
+            if(!upload_path(session, buffer, sizeof(buffer))) {
+                log_message(LOG_WARN, "File name too long: '%s'", session->filename);
+                send_header_response(session, "ERROR", err_bad_request);
+                return false;
+            }
+            int flags = O_WRONLY | O_CREAT | O_TRUNC;
+            if(session->putResume)
+                flags = O_RDWR | (session->rangeOffset == 0 ? O_CREAT : 0);
+            session->fd = -1;
+            if(direct_io_flag && !session->putResume) {
+                session->fd = open(buffer, flags | O_DIRECT, 0644);
+                session->putDirect = session->fd != -1;
+            }
+            // Not every filesystem supports O_DIRECT (tmpfs doesn't), fall back to the page cache
+            if(session->fd == -1)
+                session->fd = open(buffer, flags, 0644);
+            if(session->fd == -1 && session->putResume) {
+                log_message(LOG_WARN, "No partial upload of '%s' to resume", session->filename);
+                send_header_response(session, "ERROR", err_bad_range);
+                return false;
+            }
+            if(session->fd == -1) {
+                log_message(LOG_ERROR, "%s", strerror(errno));
+                send_header_response(session, "ERROR", "An internal error ocurred");
+                return false;
+            }
+            if(session->putResume) {
+                // Whatever the partial file holds past the resume offset is dropped
+                struct stat file_info;
+                if(fstat(session->fd, &file_info) == -1 || (size_t)file_info.st_size < session->rangeOffset ||
+                   session->totalBytesForPut < session->rangeOffset ||
+                   ftruncate(session->fd, session->rangeOffset) == -1) {
+                    log_message(LOG_WARN, "Can't resume '%s' at %zu", session->filename, session->rangeOffset);
+                    close(session->fd);
+                    session->fd = -1;
+                    send_header_response(session, "ERROR", err_bad_range);
+                    return false;
+                }
+            }
+
+            // Reserve the blocks up front so the file is laid out in one piece. KEEP_SIZE so readers
+            // never see a file that is longer than what has been written
+            if(session->totalBytesForPut > 0 &&
+               fallocate(session->fd, FALLOC_FL_KEEP_SIZE, 0, session->totalBytesForPut) == -1 &&
+               errno == ENOSPC) {
+                log_message(LOG_ERROR, "%s", strerror(errno));
+                sending_put_response(session, "ERROR", "An internal error ocurred");
+                return false;
+            }
+
+            if(dedup_flag) {
+                sha256_init(&session->putHash);
+                session->putHashing = !session->putResume || put_hash_prefix(session);
+            }
+
+            // A resumed upload counts the bytes already stored as received
+            session->putOffset = session->putResume ? session->rangeOffset : 0;
+            session->totalWritten = session->putOffset;
+            session->putTailLen = 0;
+
+            if(session->compressed) {
+                // PUTZ frames come through the stream buffer, see continue_reading_put_frames
+                if(session->frame == NULL)
+                    session->frame = malloc(LZ_FRAME_HEADER + LZ_FRAME_SIZE);
+                if(session->frame == NULL) {
+                    print_error_message("malloc failed");
+                    sending_put_response(session, "ERROR", "An internal error ocurred");
+                    return false;
+                }
+                session->frameLen = 0;
+                session->state = STATE_READING_PUT_FRAMES;
+                return Stream_has_more(stream);
+            }
+            session->state = STATE_READING_PUT_DATA;
+
+            // Whatever followed the size in this read is the start of the payload. On a persistent connection
+            // the payload is length framed and anything after it belongs to the next request
+            size_t nowWritingBytes = stream->bytesInBuffer - stream->position;
+            if(session->keepAlive && nowWritingBytes > session->totalBytesForPut - session->totalWritten)
+                nowWritingBytes = session->totalBytesForPut - session->totalWritten;
+            if(nowWritingBytes > 0) {
+                session->totalWritten += nowWritingBytes;
+                memcpy(put_buffer, &stream->buffer[stream->position], nowWritingBytes);
+                stream->position += nowWritingBytes;
+                if(put_store(session, put_buffer, nowWritingBytes)) {
+                    sending_put_response(session, "ERROR", "An internal error ocurred");
+                    return false;
+                }
+            }
+            if(session->keepAlive && session->totalWritten == session->totalBytesForPut)
+                finish_put(session);
+        }
+    }
+    return session->state == STATE_DONE;
+}
+
+// Take PUTZ frames from the stream buffer. Each complete frame is decompressed into put_buffer, behind any
+// O_DIRECT tail carried over from the last one, and stored. The end frame finishes the PUT
+bool continue_reading_put_frames(Session* session)
+{
+    Stream* stream = &session->stream;
+    while(session->state == STATE_READING_PUT_FRAMES && Stream_has_more(stream)) {
+        uint32_t raw = 0, coded = 0;
+        size_t need = LZ_FRAME_HEADER;
+        if(session->frameLen >= LZ_FRAME_HEADER) {
+            memcpy(&raw, session->frame, 4);
+            memcpy(&coded, session->frame + 4, 4);
+            need += coded;
+        }
+        size_t take = need - session->frameLen;
+        if(take > stream->bytesInBuffer - stream->position)
+            take = stream->bytesInBuffer - stream->position;
+        memcpy(&session->frame[session->frameLen], &stream->buffer[stream->position], take);
+        session->frameLen += take;
+        stream->position += take;
+        if(session->frameLen < LZ_FRAME_HEADER)
+            break;
+
+        memcpy(&raw, session->frame, 4);
+        memcpy(&coded, session->frame + 4, 4);
+        if(raw > LZ_FRAME_SIZE || coded > raw || (raw == 0) != (coded == 0)) {
+            log_message(LOG_WARN, "Bad PUTZ frame for '%s'", session->filename);
+            sending_put_response(session, "ERROR", err_bad_request);
+            break;
+        }
+        if(raw == 0) {
+            session->frameLen = 0;
+            finish_put(session);
+            break;
+        }
+        if(session->frameLen < LZ_FRAME_HEADER + coded)
+            continue;
+
+        size_t carried = session->putTailLen;
+        if(carried > 0) {
+            memcpy(put_buffer, session->putTail, carried);
+            session->putTailLen = 0;
+        }
+        char* out = put_buffer + carried;
+        char* in = session->frame + LZ_FRAME_HEADER;
+        if(coded == raw) {
+            memcpy(out, in, raw);
+        } else if(lz_decompress((uint8_t*)in, coded, (uint8_t*)out, raw) != (ssize_t)raw) {
+            log_message(LOG_WARN, "Bad PUTZ frame for '%s'", session->filename);
+            sending_put_response(session, "ERROR", err_bad_request);
+            break;
+        }
+        session->frameLen = 0;
+        session->totalWritten += raw;
+        if(put_store(session, put_buffer, carried + raw)) {
+            sending_put_response(session, "ERROR", "An internal error ocurred");
+            break;
+        }
+    }
+    return session->state == STATE_DONE;
+}
+
+// Write size bytes of PUT payload that belong at putOffset. data must point into put_buffer.
+// Anything past the size the client announced is only counted, never written, since that upload is going to fail anyway
+int put_store(Session* session, char* data, size_t size)
+{
+    size_t room = 0;
+    if(session->putOffset + session->putTailLen < session->totalBytesForPut)
+        room = session->totalBytesForPut - session->putOffset - session->putTailLen;
+    if(size > room)
+        size = room;
+
+    size_t writable = size;
+    if(session->putDirect) {
+        // O_DIRECT only takes whole aligned blocks, the remainder waits in putTail for the next batch
+        writable = size & ~(size_t)(PUT_DIRECT_ALIGN - 1);
+        size_t tail = size - writable;
+        if(tail > 0) {
+            if(session->putTail == NULL)
+                session->putTail = malloc(PUT_DIRECT_ALIGN);
+            if(session->putTail == NULL) {
+                print_error_message("malloc failed");
+                return -1;
+            }
+            memcpy(session->putTail, data + writable, tail);
+        }
+        session->putTailLen = tail;
+    }
+
+    if(writable > 0) {
+        if(pwrite_all(session->fd, data, writable, session->putOffset))
+            return -1;
+        if(session->putHashing)
+            sha256_update(&session->putHash, data, writable);
+        session->putOffset += writable;
+    }
+    return 0;
+}
+
+// send to a connection, or nowhere while the parser harness is driving the session
+static ssize_t session_transmit(int sock, const void* buffer, size_t len)
+{
+    if(parser_input)
+        return len;
+    return send(sock, buffer, len, MSG_NOSIGNAL);
+}
+
+// recv from a connection, or from parser_input while the parser harness is driving the session
+static ssize_t session_recv(int sock, void* buffer, size_t len)
+{
+    ParserInput* input = parser_input;
+    if(input == NULL)
+        return recv(sock, buffer, len, 0);
+
+    size_t cut = input->numCuts ? input->cuts[input->nextCut++ % input->numCuts] : len;
+    if(cut == 0 && !input->stalled && input->position < input->size) {
+        input->stalled = true;
+        errno = EAGAIN;
+        return -1;
+    }
+    input->stalled = false;
+    if(cut == 0)
+        cut = 1;
+    if(cut > len)
+        cut = len;
+    if(cut > input->size - input->position)
+        cut = input->size - input->position;
+    memcpy(buffer, &input->data[input->position], cut);
+    input->position += cut;
+    return cut;
+}
+
+// Receive the next batch of PUT payload, at most limit bytes, straight into put_buffer and write it to the file.
+// Returns what recv returned, so the caller can tell EOF and EAGAIN apart
+ssize_t continue_receiving_put(Session* session, size_t limit)
+{
+    size_t carried = session->putTailLen;
+    if(carried > 0) {
+        // Put the unaligned tail of the last batch back in front so the block can be completed
+        memcpy(put_buffer, session->putTail, carried);
+        session->putTailLen = 0;
+    }
+
+    // Don't read past the payload on a persistent connection, the next request stays in the socket
+    size_t wanted = PUT_BUFFER_SIZE - carried;
+    if(session->keepAlive && session->totalBytesForPut - session->totalWritten < wanted)
+        wanted = session->totalBytesForPut - session->totalWritten;
+    if(wanted > limit)
+        wanted = limit;
+
+    ssize_t bytesRead = session_recv(session->stream.socket, put_buffer + carried, wanted);
+    if(bytesRead <= 0) {
+        session->putTailLen = carried;
+        return bytesRead;
+    }
+
+    session->totalWritten += bytesRead;
+    if(put_store(session, put_buffer, carried + bytesRead)) {
+        sending_put_response(session, "ERROR", "An internal error ocurred");
+    } else if(session->keepAlive && session->totalWritten == session->totalBytesForPut) {
+        finish_put(session);
+    }
+    return bytesRead;
+}
+
+// Write out whatever is still held back once the client has finished sending
+int put_finish(Session* session)
+{
+    if(session->putTailLen == 0)
+        return 0;
+
+    // The tail is shorter than a block, so it has to go through the page cache
+    int flags = fcntl(session->fd, F_GETFL);
+    if(flags == -1 || fcntl(session->fd, F_SETFL, flags & ~O_DIRECT) == -1)
+        return -1;
+    session->putDirect = false;
+    if(pwrite_all(session->fd, session->putTail, session->putTailLen, session->putOffset))
+        return -1;
+    if(session->putHashing)
+        sha256_update(&session->putHash, session->putTail, session->putTailLen);
+    session->putOffset += session->putTailLen;
+    session->putTailLen = 0;
+    return 0;
+}
+
+// Reset a stream to initial state with the socket passed in
+void Stream_Reset(Stream* stream, int socket) {
+    stream->socket = socket;
+    stream->position = 0;
+    stream->bytesInBuffer = 0;
+    stream->atEnd = false;
+    stream->inError = false;
+}
+
+// Return true is there is data still in the buffer unread
+bool Stream_has_more(Stream* stream) {
+    return stream->position < stream->bytesInBuffer;
+}
+
+// Read the next character from the stream without blocking, or send back STREAM_END, STREAM_PENDING or STREAM_ERROR
+int Stream_GetNext(Stream* stream) {
+    assert(! stream->atEnd && ! stream->inError); // Shouldn't be called when the stream is no longer viable
+    if(stream->position < stream->bytesInBuffer) {
+        return stream->buffer[stream->position++];
+    }
+    return STREAM_END;
+}
+
+// Write next character to buffer, and flush to stream if buffer is full. This can return STREAM_END, STREAM_PENDING, or STREAM_ERROR
+int Stream_WriteNext(Stream* stream, char c) {
+    assert(! stream->atEnd && ! stream->inError); // Shouldn't be called when the stream is no longer viable
+    if(stream->position == BUFSIZ) {
+        int result = 0;// = Stream_SendUntilBlock(stream);
+        if(result != STREAM_OK)
+            return result;
+        assert(stream->position = 0);
+        stream->buffer[stream->position++] = c;
+    }
+    return STREAM_END;
+}
+
+
+// The list helpers are called with get_cache.lock held
+static void get_cache_unlink(CacheObject* object)
+{
+    if(object->prev)
+        object->prev->next = object->next;
+    else
+        get_cache.head = object->next;
+    if(object->next)
+        object->next->prev = object->prev;
+    else
+        get_cache.tail = object->prev;
+    object->prev = object->next = NULL;
+}
+
+static void get_cache_push_front(CacheObject* object)
+{
+    object->prev = NULL;
+    object->next = get_cache.head;
+    if(get_cache.head)
+        get_cache.head->prev = object;
+    get_cache.head = object;
+    if(get_cache.tail == NULL)
+        get_cache.tail = object;
+}
+
+static void get_cache_free(CacheObject* object)
+{
+    free(object->data);
+    free(object->name);
+    free(object);
+}
+
+// Detach the object from its catalog entry and free it, or leave that to the last session still sending it.
+// The caller holds the entry's shard write lock
+static void get_cache_drop(catalog_entry_t* entry)
+{
+    CacheObject* object = entry->cache;
+    entry->cache = NULL;
+    pthread_mutex_lock(&get_cache.lock);
+    get_cache_unlink(object);
+    get_cache.bytes -= object->length;
+    bool unused = object->senders == 0;
+    if(!unused)
+        object->dropped = true;
+    pthread_mutex_unlock(&get_cache.lock);
+    if(unused)
+        get_cache_free(object);
+}
+
+// A session has finished sending the object
+static void get_cache_unpin(CacheObject* object)
+{
+    pthread_mutex_lock(&get_cache.lock);
+    bool last = --object->senders == 0 && object->dropped;
+    pthread_mutex_unlock(&get_cache.lock);
+    if(last)
+        get_cache_free(object);
+}
+
+void get_cache_invalidate(const char* name)
+{
+    catalog_shard_t* shard = sharded_catalog_lock(&directory, name, true);
+    catalog_entry_t* entry = catalog_find(&shard->catalog, name);
+    if(entry && entry->cache)
+        get_cache_drop(entry);
+    catalog_shard_unlock(shard);
+}
+
+// Read the whole file into a new cache object, evicting the least recently used objects to make room.
+// Returns the object pinned for the caller, or NULL if the file is too big for the cache or can't be read,
+// the caller then serves it from disk. No lock is held while the file is read, the object is attached at
+// the end if the file is unchanged
+static CacheObject* get_cache_fill(const char* fileName, size_t fileSize)
+{
+    size_t length = 3 + sizeof(size_t) + fileSize;
+    if(length > get_cache.capacity / GET_CACHE_OBJECT_DIVISOR)
+        return NULL;
+
+    char path[BUFSIZ];
+    if(!stored_path(fileName, path, sizeof(path)))
+        return NULL;
+    int fd = open(path, O_RDONLY);
+    if(fd == -1)
+        return NULL;
+
+    CacheObject* object = calloc(1, sizeof(CacheObject));
+    char* data = malloc(length);
+    char* name = strdup(fileName);
+    if(object == NULL || data == NULL || name == NULL) {
+        free(object);
+        free(data);
+        free(name);
+        close(fd);
+        return NULL;
+    }
+    memcpy(data, "OK\n", 3);
+    insert_size_into_mem(&data[3], fileSize);
+    size_t got = 3 + sizeof(size_t);
+    while(got < length) {
+        ssize_t count = read(fd, data + got, length - got);
+        if(count == -1 && errno == EINTR)
+            continue;
+        if(count <= 0)
+            break;
+        got += count;
+    }
+    close(fd);
+    if(got < length) {
+        // The file is shorter than the catalog says, leave it to the uncached path
+        free(object);
+        free(data);
+        free(name);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&get_cache.lock);
+    while(get_cache.bytes + length > get_cache.capacity && get_cache.tail) {
+        // The victim's shard lock has to come first, pin the victim so it stays allocated in between
+        CacheObject* victim = get_cache.tail;
+        victim->senders++;
+        pthread_mutex_unlock(&get_cache.lock);
+        catalog_shard_t* shard = sharded_catalog_lock(&directory, victim->name, true);
+        catalog_entry_t* entry = catalog_find(&shard->catalog, victim->name);
+        bool evicted = entry && entry->cache == victim;
+        if(evicted)
+            get_cache_drop(entry);
+        catalog_shard_unlock(shard);
+        get_cache_unpin(victim);
+        pthread_mutex_lock(&get_cache.lock);
+        if(evicted)
+            get_cache.evictions++;
+    }
+    pthread_mutex_unlock(&get_cache.lock);
+
+    catalog_shard_t* shard = sharded_catalog_lock(&directory, fileName, true);
+    catalog_entry_t* entry = catalog_find(&shard->catalog, fileName);
+    if(entry == NULL || entry->size != fileSize || entry->cache) {
+        catalog_shard_unlock(shard);
+        free(object);
+        free(data);
+        free(name);
+        return NULL;
+    }
+    object->name = name;
+    object->data = data;
+    object->length = length;
+    object->senders = 1;
+    entry->cache = object;
+    pthread_mutex_lock(&get_cache.lock);
+    get_cache.bytes += length;
+    get_cache_push_front(object);
+    pthread_mutex_unlock(&get_cache.lock);
+    catalog_shard_unlock(shard);
+    return object;
+}
+
+// Find the cached response for a file, loading it if it fits. Returns NULL when it has to come from disk,
+// otherwise the object is pinned and the caller lets go of it with get_cache_unpin
+static CacheObject* get_cache_lookup(const char* name)
+{
+    if(get_cache.capacity == 0)
+        return NULL;
+    catalog_shard_t* shard = sharded_catalog_lock(&directory, name, false);
+    catalog_entry_t* entry = catalog_find(&shard->catalog, name);
+    CacheObject* object = entry ? entry->cache : NULL;
+    size_t size = entry ? entry->size : 0;
+    if(entry) {
+        // Pinned before the shard lock goes, an object can only be dropped under the write lock
+        pthread_mutex_lock(&get_cache.lock);
+        if(object) {
+            get_cache.hits++;
+            get_cache_unlink(object);
+            get_cache_push_front(object);
+            object->senders++;
+        } else {
+            get_cache.misses++;
+        }
+        pthread_mutex_unlock(&get_cache.lock);
+    }
+    catalog_shard_unlock(shard);
+    if(entry == NULL || object)
+        return object;
+    return get_cache_fill(name, size);
+}
+
+void get_cache_report(void) {
+    pthread_mutex_lock(&get_cache.lock);
+    fprintf(stderr, "GET cache: %zu hits, %zu misses, %zu evictions, %zu of %zu bytes used\n",
+            get_cache.hits, get_cache.misses, get_cache.evictions, get_cache.bytes, get_cache.capacity);
+    pthread_mutex_unlock(&get_cache.lock);
+}
+
+// Record the latency of the request the session just finished, once
+void metrics_request_done(Session* session)
+{
+    verb v = session->requestVerb;
+    if(v == V_UNKNOWN)
+        return;
+    session->requestVerb = V_UNKNOWN;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t elapsed = (int64_t)(now.tv_sec - session->requestStart.tv_sec) * 1000000000
+                      + (now.tv_nsec - session->requestStart.tv_nsec);
+    histogram_record(&metrics.latency[v], elapsed > 0 ? (uint64_t)elapsed : 0);
+    METRIC_ADD(metrics.requests[v], 1);
+    if(session->requestFailed || session->status == STATUS_SESSION_ERROR)
+        METRIC_ADD(metrics.errors[v], 1);
+}
+
+// Answer PARTIAL with the number of bytes kept from an interrupted upload of the file, in the same
+// OK + size form as a GET without the payload. The client resumes from there with PUTFROM
+void session_start_partial(Session* session)
+{
+    char path[BUFSIZ];
+    struct stat file_info;
+    if(!partial_path(session->filename, path, sizeof(path)) || stat(path, &file_info) == -1) {
+        send_header_response(session, "ERROR", err_no_such_file);
+        return;
+    }
+
+    char header[3 + sizeof(size_t)];
+    memcpy(header, "OK\n", 3);
+    insert_size_into_mem(&header[3], file_info.st_size);
+    session_send(session, header, sizeof(header));
+    session->state = STATE_DONE;
+    session->status = STATUS_SESSION_END;
+}
+
+// Answer STATS with the counters and latency percentiles as "name value" lines, in the same
+// OK + size + payload form as LIST
+void session_start_stats(Session* session)
+{
+    static const char* names[] = { "get", "put", "delete", "list" };
+    char body[4096];
+    size_t len = 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+#define STATS_LINE(...) \
+    len += snprintf(&body[len], sizeof(body) - len, __VA_ARGS__)
+
+    STATS_LINE("uptime_seconds %ld\n", (long)(now.tv_sec - metrics.started.tv_sec));
+    STATS_LINE("connections_accepted %" PRIu64 "\n", METRIC_GET(metrics.accepted));
+    STATS_LINE("active_sessions %zu\n", session_pool.inUse);
+    STATS_LINE("bytes_in %" PRIu64 "\n", METRIC_GET(metrics.bytesIn));
+    STATS_LINE("bytes_out %" PRIu64 "\n", METRIC_GET(metrics.bytesOut));
+    STATS_LINE("send_eagain_stalls %" PRIu64 "\n", METRIC_GET(metrics.sendStalls));
+    STATS_LINE("bad_requests %" PRIu64 "\n", METRIC_GET(metrics.badRequests));
+    STATS_LINE("sessions_timed_out %" PRIu64 "\n", METRIC_GET(metrics.timedOut));
+    STATS_LINE("accept_pauses %" PRIu64 "\n", METRIC_GET(metrics.acceptPauses));
+    STATS_LINE("read_turns_yielded %" PRIu64 "\n", METRIC_GET(metrics.turnsYielded));
+    STATS_LINE("rate_throttled %" PRIu64 "\n", METRIC_GET(metrics.rateThrottled));
+    pthread_mutex_lock(&get_cache.lock);
+    STATS_LINE("get_cache_hits %zu\n", get_cache.hits);
+    STATS_LINE("get_cache_misses %zu\n", get_cache.misses);
+    pthread_mutex_unlock(&get_cache.lock);
+    pthread_mutex_lock(&blob_store.lock);
+    STATS_LINE("dedup_blobs %zu\n", blob_store.count);
+    STATS_LINE("dedup_blob_bytes %zu\n", blob_store.bytes);
+    STATS_LINE("dedup_bytes_saved %zu\n", blob_store.referenced - blob_store.bytes);
+    pthread_mutex_unlock(&blob_store.lock);
+    for(int v = GET; v <= LIST; v++) {
+        histogram_t* h = &metrics.latency[v];
+        STATS_LINE("%s_requests %" PRIu64 "\n", names[v], METRIC_GET(metrics.requests[v]));
+        STATS_LINE("%s_errors %" PRIu64 "\n", names[v], METRIC_GET(metrics.errors[v]));
+        STATS_LINE("%s_latency_us_mean %.1f\n", names[v], histogram_mean(h) / 1000.0);
+        STATS_LINE("%s_latency_us_p50 %.1f\n", names[v], histogram_quantile(h, 0.50) / 1000.0);
+        STATS_LINE("%s_latency_us_p90 %.1f\n", names[v], histogram_quantile(h, 0.90) / 1000.0);
+        STATS_LINE("%s_latency_us_p99 %.1f\n", names[v], histogram_quantile(h, 0.99) / 1000.0);
+        STATS_LINE("%s_latency_us_p999 %.1f\n", names[v], histogram_quantile(h, 0.999) / 1000.0);
+        STATS_LINE("%s_latency_us_max %.1f\n", names[v], histogram_max(h) / 1000.0);
+    }
+#undef STATS_LINE
+    if(len > sizeof(body))
+        len = sizeof(body);
+
+    char header[3 + sizeof(size_t)];
+    memcpy(header, "OK\n", 3);
+    insert_size_into_mem(&header[3], len);
+    session_queue(session, header, sizeof(header));
+    session_send(session, body, len);
+
+    session->state = STATE_DONE;
+    session->status = STATUS_SESSION_END;
+}
+
+// GETZ: add count bytes to the output as LZ frames, and the end frame after them if last is set.
+// Returns false if memory ran out
+static bool queue_frames(Session* session, const char* data, size_t count, bool last)
+{
+    for(size_t sent = 0; sent < count || last; ) {
+        size_t len = count - sent < LZ_FRAME_SIZE ? count - sent : LZ_FRAME_SIZE;
+        uint8_t* frame = (uint8_t*)session_out_space(session, LZ_FRAME_HEADER + len);
+        if(frame == NULL)
+            return false;
+        session->outLen += lz_frame(len ? (const uint8_t*)data + sent : NULL, len, frame);
+        sent += len;
+        if(len == 0)
+            break;
+    }
+    return true;
+}
+
+// Put the next piece of a GET in the output: read from the file, or straight from the cache object, compressed
+// for GETZ. Returns false if the file can't be read or memory ran out
+static bool get_refill(Session* session)
+{
+    size_t len = session->getLeft;
+    const char* data = NULL;
+    if(session->getCached) {
+        data = session->getCached->data + 3 + sizeof(size_t) + session->getOffset;
+        if(!session->compressed) {
+            session->outData = data;
+            session->outPos = 0;
+            session->outLen = len;
+            session->getOffset += len;
+            session->getLeft = 0;
+            return true;
+        }
+    }
+    size_t piece = session->compressed ? LZ_FRAME_SIZE : SEND_CHUNK_SIZE;
+    if(len > piece)
+        len = piece;
+    if(data == NULL) {
+        // GETZ reads into put_buffer and compresses into the output, a plain GET reads into the output
+        char* target = session->compressed ? put_buffer : session_out_space(session, len);
+        if(target == NULL)
+            return false;
+        ssize_t count;
+        do {
+            count = pread(session->getFd, target, len, session->getOffset);
+        } while(count == -1 && errno == EINTR);
+        if(count <= 0)
+            return false;
+        len = count;
+        data = target;
+    }
+    session->getOffset += len;
+    session->getLeft -= len;
+    if(session->compressed)
+        return queue_frames(session, data, len, session->getLeft == 0);
+    session->outLen += len;
+    return true;
+}
+
+static int sending_get_response(Session* session) {
+    char *filename = session->filename;
+    LOG("Get requested for '%s'", filename);
+    char buffer[BUFSIZ];
+    if(strlen(session->filename) == 0) {
+        log_message(LOG_WARN, "Requested file not found");
+        send_header_response(session, "ERROR", err_no_such_file);
+        return false;
+    }
+    size_t start, count;
+    size_t headerLen = 3 + sizeof(size_t);
+    CacheObject* cached = get_cache_lookup(session->filename);
+    if(cached) {
+        if(!get_range(session, cached->length - headerLen, &start, &count)) {
+            get_cache_unpin(cached);
+            send_header_response(session, "ERROR", err_bad_range);
+            return -1;
+        }
+        LOG("Writing cached response OK");
+        // Sent straight from the object, which the lookup pinned so it stays allocated until it has gone out
+        // even if it is dropped
+        session->getCached = cached;
+    } else if(ring_active && !session->compressed) {
+        // The io_uring engine opens and streams the file itself, see ring_complete. GETZ is compressed here
+        session->state = STATE_SENDING_GET;
+        return 0;
+    } else {
+        struct stat file_info;
+        int fd = stored_path(filename, buffer, sizeof(buffer)) ? open(buffer, O_RDONLY) : -1;
+        if(fd == -1 || fstat(fd, &file_info) == -1) {
+            if(fd != -1)
+                close(fd);
+            log_message(LOG_WARN, "Requested file not found");
+            send_header_response(session, "ERROR", err_no_such_file);
+            return -1;
+        }
+        if(!get_range(session, file_info.st_size, &start, &count)) {
+            close(fd);
+            send_header_response(session, "ERROR", err_bad_range);
+            return -1;
+        }
+        LOG("Writing header for response OK");
+        session->getFd = fd;
+    }
+    session->getOffset = start;
+    session->getLeft = count;
+    if(cached && !session->ranged && !session->compressed) {
+        // The whole object, header included, in one send
+        session->outData = cached->data;
+        session->outPos = 0;
+        session->outLen = cached->length;
+        session->getLeft = 0;
+    } else {
+        memcpy(buffer, "OK\n", 3);
+        insert_size_into_mem(&buffer[3], count);
+        session_queue(session, buffer, headerLen);
+        if(session->compressed && count == 0)
+            queue_frames(session, NULL, 0, true);
+    }
     session->state = STATE_SENDING_GET;
+    continue_sending_get(session);
+    return 0;
+}
+
+// STATE_SENDING_GET: send the GET piece by piece, reading the next one whenever the socket has taken the last
+bool continue_sending_get(Session* session)
+{
+    if(session->getFd == -1 && session->getCached == NULL)
+        return false;   // The io_uring engine streams this one, see ring_complete
+    while(session_flush(session)) {
+        if(session->getLeft == 0 || session->outFailed) {
+            session->state = STATE_WRITING;
+            session->status = STATUS_SESSION_END;
+            return continue_writing(session);
+        }
+        if(!get_refill(session)) {
+            print_error_message("Reading the file for a GET failed");
+            response_release(session);
+            session->state = STATE_INTERNAL_ERROR;
+            session->status = STATUS_SESSION_ERROR;
+            return false;
+        }
+    }
+    return false;
+}
+
+void session_start_delete(Session *session)
+{
+    int result = 0;
+    char fullpath[BUFSIZ] = "";
+    
+    get_cache_invalidate(session->filename);
+    char partial[BUFSIZ];
+    if(partial_path(session->filename, partial, sizeof(partial)))
+        unlink(partial);
+    bool shared;        // Only a reference to a dedup blob, store_forget drops it
+    if(store_forget(session->filename, &shared) == HASH_TABLE_OK) {
+        int len = snprintf(fullpath, sizeof(fullpath), "%s/%s", base_temp_dir, session->filename);
+        if(len < 0 || (size_t)len >= sizeof(fullpath))
+            fullpath[0] = '\0';
+    }
+    
+    result = shared ? 0 : unlink(fullpath);
+    if(result == 0) {
+        send_header_response(session, "OK", NULL);
+    } else {
+        send_header_response(session, "ERROR", err_no_such_file);
+    }
+}
+
+static void list_failed(Session* session)
+{
+    print_error_message("Out of memory listing the files");
+    response_release(session);
+    session->state = STATE_INTERNAL_ERROR;
+    session->status = STATUS_SESSION_ERROR;
+}
+
+void session_start_list(Session *session)
+{
+    // Note we assume there is a catalog called directory storing the directory of all files in the temp folder
+    // We do this as per instructions rather than reading the filesystem directly.
+    // The names come from a snapshot, so the size sent first matches them even if files come and go meanwhile
+    size_t sizeCount;
+    catalog_snapshot_t* snapshot = sharded_catalog_snapshot(&directory, &sizeCount);
+    char* header = snapshot ? session_out_space(session, 3 + sizeof(size_t)) : NULL;
+    if(header == NULL) {
+        if(snapshot)
+            catalog_snapshot_release(snapshot);
+        list_failed(session);
+        return;
+    }
+
+    LOG("Writing response OK");
+    memcpy(header, "OK\n", 3);
+    insert_size_into_mem(&header[3], sizeCount);
+    session->outLen += 3 + sizeof(size_t);
+    session->listSnapshot = snapshot;
+    session->state = STATE_WRITING_LIST;
+    continue_writing_list(session);
+}
+
+// Answer LISTPAGE with the names starting with the prefix in filename, from cursor on, stopping after the first
+// home slot that takes the count to limit (0 for no limit). The names are followed by an empty line and the 8
+// byte cursor to ask for the next page with, 0 when the listing is complete
+void session_start_listpage(Session *session, size_t cursor, size_t limit)
+{
+    char* header = session_out_space(session, 3);
+    if(header == NULL) {
+        list_failed(session);
+        return;
+    }
+
+    memcpy(header, "OK\n", 3);
+    session->outLen += 3;
+    session->listCursor = cursor;
+    session->listCount = 0;
+    session->listLimit = limit;
+    session->state = STATE_WRITING_LIST;
+    continue_writing_list(session);
+}
+
+// Add the next names of a LIST or LISTPAGE to the output, up to LIST_CHUNK_SIZE bytes. The output only grows
+// past that if all the names in one home slot of the catalog don't fit. Returns 1 while there are more names,
+// 0 once the whole listing, with the LISTPAGE trailer, is in the output and -1 if memory ran out
+static int list_fill(Session* session)
+{
+    for(;;) {
+        session_out_reset(session);
+        size_t room = session->outCap > LIST_CHUNK_SIZE ? session->outCap : LIST_CHUNK_SIZE;
+        char* space = session_out_space(session, room - session->outLen);
+        if(space == NULL)
+            return -1;
+        ssize_t filled;
+        if(session->listSnapshot) {
+            filled = catalog_snapshot_read(session->listSnapshot, space, room - session->outLen);
+            if(filled == 0) {
+                catalog_snapshot_release(session->listSnapshot);
+                session->listSnapshot = NULL;
+                return 0;
+            }
+        } else {
+            if(session->listCursor >= SHARDED_CATALOG_END
+               || (session->listLimit != 0 && session->listCount >= session->listLimit)) {
+                space = session_out_space(session, 1 + sizeof(size_t));
+                if(space == NULL)
+                    return -1;
+                space[0] = '\n';
+                insert_size_into_mem(&space[1], session->listCursor < SHARDED_CATALOG_END ? session->listCursor : 0);
+                session->outLen += 1 + sizeof(size_t);
+                return 0;
+            }
+            filled = sharded_catalog_list(&directory, &session->listCursor, session->filename, session->listLimit,
+                                          &session->listCount, space, room - session->outLen);
+        }
+        if(filled > 0) {
+            session->outLen += filled;
+            return 1;
+        }
+        if(filled == 0)
+            continue;
+        if(errno != EMSGSIZE)
+            return -1;
+        // The next slot's names don't fit: send what there is first, or grow the output if it is empty
+        if(session->outLen > session->outPos)
+            return 1;
+        if(session_out_space(session, room * 2) == NULL)
+            return -1;
+    }
+}
+
+// STATE_WRITING_LIST: send the listing a chunk at a time, so it takes no more memory than the chunk however big
+// the catalog is. The header goes out in the same send as the first names
+bool continue_writing_list(Session* session)
+{
+    do {
+        int more = session->outFailed ? 0 : list_fill(session);
+        if(more == -1) {
+            // Part of the listing went out already, all that can be done is to drop the connection
+            list_failed(session);
+            return false;
+        }
+        if(more == 0) {
+            session->state = STATE_WRITING;
+            session->status = STATUS_SESSION_END;
+            return continue_writing(session);
+        }
+    } while(session_flush(session));
+    return false;
+}
+
+void session_start_get(Session* session) {
+    sending_get_response(session);
+}
+
+void session_start_put(Session* session) {
+    // The size comes right after the header line
+    session->headersize = session->inputPos;
+    session->state = STATE_READING_PUT_SIZE;
+    continue_reading_put(session);
+}
+
+// Make sure *pBuffer can hold at least needed bytes, growing it by doubling. Returns false if that would exceed SESSION_INPUT_MAX
+bool session_reserve(char** pBuffer, size_t* pCap, size_t needed) {
+    if(needed <= *pCap)
+        return true;
+    if(needed > SESSION_INPUT_MAX)
+        return false;
+
+    size_t newCap = *pCap ? *pCap : SESSION_BUF_INITIAL;
+    while(newCap < needed)
+        newCap *= 2;
+    if(newCap > SESSION_INPUT_MAX)
+        newCap = SESSION_INPUT_MAX;
+
+    char* grown = realloc(*pBuffer, newCap);
+    if(grown == NULL) {
+        print_error_message("realloc failed");
+        return false;
+    }
+    *pBuffer = grown;
+    *pCap = newCap;
+    session_pool.bufferGrowths++;
+    return true;
+}
+
+// Append len bytes to the header input, keeping it '\0' terminated
+bool session_input_append(Session* session, const char* data, size_t len) {
+    if(!session_reserve(&session->input, &session->inputCap, session->inputPos + len + 1))
+        return false;
+    memcpy(&session->input[session->inputPos], data, len);
+    session->inputPos += len;
+    session->input[session->inputPos] = '\0';
+    return true;
+}
+
+Session* Session_create(int sock) {
+    Session* session = session_pool.freeList;
+    if(session != NULL) {
+        session_pool.freeList = session->nextFree;
+        session_pool.freeCount--;
+        session_pool.reused++;
+    } else {
+        session = malloc(sizeof(Session));
+        if(session == NULL) {
+            print_error_message("malloc failed");
+            return NULL;
+        }
+        session->input = NULL;
+        session->inputCap = 0;
+        session->filename = NULL;
+        session->filenameCap = 0;
+        session->putTail = NULL;
+        session->frame = NULL;
+        session->out = NULL;
+        session->outCap = 0;
+        session_pool.created++;
+    }
+
+    if(!session_reserve(&session->input, &session->inputCap, SESSION_BUF_INITIAL) ||
+       !session_reserve(&session->filename, &session->filenameCap, SESSION_BUF_INITIAL)) {
+        free(session->input);
+        free(session->filename);
+        free(session);
+        return NULL;
+    }
+
+    Stream_Reset(&session->stream, sock);
+    session->input[0] = '\0';
+    session->filename[0] = '\0';
+    session->state = STATE_READING_HEADER;
+    session->inputPos = 0;
+    session->fd = -1;
+    session->putDirect = false;
+    session->putTailLen = 0;
+    session->putOffset = 0;
+    session->status = STATUS_SESSION_WAIT;
+    session->reading = true;
+    session->keepAlive = false;
+    session->ranged = false;
+    session->putResume = false;
+    session->putHashing = false;
+    session->compressed = false;
+    session->frameLen = 0;
+    session->rangeOffset = 0;
+    session->rangeLength = 0;
+    session->requestVerb = V_UNKNOWN;
+    session->requestFailed = false;
+    session->ringSlot = -1;
+    session->getFd = -1;
+    session->getCached = NULL;
+    session->getLeft = 0;
+    session->getOffset = 0;
+    session->outData = session->out;
+    session->outLen = 0;
+    session->outPos = 0;
+    session->outArmed = false;
+    session->outFailed = false;
+    session->closeAfterSend = false;
+    session->listSnapshot = NULL;
+    session->ioPos = 0;
+    session->ioLen = 0;
+    session->headersize = 0;
+    session->totalBytesForPut = 0;
+    session->totalWritten = 0;
+    session->nextFree = NULL;
+    session->wheelPrev = NULL;
+    session->wheelNext = NULL;
+    session->wheelSlot = -1;
+    session->readyPrev = NULL;
+    session->readyNext = NULL;
+    session->readyQueued = false;
+    session->throttled = false;
+    session->deficit = 0;
+    if(client_rate) {
+        session->rateTokens = rate_burst();
+        clock_gettime(CLOCK_MONOTONIC, &session->rateRefilled);
+    }
+    session->lastActivity = wheel.now;
+    session->requestBegan = wheel.now;
+    wheel_schedule(session);
+
+    session_pool.inUse++;
+    if(session_pool.inUse > session_pool.peakInUse)
+        session_pool.peakInUse = session_pool.inUse;
+    return session;
+}
+
+// Give a session back to the pool once its socket is closed
+void Session_release(Session* session) {
+    if(session == NULL)
+        return;
+
+    if(session->fd != -1) {
+        // An upload that never completed
+        char path[BUFSIZ];
+        upload_path(session, path, sizeof(path));
+        if(!session->putResume)
+            unlink(path);
+        close(session->fd);
+        session->fd = -1;
+    }
+    response_release(session);
+    // Few connections use PUTZ, so its frame buffer is not kept in the pool
+    free(session->frame);
+    session->frame = NULL;
+    wheel_cancel(session);
+    sched_dequeue(session);
+    session_pool.inUse--;
+
+    if(session_pool.freeCount >= SESSION_POOL_MAX_FREE) {
+        free(session->input);
+        free(session->filename);
+        free(session->putTail);
+        free(session->out);
+        free(session);
+        return;
+    }
+
+    // Don't let one unusually long header pin a large buffer in the pool
+    if(session->inputCap > SESSION_BUF_KEEP) {
+        free(session->input);
+        session->input = NULL;
+        session->inputCap = 0;
+    }
+    if(session->filenameCap > SESSION_BUF_KEEP) {
+        free(session->filename);
+        session->filename = NULL;
+        session->filenameCap = 0;
+    }
+    if(session->outCap > SESSION_BUF_KEEP) {
+        free(session->out);
+        session->out = NULL;
+        session->outCap = 0;
+    }
+
+    session->nextFree = session_pool.freeList;
+    session_pool.freeList = session;
+    session_pool.freeCount++;
+}
+
+// Get a persistent connection ready for its next request
+void Session_nextRequest(Session* session) {
+    session->input[0] = '\0';
+    session->inputPos = 0;
+    session->filename[0] = '\0';
+    session->state = STATE_READING_HEADER;
+    session->status = STATUS_SESSION_WAIT;
+    session->headersize = 0;
+    session->totalBytesForPut = 0;
+    session->totalWritten = 0;
+    session->putDirect = false;
+    session->putTailLen = 0;
+    session->putOffset = 0;
+    session->requestVerb = V_UNKNOWN;
+    session->requestFailed = false;
+    session->ranged = false;
+    session->putResume = false;
+    session->putHashing = false;
+    session->compressed = false;
+    session->frameLen = 0;
+    session->rangeOffset = 0;
+    session->rangeLength = 0;
+}
+
+void session_pool_report(void) {
+    fprintf(stderr, "Session pool: %zu created, %zu reused, %zu in use, %zu peak in use, %zu free, %zu buffer growths\n",
+            session_pool.created, session_pool.reused, session_pool.inUse,
+            session_pool.peakInUse, session_pool.freeCount, session_pool.bufferGrowths);
+}
+
+int Session_processNext(Session* session) {
+    bool running = false;
+    do
+    {
+        switch(session->state) {
+            case STATE_WRITING:
+                running = continue_writing(session);
+                break;
+            case STATE_READING_HEADER:
+                running = continue_reading_header(session);
+                break;
+            case STATE_SENDING_GET:
+                running = continue_sending_get(session);
+                break;
+            case STATE_READING_PUT_SIZE:
+            case STATE_READING_PUT_DATA:
+                running = continue_reading_put(session);
+                break;
+            case STATE_READING_PUT_FRAMES:
+                running = continue_reading_put_frames(session);
+                break;
+            case STATE_WRITING_LIST:
+                running = continue_writing_list(session);
+                break;
+            case STATE_COMMITTING:
+                running = false;
+                break;
+            case STATE_INTERNAL_ERROR:
+                metrics_request_done(session);
+                running = false;
+                break;
+            case STATE_DONE:
+                if(session->outPos < session->outLen && !session->outFailed) {
+                    // The next request waits until the socket has taken the rest of this response
+                    session->state = STATE_WRITING;
+                    running = false;
+                    break;
+                }
+                metrics_request_done(session);
+                // On a persistent connection go on with the next request, unless the last one left the stream out of step
+                if(session->keepAlive && session->status != STATUS_SESSION_ERROR) {
+                    Session_nextRequest(session);
+                    running = Stream_has_more(&session->stream);
+                } else {
+                    if(session->status != STATUS_SESSION_ERROR)
+                        session->status = STATUS_SESSION_END;
+                    running = false;
+                }
+                break;
+            default:
+                assert(false); //Should never be in anything except the above states.
+        }
+    }while(running);
+    return session->status;
+}
+
+/*
+   Scheduler
+   A connection may read read_quantum bytes per turn (deficit round robin: what a read takes past that comes off
+   its next turn). One that still has input when its turn runs out waits in the run queue, as edge triggered epoll
+   won't report it again, and every pass of the event loop gives the queue one more turn before the new events.
+   So a bulk upload holds the loop up for at most a turn, not until its socket is dry, and a short request next to
+   it is answered in the same pass. With --client-rate each connection also has a token bucket, and waits in the
+   queue, throttled, while it is empty. The io_uring engine has one receive in flight per connection, so it is
+   fair as it is and doesn't use any of this.
+*/
+
+// Connections waiting for their next turn, in the order their turns ran out
+typedef struct {
+    Session* head;
+    Session* tail;
+    size_t count;
+} RunQueue;
+
+static RunQueue run_queue;
+
+static void sched_enqueue(Session* session)
+{
+    session->readyPrev = run_queue.tail;
+    session->readyNext = NULL;
+    if(run_queue.tail)
+        run_queue.tail->readyNext = session;
+    else
+        run_queue.head = session;
+    run_queue.tail = session;
+    run_queue.count++;
+    session->readyQueued = true;
+}
+
+static void sched_dequeue(Session* session)
+{
+    if(!session->readyQueued)
+        return;
+    if(session->readyPrev)
+        session->readyPrev->readyNext = session->readyNext;
+    else
+        run_queue.head = session->readyNext;
+    if(session->readyNext)
+        session->readyNext->readyPrev = session->readyPrev;
+    else
+        run_queue.tail = session->readyPrev;
+    session->readyPrev = session->readyNext = NULL;
+    run_queue.count--;
+    session->readyQueued = false;
+}
+
+// Bytes an idle connection can save up under --client-rate, a tenth of a second's worth
+static double rate_burst(void)
+{
+    return client_rate < 10 ? 1 : client_rate / 10.0;
+}
+
+// A throttled connection waits until it may read this much, so a low rate doesn't become a stream of tiny reads
+static double rate_chunk(void)
+{
+    return rate_burst() < BUFSIZ ? rate_burst() : BUFSIZ;
+}
+
+static void rate_refill(Session* session)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - session->rateRefilled.tv_sec) + (now.tv_nsec - session->rateRefilled.tv_nsec) / 1e9;
+    session->rateRefilled = now;
+    session->rateTokens += elapsed * client_rate;
+    if(session->rateTokens > rate_burst())
+        session->rateTokens = rate_burst();
+}
+
+static void sched_begin_turn(Session* session)
+{
+    // Credit left from a turn cut short by the rate limit doesn't pile up
+    session->deficit += read_quantum;
+    if(session->deficit > (ssize_t)read_quantum)
+        session->deficit = read_quantum;
+}
+
+// Bytes the session may read now, 0 if it has to wait for its next turn
+static size_t sched_budget(Session* session)
+{
+    if(session->deficit <= 0) {
+        METRIC_ADD(metrics.turnsYielded, 1);
+        session->throttled = false;
+        return 0;
+    }
+    size_t budget = session->deficit;
+    if(client_rate) {
+        rate_refill(session);
+        if(session->rateTokens < rate_chunk()) {
+            METRIC_ADD(metrics.rateThrottled, 1);
+            session->throttled = true;
+            return 0;
+        }
+        if(session->rateTokens < budget)
+            budget = session->rateTokens;
+    }
+    return budget;
+}
+
+static void sched_charge(Session* session, size_t bytes)
+{
+    session->deficit -= bytes;
+    if(client_rate)
+        session->rateTokens -= bytes;
+}
+
+// The socket is dry. An idle connection keeps no credit for later
+static void sched_idle(Session* session)
+{
+    session->deficit = 0;
+}
+
+// Give the connections that were in the run queue at the start of this pass one more turn each.
+// Throttled ones stay queued until their bucket has refilled
+static void sched_run(void)
+{
+    for(size_t turns = run_queue.count; turns > 0 && run_queue.head; turns--) {
+        Session* session = run_queue.head;
+        sched_dequeue(session);
+        if(session->throttled) {
+            rate_refill(session);
+            if(session->rateTokens < rate_chunk()) {
+                sched_enqueue(session);
+                continue;
+            }
+        }
+        session_readable(session->stream.socket);
+    }
+}
+
+// How long epoll_wait may block: not at all while a queued connection can read, until the first throttled one
+// may read again when all of them are throttled, and for good with nothing queued
+static int sched_timeout(void)
+{
+    int timeout = -1;
+    for(Session* session = run_queue.head; session; session = session->readyNext) {
+        if(!session->throttled)
+            return 0;
+        int wait = (rate_chunk() - session->rateTokens) * 1000 / client_rate + 1;
+        if(timeout == -1 || wait < timeout)
+            timeout = wait;
+    }
+    return timeout;
+}
+
+// Read what a connection has sent and process it, for one turn. Called when epoll reports the socket readable,
+// when the scheduler gives a connection in the run queue its next turn, and after the group commit for a session
+// that stopped reading while its PUT waited
+static void session_readable(int sock)
+{
+    /* We have data on the fd waiting to be read. Read and
+    display it. We must read whatever data is available
+     completely, as we are running in edge-triggered mode
+     and won't get a notification again for the same
+     data. A connection whose turn runs out first waits in
+     the run queue for its next one. */
+    int done = 0;
+    Session* session = NULL;
+
+    const uint32_t keyP = sock;
+    hashtable_rc_t hash_rc0;
+    hash_rc0 = hashtable_ts_get(&sock_to_session_hashtable, keyP, (void * *)&session);
+    if (hash_rc0 != HASH_TABLE_OK) {
+        session = Session_create(sock);
+        if(session == NULL) {
+            client_closed(sock, NULL);
+            return;
+        }
+        hashtable_ts_insert(&sock_to_session_hashtable, keyP, session);
+    }
+
+    // It is already waiting for its turn
+    if(session->readyQueued)
+        return;
+    sched_begin_turn(session);
+
+    while (1)
+    {
+        ssize_t bytesRead;
+        char *buffer;
+
+        // A PUT waiting for the group commit leaves the rest in the socket until it has been answered
+        if(session->state == STATE_COMMITTING)
+            break;
+
+        // Nor is anything read while a response is still going out, see session_writable
+        if(session_writing(session))
+            break;
+
+        // Out of budget, the other connections get their turn before this one reads again
+        size_t budget = sched_budget(session);
+        if(budget == 0) {
+            sched_enqueue(session);
+            break;
+        }
+
+        // Once the PUT header is parsed the payload bypasses the stream buffer
+        bool receivingPut = session->state == STATE_READING_PUT_DATA;
+        if(receivingPut) {
+            bytesRead = continue_receiving_put(session, budget);
+        } else {
+            buffer = session->stream.buffer;
+            session->stream.position = 0;
+
+            bytesRead = session_recv(sock, buffer, budget < BUFSIZ ? budget : BUFSIZ);
+        }
+        if (bytesRead == -1) {
+            /* If errno == EAGAIN, that means we have read all
+             data. So go back to the main loop. */
+            if (errno != EAGAIN)
+            {
+                perror ("read");
+                done = 1;
+            }
+            else
+                sched_idle(session);
+            break;
+        } else if (bytesRead == 0) {
+            /* End of file. The remote has closed the
+               connection. */
+            done = 1;
+            break;
+        }
+
+        METRIC_ADD(metrics.bytesIn, bytesRead);
+        sched_charge(session, bytesRead);
+        session->lastActivity = wheel.now;
+        if(!receivingPut) {
+            session->stream.bytesInBuffer = bytesRead;
+        }
+
+        Session_processNext(session);
+
+        // A persistent connection can't be trusted after a failed PUT or a malformed header
+        if(session->keepAlive && session->status == STATUS_SESSION_ERROR) {
+            done = 1;
+            break;
+        }
+
+        /* Write the buffer to standard output */
+        /*s = write (1, buffer, bytesRead);
+        if (s == -1) {
+            perror ("write");
+            exit(EXIT_FAILURE);
+        }*/
+
+    }
+
+    if (done)
+        client_closed(sock, session);
+}
+
+// epoll reports room in the socket of a connection whose response didn't all go out. Send the rest, then go on
+// reading, or end the connection if the client had already closed its side
+static void session_writable(int sock)
+{
+    Session* session = NULL;
+    if(hashtable_ts_get(&sock_to_session_hashtable, sock, (void **)&session) != HASH_TABLE_OK)
+        return;
+    if(!session_flush(session))
+        return;
+    Session_processNext(session);
+    if(session_writing(session))
+        return;
+    if(session->closeAfterSend || (session->keepAlive && session->status == STATUS_SESSION_ERROR))
+        client_closed(sock, session);
+    else
+        session_readable(sock);
+}
+
+static int
+make_socket_non_blocking (int sfd)
+{
+    int flags, s;
+
+    flags = fcntl (sfd, F_GETFL, 0);
+    if (flags == -1)
+    {
+        perror ("fcntl");
+        return -1;
+    }
+
+    flags |= O_NONBLOCK;
+    s = fcntl (sfd, F_SETFL, flags);
+    if (s == -1)
+    {
+        perror ("fcntl");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+create_and_bind (int portNum)
+{
+
+    int sfd;
+
+    struct sockaddr_in address;
+
+    // Creating socket file descriptor
+    if ((sfd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+      perror("Socket creation failed");
+      exit(EXIT_FAILURE);
+    }
+
+    int enable = 1;
+    if(setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int))<0) {
+        perror(NULL);
+        exit(1);
+    }
+    if(setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int))<0) {
+        perror(NULL);
+        exit(1);
+    }
+
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(portNum);
+
+    // Binding to the specified port
+    if (bind(sfd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        print_error_message("Bind failed");
+        exit(EXIT_FAILURE);
+    }
+
+    return sfd;
+}
+
+
+void printBuffer(const char *buffer, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        fprintf(stderr, "%02X ", (unsigned char)buffer[i]); // Prints in hexadecimal format
+    }
+    fprintf(stderr, "\n");
+}
+
+// Start the output buffer over once everything in it has been sent
+static void session_out_reset(Session* session)
+{
+    if(session->outPos == session->outLen) {
+        session->outData = session->out;
+        session->outPos = 0;
+        session->outLen = 0;
+    }
+}
+
+// Room for needed more bytes at the end of the output, growing the buffer by doubling. Returns NULL if memory ran out
+static char* session_out_space(Session* session, size_t needed)
+{
+    session_out_reset(session);
+    assert(session->outData == session->out);
+    if(session->outLen + needed > session->outCap) {
+        size_t cap = session->outCap ? session->outCap : SESSION_BUF_INITIAL;
+        while(cap < session->outLen + needed)
+            cap *= 2;
+        char* grown = realloc(session->out, cap);
+        if(grown == NULL) {
+            print_error_message("Out of memory for a response");
+            return NULL;
+        }
+        session->out = grown;
+        session->outData = grown;
+        session->outCap = cap;
+        session_pool.bufferGrowths++;
+    }
+    return &session->out[session->outLen];
+}
+
+// Add to the output without sending. A response that can't be buffered is dropped along with the connection
+static void session_queue(Session* session, const char* data, size_t len)
+{
+    if(session->outFailed)
+        return;
+    char* space = session_out_space(session, len);
+    if(space == NULL) {
+        session->outFailed = true;
+        shutdown(session->stream.socket, SHUT_RDWR);
+        return;
+    }
+    memcpy(space, data, len);
+    session->outLen += len;
+}
+
+void session_send(Session* session, const char* data, size_t len)
+{
+    session_queue(session, data, len);
+    session_flush(session);
+}
+
+// The socket is full: have epoll report when it has room again, and put the write deadline on the wheel
+static void session_wait_writable(Session* session)
+{
+    if(!session->outArmed && epoll_fd != -1) {
+        struct epoll_event event;
+        event.data.fd = session->stream.socket;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, session->stream.socket, &event) == -1)
+            print_error_message("epoll_ctl");
+        else
+            session->outArmed = true;
+    }
+    wheel_reschedule(session);
+}
+
+// Send what is waiting in the output as far as the socket takes it. Returns true once it has all gone, or been
+// dropped because the connection failed, and false while some is left: epoll then reports the socket writable,
+// see session_writable, and the io_uring engine queues the send itself
+static bool session_flush(Session* session)
+{
+    int sock = session->stream.socket;
+    while(session->outPos < session->outLen && !session->outFailed) {
+        if(ring_active)
+            return false;
+        ssize_t count = session_transmit(sock, &session->outData[session->outPos], session->outLen - session->outPos);
+        if(count < 0 && errno == EINTR)
+            continue;
+        if(count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            METRIC_ADD(metrics.sendStalls, 1);
+            session_wait_writable(session);
+            return false;
+        }
+        if(count <= 0) {
+            // The client has gone, the next read sees the connection close
+            session->outFailed = true;
+            break;
+        }
+        METRIC_ADD(metrics.bytesOut, count);
+        session->outPos += count;
+        session->lastActivity = wheel.now;
+    }
+    session->outPos = session->outLen;
+    session_out_reset(session);
+    if(session->outArmed) {
+        struct epoll_event event;
+        event.data.fd = sock;
+        event.events = EPOLLIN | EPOLLET;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, sock, &event);
+        session->outArmed = false;
+    }
+    return true;
+}
+
+// Let go of what a GET or LIST was being sent from
+static void response_release(Session* session)
+{
+    if(session->getFd != -1) {
+        close(session->getFd);
+        session->getFd = -1;
+    }
+    if(session->getCached) {
+        get_cache_unpin(session->getCached);
+        session->getCached = NULL;
+    }
+    if(session->listSnapshot) {
+        catalog_snapshot_release(session->listSnapshot);
+        session->listSnapshot = NULL;
+    }
+}
+
+// STATE_WRITING: the response is complete, but part of it is still waiting for room in the socket
+bool continue_writing(Session* session)
+{
+    if(!session_flush(session))
+        return false;
+    response_release(session);
+    session->state = STATE_DONE;
+    return true;
+}
+
+// A response is still going out, the next request isn't read until it has
+static bool session_writing(Session* session)
+{
+    if(session->outFailed)
+        return false;
+    return session->outPos < session->outLen || session->state == STATE_WRITING
+        || session->state == STATE_SENDING_GET || session->state == STATE_WRITING_LIST;
+}
+
+int pwrite_all(int fd, char* buffer, size_t size, off_t offset) {
+    size_t bytes_written = 0;
+    while (bytes_written < size) {
+        ssize_t count = pwrite(fd, &buffer[bytes_written], size - bytes_written, offset + bytes_written);
+        if(count < 0) {
+            if(errno == EINTR)
+                continue;
+            print_error_message("Output file");
+            return -1;
+        }
+        if(count == 0) {
+            print_error_message("Output write failed");
+            return -1;
+        }
+        bytes_written += count;
+    }
+    return 0;
+}
+
+void insert_size_into_mem(char* pBuffer, size_t size) {
+    memcpy(pBuffer, &size, sizeof(size_t));
+}
+
+//------------------------------------------------------------------------------
+/*
+   Persistent index
+   With --data-dir the catalog is mirrored into INDEX_FILE, an append only log of records that is memory
+   mapped. A PUT appends a record and clears the live flag of the one it replaces, a DELETE clears the flag.
+   Startup replays the log straight from the mapping, with no readdir or stat of the stored files. The log is
+   rewritten without the dead records once they take up more than half of it, at startup and as PUTs and
+   DELETEs retire records, so it stays in proportion to the files stored however long the server runs.
+   Records change under their entry's shard write lock, and store_index.lock as well since appends from
+   different shards share the mapping and a growing mapping can move
+*/
+#define INDEX_MAGIC 0x32584449534e534eULL    // "NSNSIDX2"
+#define INDEX_MIN_SIZE (1024 * 1024)
+#define INDEX_COMPACT_MIN (INDEX_MIN_SIZE / 2)   // A running server leaves smaller logs be, a rewrite syncs
+
+typedef struct {
+    uint64_t magic;
+    uint64_t used;          // Bytes of the file holding records, this header included
+    uint64_t dead;          // Bytes taken by records that are no longer live
+    uint64_t reserved;
+} IndexHeader;
+
+typedef struct {
+    uint32_t length;        // Bytes of the whole record, padded to a multiple of 8
+    uint32_t live;          // Cleared when the file is replaced or deleted
+    uint32_t checksum;      // FNV-1a of the rest of the record, so a torn append is noticed at startup
+    uint32_t nameLen;
+    uint64_t size;
+    int64_t mtime;
+    uint64_t inode;
+    uint8_t digest[SHA256_DIGEST_SIZE];     // The dedup store blob holding the contents, all zero for none
+    char name[];            // nameLen bytes and a '\0'
+} IndexRecord;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int fd;
+    char* map;
+    size_t mapped;
+} StoreIndex;
+
+static StoreIndex store_index = { .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+
+static IndexHeader* index_header(void)
+{
+    return (IndexHeader*)store_index.map;
+}
+
+static uint32_t index_checksum(const IndexRecord* record)
+{
+    uint32_t hash = 2166136261u;
+    const unsigned char* p = (const unsigned char*)&record->nameLen;
+    const unsigned char* end = (const unsigned char*)record->name + record->nameLen;
+    while(p < end) {
+        hash ^= *p++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Make sure the mapping has room for needed more bytes, the file at least doubles each time it grows.
+// index_reserve and index_retire are called with store_index.lock held
+static bool index_reserve(size_t needed)
+{
+    size_t want = index_header()->used + needed;
+    if(want <= store_index.mapped)
+        return true;
+    size_t size = store_index.mapped * 2;
+    while(size < want)
+        size *= 2;
+    if(ftruncate(store_index.fd, size) == -1)
+        return false;
+    char* map = mremap(store_index.map, store_index.mapped, size, MREMAP_MAYMOVE);
+    if(map == MAP_FAILED)
+        return false;
+    store_index.map = map;
+    store_index.mapped = size;
+    return true;
+}
+
+static void index_retire(catalog_entry_t* entry)
+{
+    if(entry->index == 0)
+        return;
+    IndexRecord* record = (IndexRecord*)&store_index.map[entry->index];
+    record->live = 0;
+    index_header()->dead += record->length;
+    entry->index = 0;
+}
+
+static void index_kill(catalog_entry_t* entry)
+{
+    pthread_mutex_lock(&store_index.lock);
+    index_retire(entry);
+    pthread_mutex_unlock(&store_index.lock);
+}
+
+// Append a live record for entry and retire the one it had
+static void index_append(catalog_entry_t* entry, uint64_t inode)
+{
+    size_t nameLen = strlen(entry->name);
+    size_t length = (sizeof(IndexRecord) + nameLen + 1 + 7) & ~(size_t)7;
+    pthread_mutex_lock(&store_index.lock);
+    if(!index_reserve(length)) {
+        log_message(LOG_ERROR, "Can't grow the index: %s", strerror(errno));
+        pthread_mutex_unlock(&store_index.lock);
+        return;
+    }
+
+    IndexHeader* header = index_header();
+    uint64_t offset = header->used;
+    IndexRecord* record = (IndexRecord*)&store_index.map[offset];
+    memset(record, 0, length);
+    record->length = length;
+    record->live = 1;
+    record->nameLen = nameLen;
+    record->size = entry->size;
+    record->mtime = entry->mtime;
+    record->inode = inode;
+    if(entry->blob)
+        memcpy(record->digest, ((Blob*)entry->blob)->digest, SHA256_DIGEST_SIZE);
+    memcpy(record->name, entry->name, nameLen + 1);
+    record->checksum = index_checksum(record);
+    // The record is complete before used covers it
+    __atomic_store_n(&header->used, offset + length, __ATOMIC_RELEASE);
+
+    index_retire(entry);
+    entry->index = offset;
+    pthread_mutex_unlock(&store_index.lock);
+}
+
+static bool index_map(int fd)
+{
+    struct stat file_info;
+    if(fstat(fd, &file_info) == -1)
+        return false;
+    size_t size = file_info.st_size;
+    if(size < INDEX_MIN_SIZE) {
+        if(ftruncate(fd, INDEX_MIN_SIZE) == -1)
+            return false;
+        size = INDEX_MIN_SIZE;
+    }
+    char* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED)
+        return false;
+    store_index.fd = fd;
+    store_index.map = map;
+    store_index.mapped = size;
+    return true;
+}
+
+// Write the live records alone to a new index file and switch over to it, with every shard write locked
+static bool index_rewrite(const char* path)
+{
+    char tmp[BUFSIZ];
+    int len = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if(len < 0 || (size_t)len >= sizeof(tmp))
+        return false;
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if(fd == -1)
+        return false;
+
+    size_t used = sizeof(IndexHeader);
+    for(unsigned s=0; s < CATALOG_SHARDS; s++) {
+        catalog_t* catalog = &directory.shards[s].catalog;
+        for(size_t i=0; i < catalog_size(catalog); i++)
+            used += ((IndexRecord*)&store_index.map[catalog_at(catalog, i)->index])->length;
+    }
+    size_t size = INDEX_MIN_SIZE;
+    while(size < used * 2)
+        size *= 2;
+    char* map = NULL;
+    if(ftruncate(fd, size) == -1 ||
+       (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        unlink(tmp);
+        return false;
+    }
+
+    size_t offset = sizeof(IndexHeader);
+    for(unsigned s=0; s < CATALOG_SHARDS; s++) {
+        catalog_t* catalog = &directory.shards[s].catalog;
+        for(size_t i=0; i < catalog_size(catalog); i++) {
+            catalog_entry_t* entry = catalog_at(catalog, i);
+            IndexRecord* record = (IndexRecord*)&store_index.map[entry->index];
+            memcpy(&map[offset], record, record->length);
+            entry->index = offset;
+            offset += record->length;
+        }
+    }
+    IndexHeader* header = (IndexHeader*)map;
+    header->magic = INDEX_MAGIC;
+    header->used = offset;
+    header->dead = 0;
+    if(msync(map, offset, MS_SYNC) == -1 || fsync(fd) == -1 || rename(tmp, path) == -1) {
+        munmap(map, size);
+        close(fd);
+        unlink(tmp);
+        return false;
+    }
+
+    munmap(store_index.map, store_index.mapped);
+    close(store_index.fd);
+    store_index.fd = fd;
+    store_index.map = map;
+    store_index.mapped = size;
+    return true;
+}
+
+static bool index_compact(const char* path)
+{
+    for(unsigned s=0; s < CATALOG_SHARDS; s++)
+        catalog_shard_lock(&directory.shards[s], true);
+    pthread_mutex_lock(&store_index.lock);
+    bool done = index_rewrite(path);
+    pthread_mutex_unlock(&store_index.lock);
+    for(unsigned s=0; s < CATALOG_SHARDS; s++)
+        catalog_shard_unlock(&directory.shards[s]);
+    return done;
+}
+
+static void index_path(char* buffer, size_t size)
+{
+    snprintf(buffer, size, "%s/" INDEX_FILE, base_temp_dir);
+}
+
+// Compact the index if dead records have come to outweigh the live ones. Called with no shard lock held,
+// as the compaction takes them all
+static void index_maybe_compact(void)
+{
+    pthread_mutex_lock(&store_index.lock);
+    IndexHeader* header = index_header();
+    bool due = header->used >= INDEX_COMPACT_MIN && header->dead > header->used / 2;
+    pthread_mutex_unlock(&store_index.lock);
+    if(!due)
+        return;
+
+    char path[BUFSIZ];
+    index_path(path, sizeof(path));
+    if(!index_compact(path))
+        log_message(LOG_WARN, "Can't compact the index: %s", strerror(errno));
+}
+
+// Open or create the index in base_temp_dir and fill the catalog from it
+static void index_load(void)
+{
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    char path[BUFSIZ];
+    index_path(path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if(fd == -1 || !index_map(fd)) {
+        print_error_message("Can't open the index");
+        exit(EXIT_FAILURE);
+    }
+
+    IndexHeader* header = index_header();
+    if(header->magic == 0 && header->used == 0) {
+        header->magic = INDEX_MAGIC;
+        header->used = sizeof(IndexHeader);
+    }
+    if(header->magic != INDEX_MAGIC || header->used < sizeof(IndexHeader) || header->used > store_index.mapped) {
+        fprintf(stderr, "'%s' is not a valid index\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t offset = sizeof(IndexHeader);
+    while(offset < header->used) {
+        IndexRecord* record = (IndexRecord*)&store_index.map[offset];
+        if(header->used - offset < sizeof(IndexRecord) || record->length < sizeof(IndexRecord) + record->nameLen + 1 ||
+           record->length > header->used - offset || record->name[record->nameLen] != '\0' ||
+           record->checksum != index_checksum(record)) {
+            // Only the last append can be torn, drop it
+            log_message(LOG_WARN, "Index is damaged at %" PRIu64 ", dropping %" PRIu64 " bytes", offset,
+                        header->used - offset);
+            header->used = offset;
+            break;
+        }
+        if(record->live) {
+            catalog_shard_t* shard = sharded_catalog_lock(&directory, record->name, true);
+            catalog_entry_t* entry = catalog_shard_put(shard, record->name, record->size, record->mtime);
+            if(entry == NULL) {
+                print_error_message("Out of memory loading the index");
+                exit(EXIT_FAILURE);
+            }
+            // A crash between appending a record and retiring the old one leaves both live, the later one wins
+            index_kill(entry);
+            entry->index = offset;
+            Blob* previous = entry->blob;
+            entry->blob = NULL;
+            static const uint8_t none[SHA256_DIGEST_SIZE];
+            if(memcmp(record->digest, none, SHA256_DIGEST_SIZE)) {
+                pthread_mutex_lock(&blob_store.lock);
+                Blob* blob = blob_find(record->digest);
+                if(blob == NULL)
+                    blob = blob_add(record->digest, record->size);
+                if(blob == NULL) {
+                    print_error_message("Out of memory loading the index");
+                    exit(EXIT_FAILURE);
+                }
+                blob_hold(blob);
+                pthread_mutex_unlock(&blob_store.lock);
+                entry->blob = blob;
+            }
+            if(previous)
+                blob_release(previous);
+            catalog_shard_unlock(shard);
+        }
+        offset += record->length;
+    }
+
+    if(header->dead > header->used / 2 && !index_compact(path))
+        log_message(LOG_WARN, "Can't compact the index: %s", strerror(errno));
+
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    fprintf(stderr, "Loaded %zu files from the index in %.1f ms\n", sharded_catalog_size(&directory),
+            (finished.tv_sec - started.tv_sec) * 1e3 + (finished.tv_nsec - started.tv_nsec) / 1e6);
+}
+
+// Write the index records appended so far back to disk
+static void index_sync(void)
+{
+    if(store_index.fd == -1)
+        return;
+    pthread_mutex_lock(&store_index.lock);
+    if(msync(store_index.map, index_header()->used, MS_SYNC) == -1)
+        log_message(LOG_ERROR, "Can't sync the index: %s", strerror(errno));
+    pthread_mutex_unlock(&store_index.lock);
+}
+
+static void index_close(void)
+{
+    if(store_index.fd == -1)
+        return;
+    msync(store_index.map, index_header()->used, MS_SYNC);
+    munmap(store_index.map, store_index.mapped);
+    close(store_index.fd);
+    store_index.fd = -1;
+}
+
+// Record a stored file in the catalog, and in the index when there is one. blob is the dedup store blob
+// that holds the contents, with a reference already taken for the entry, or NULL for a file of its own.
+// The entry, its blob and its index record change together under the shard lock, so of two PUTs of one name
+// the one that commits last wins
+static void store_commit(const char* name, size_t size, uint64_t inode, void* blob)
+{
+    catalog_shard_t* shard = sharded_catalog_lock(&directory, name, true);
+    catalog_entry_t* entry = catalog_shard_put(shard, name, size, time(NULL));
+    if(entry == NULL) {
+        catalog_shard_unlock(shard);
+        if(blob)
+            blob_release(blob);
+        return;
+    }
+    Blob* previous = entry->blob;
+    entry->blob = blob;
+    if(previous)
+        blob_release(previous);
+    if(store_index.fd != -1)
+        index_append(entry, inode);
+    catalog_shard_unlock(shard);
+    if(store_index.fd != -1)
+        index_maybe_compact();
+}
+
+// Drop a stored file from the catalog and the index. *pShared is set if it was a reference to a dedup blob
+// rather than a file of its own
+static hashtable_rc_t store_forget(const char* name, bool* pShared)
+{
+    catalog_shard_t* shard = sharded_catalog_lock(&directory, name, true);
+    catalog_entry_t* entry = catalog_find(&shard->catalog, name);
+    *pShared = entry && entry->blob;
+    if(entry && store_index.fd != -1)
+        index_kill(entry);
+    if(entry && entry->blob)
+        blob_release(entry->blob);
+    hashtable_rc_t rc = catalog_shard_remove(shard, name);
+    catalog_shard_unlock(shard);
+    if(store_index.fd != -1)
+        index_maybe_compact();
+    return rc;
+}
+
+static void initialize()
+{
+    char base_path[] = "XXXXXX";
+
+    clock_gettime(CLOCK_MONOTONIC, &metrics.started);
+
+    if(data_dir) {
+        if(mkdir(data_dir, 0700) == -1 && errno != EEXIST) {
+            print_error_message("mkdir failed");
+            exit(EXIT_FAILURE);
+        }
+        if(snprintf(base_temp_dir, sizeof(base_temp_dir), "%s", data_dir) >= (int)sizeof(base_temp_dir)) {
+            print_error_message("--data-dir path too long");
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        char *tmp_dir = mkdtemp(base_path);
+        if(tmp_dir == NULL) {
+            print_error_message("mkdtemp faild");
+            exit(EXIT_FAILURE);
+        }
+        print_temp_directory(tmp_dir);
+
+        snprintf(base_temp_dir, sizeof(base_temp_dir), "%s", tmp_dir);
+    }
+
+    char partial_dir[BUFSIZ];
+    snprintf(partial_dir, sizeof(partial_dir), "%s/" PARTIAL_DIR, base_temp_dir);
+    if(mkdir(partial_dir, 0700) == -1 && errno != EEXIST) {
+        print_error_message("mkdir failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // Uploads that were in progress when the server stopped are gone
+    char incoming_dir[BUFSIZ];
+    snprintf(incoming_dir, sizeof(incoming_dir), "%s/" INCOMING_DIR, base_temp_dir);
+    remove_directory(incoming_dir);
+    if(mkdir(incoming_dir, 0700) == -1) {
+        print_error_message("mkdir failed");
+        exit(EXIT_FAILURE);
+    }
+
+    char blob_dir[BUFSIZ];
+    snprintf(blob_dir, sizeof(blob_dir), "%s/" BLOB_DIR, base_temp_dir);
+    if(mkdir(blob_dir, 0700) == -1 && errno != EEXIST) {
+        print_error_message("mkdir failed");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stderr, "Storing files at '%s'\n", base_temp_dir);
+
+    hashtable_ts_init(&sock_to_session_hashtable, NULL, "sock_to_session_hashtable");
+
+    sharded_catalog_init(&directory);
+    if(data_dir)
+        index_load();
+
+    if(posix_memalign((void **)&put_buffer, sysconf(_SC_PAGESIZE), PUT_BUFFER_SIZE)) {
+        print_error_message("posix_memalign failed");
+        exit(EXIT_FAILURE);
+    }
+}
+// Parse the decimal value text of option into *pValue, which has to come out from min to max. Prints what
+// is wrong with it otherwise, signs and trailing characters included
+static bool parse_count(const char* progname, const char* option, const char* text, unsigned long long min,
+                        unsigned long long max, unsigned long long* pValue)
+{
+    char* end = NULL;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    // strtoull would take "-1" as a huge value, so the number has to start with a digit
+    if(!isdigit((unsigned char)text[0]) || errno || *end != '\0' || value < min || value > max) {
+        fprintf(stderr, "%s: bad value '%s' for %s, expected %llu to %llu\n", progname, text, option, min, max);
+        print_usage(progname);
+        return false;
+    }
+    *pValue = value;
+    return true;
+}
+
+static int parse_args(int argc, char* argv[])
+{
+  int i;
+  unsigned long long value;
+  for(i=2; i<argc; i++){
+
+    char* arg = argv[i];
+
+    if(!strcmp(arg, "--noverbose")) {
+        verbose_flag = 0;
+    } else if(!strcmp(arg, "--direct-io")) {
+        direct_io_flag = 1;
+    } else if(!strcmp(arg, "--io-uring")) {
+        io_uring_flag = 1;
+    } else if(!strcmp(arg, "--cache-size") && i + 1 < argc) {
+        char* end = NULL;
+        errno = 0;
+        unsigned long long size = strtoull(argv[++i], &end, 10);
+        if(errno || end == argv[i] || *end != '\0') {
+            fprintf(stderr, "%s: bad cache size '%s'\n", argv[0], argv[i]);
+            print_usage(argv[0]);
+            return -1;
+        }
+        get_cache.capacity = size;
+    } else if(!strcmp(arg, "--log-level") && i + 1 < argc) {
+        if(log_parse_level(argv[++i], &log_level)) {
+            fprintf(stderr, "%s: bad log level '%s'\n", argv[0], argv[i]);
+            print_usage(argv[0]);
+            return -1;
+        }
+    } else if(!strcmp(arg, "--log-rate") && i + 1 < argc) {
+        if(!parse_count(argv[0], arg, argv[++i], 0, UINT_MAX, &value))
+            return -1;
+        log_rate = value;
+    } else if(!strcmp(arg, "--backlog") && i + 1 < argc) {
+        if(!parse_count(argv[0], arg, argv[++i], 0, INT_MAX, &value))
+            return -1;
+        listen_backlog = value;
+    } else if(!strcmp(arg, "--max-connections") && i + 1 < argc) {
+        if(!parse_count(argv[0], arg, argv[++i], 0, SIZE_MAX, &value))
+            return -1;
+        max_connections = value;
+    } else if(!strcmp(arg, "--idle-timeout") && i + 1 < argc) {
+        if(!parse_count(argv[0], arg, argv[++i], 0, UINT_MAX, &value))
+            return -1;
+        idle_timeout = value;
+    } else if(!strcmp(arg, "--header-timeout") && i + 1 < argc) {
+        if(!parse_count(argv[0], arg, argv[++i], 0, UINT_MAX, &value))
+            return -1;
+        header_timeout = value;
+    } else if(!strcmp(arg, "--write-timeout") && i + 1 < argc) {
+        if(!parse_count(argv[0], arg, argv[++i], 0, UINT_MAX, &value))
+            return -1;
+        write_timeout = value;
+    } else if(!strcmp(arg, "--data-dir") && i + 1 < argc) {
+        data_dir = argv[++i];
+    } else if(!strcmp(arg, "--dedup")) {
+        dedup_flag = 1;
+    } else if(!strcmp(arg, "--fsync")) {
+        fsync_flag = 1;
+    } else if(!strcmp(arg, "--group-commit")) {
+        fsync_flag = 1;
+        group_commit_flag = 1;
+    } else if(!strcmp(arg, "--read-quantum") && i + 1 < argc) {
+        // A turn has to be able to read something, and the deficit it feeds is signed
+        if(!parse_count(argv[0], arg, argv[++i], 1, SSIZE_MAX, &value))
+            return -1;
+        read_quantum = value;
+    } else if(!strcmp(arg, "--client-rate") && i + 1 < argc) {
+        if(!parse_count(argv[0], arg, argv[++i], 0, SIZE_MAX, &value))
+            return -1;
+        client_rate = value;
+    } else {
+      	fprintf(stderr, "%s: unknown parameter '%s'\n",argv[0],arg);
+      print_usage(argv[0]);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static bool admission_full(void)
+{
+    return max_connections && session_pool.inUse >= max_connections;
+}
+
+// When the session has to be closed by, in wheel time
+static uint64_t session_deadline(Session* session)
+{
+    uint64_t deadline = UINT64_MAX;
+    if(idle_timeout)
+        deadline = session->lastActivity + idle_timeout;
+    // A header trickling in a byte at a time keeps the connection active, but still has to finish in time
+    if(header_timeout && session->state == STATE_READING_HEADER && session->inputPos > 0 &&
+       session->requestBegan + header_timeout < deadline)
+        deadline = session->requestBegan + header_timeout;
+    // A response the client isn't reading has to make progress too
+    if(write_timeout && session_writing(session) && session->lastActivity + write_timeout < deadline)
+        deadline = session->lastActivity + write_timeout;
+    return deadline;
+}
+
+void wheel_schedule(Session* session)
+{
+    uint64_t deadline = session_deadline(session);
+    if(deadline == UINT64_MAX)
+        return;
+    if(deadline <= wheel.now)
+        deadline = wheel.now + 1;
+    int slot = deadline % WHEEL_SLOTS;
+    session->wheelSlot = slot;
+    session->wheelPrev = NULL;
+    session->wheelNext = wheel.slots[slot];
+    if(wheel.slots[slot])
+        wheel.slots[slot]->wheelPrev = session;
+    wheel.slots[slot] = session;
+}
+
+void wheel_cancel(Session* session)
+{
+    if(session->wheelSlot == -1)
+        return;
+    if(session->wheelPrev)
+        session->wheelPrev->wheelNext = session->wheelNext;
+    else
+        wheel.slots[session->wheelSlot] = session->wheelNext;
+    if(session->wheelNext)
+        session->wheelNext->wheelPrev = session->wheelPrev;
+    session->wheelSlot = -1;
+    session->wheelPrev = session->wheelNext = NULL;
+}
+
+// Put the session back on the wheel once its deadline may have moved closer
+static void wheel_reschedule(Session* session)
+{
+    wheel_cancel(session);
+    wheel_schedule(session);
+}
+
+static void session_expire(Session* session);
+
+// Advance the wheel one second and close the sessions whose deadline has come.
+// Sessions that have been active since they were queued go back on the wheel at their new deadline
+static void wheel_tick(void)
+{
+    wheel.now++;
+    int slot = wheel.now % WHEEL_SLOTS;
+    Session* session = wheel.slots[slot];
+    wheel.slots[slot] = NULL;
+    while(session) {
+        Session* next = session->wheelNext;
+        session->wheelSlot = -1;
+        session->wheelPrev = session->wheelNext = NULL;
+        if(session_deadline(session) <= wheel.now)
+            session_expire(session);
+        else
+            wheel_schedule(session);
+        session = next;
+    }
+}
+
+// Read the expirations off the timer and run the wheel up to date
+static void wheel_advance(void)
+{
+    uint64_t expirations = 0;
+    if(read(wheel.timerFd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+    while(expirations--)
+        wheel_tick();
+}
+
+static int wheel_start(void)
+{
+    wheel.timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(wheel.timerFd == -1)
+        return -1;
+    struct itimerspec interval = { { 1, 0 }, { 1, 0 } };
+    return timerfd_settime(wheel.timerFd, 0, &interval, NULL);
+}
+
+// Accept pending connections on the listening socket until it is empty or max connections is reached.
+// Connections past the limit wait in the kernel backlog, which pushes back on clients
+static void accept_connections(void)
+{
+    accept_paused = false;
+    while (1) {
+        if(admission_full()) {
+            if(!accept_paused)
+                METRIC_ADD(metrics.acceptPauses, 1);
+            accept_paused = true;
+            return;
+        }
+
+        struct sockaddr in_addr;
+        socklen_t in_len;
+        int infd, s;
+        char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+
+        in_len = sizeof in_addr;
+        infd = accept (listen_fd, &in_addr, &in_len);
+        if (infd == -1) {
+            if ((errno == EAGAIN) ||
+                  (errno == EWOULDBLOCK))
+            {
+                /* We have processed all incoming
+                   connections. */
+                break;
+            }
+            else
+            {
+                print_error_message ("accept failed");
+                break;
+            }
+        }
+        METRIC_ADD(metrics.accepted, 1);
+
+        if(verbose_flag) {
+            s = getnameinfo (&in_addr, in_len,
+                             hbuf, sizeof hbuf,
+                             sbuf, sizeof sbuf,
+                             NI_NUMERICHOST | NI_NUMERICSERV);
+            if (s == 0) {
+              LOG("Accepted new connection (fd=%d, %s:%s)", infd, hbuf, sbuf);
+            }
+        }
+
+        /* Make the incoming socket non-blocking and add it to the
+           list of fds to monitor. */
+        s = make_socket_non_blocking (infd);
+        if (s == -1)
+          exit(EXIT_FAILURE);
+
+        // The session starts now so a client that never sends anything still runs into the idle deadline
+        Session* session = Session_create(infd);
+        if(session == NULL) {
+            close(infd);
+            continue;
+        }
+        hashtable_ts_insert(&sock_to_session_hashtable, infd, session);
+
+        struct epoll_event event;
+        event.data.fd = infd;
+        event.events = EPOLLIN | EPOLLET;
+        s = epoll_ctl (epoll_fd, EPOLL_CTL_ADD, infd, &event);
+        if (s == -1) {
+          print_error_message ("epoll_ctl failed");
+          exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void end_session(int sock)
+{
+    close (sock);
+
+    uint32_t keyP = sock;
+    Session* session = NULL;
+    if(hashtable_ts_remove(&sock_to_session_hashtable, keyP, (void **)&session) == HASH_TABLE_OK)
+        Session_release(session);
+
+    // A connection slot is free again, take in whatever queued up in the backlog meanwhile
+    if(accept_paused && !ring_active)
+        accept_connections();
+}
+
+// The client has closed its side of the connection (or it failed). A PUT that runs to EOF is answered now,
+// then the session is ended
+static void client_closed(int sock, Session* session)
+{
+    if(session && session->state == STATE_READING_PUT_SIZE) {
+        if(session->headersize == 0 || session->inputPos < session->headersize + 8) {
+            log_message(LOG_WARN, "File size was not a size_t");
+            send_header_response(session, "ERROR", err_bad_request);
+        }
+    } else if(session && (session->state == STATE_READING_PUT_DATA || session->state == STATE_READING_PUT_FRAMES)) {
+        finish_put(session);
+    }
+    if(session && session->state == STATE_COMMITTING) {
+        // Ended once the group commit has answered the PUT
+        session->closeAfterCommit = true;
+        return;
+    }
+    if(session && session_writing(session)) {
+        // Ended once the response has gone out, see session_writable
+        session->closeAfterSend = true;
+        return;
+    }
+    if(session)
+        metrics_request_done(session);
+    LOG("Connection closed by client (fd=%d)", sock);
+    end_session(sock);
+}
+
+// A deadline passed. With epoll the session is closed right away. The io_uring engine always has an operation
+// in flight for the session, so the socket is shut down instead and that operation completes with the close
+static void session_expire(Session* session)
+{
+    int sock = session->stream.socket;
+    log_message(LOG_WARN, "Connection timed out (fd=%d)", sock);
+    METRIC_ADD(metrics.timedOut, 1);
+    // Whatever is left of a response the client stopped reading is dropped
+    if(session_writing(session))
+        session->outFailed = true;
+    if(ring_active)
+        shutdown(sock, SHUT_RDWR);
+    else
+        client_closed(sock, session);
+}
+
+#ifdef HAVE_IO_URING
+// io_uring event engine, selected with --io-uring. Accepts, connection reads, PUT payload writes, and the
+// open, reads and sends of GET files all go through one ring. Everything queued while handling a batch of
+// completions is submitted with a single io_uring_enter, which also waits for the next completions.
+// Every connection owns one registered buffer slot and has exactly one operation in flight at a time, so
+// reads use READ_FIXED/WRITE_FIXED on the slot and data received for a PUT goes to the file without a copy.
+// The request state machine is shared with the epoll loop.
+
+enum {
+    RING_ACCEPT = 1,        // accept on the listening socket
+    RING_RECV,              // read from a connection into its slot
+    RING_PUT_WRITE,         // write PUT payload from the slot to the file
+    RING_GET_OPEN,          // open the file a GET asked for
+    RING_GET_READ,          // read the next part of the GET file into the slot
+    RING_GET_SEND,          // send the slot to the client
+    RING_OUT_SEND,          // send the connection's pending response output
+    RING_TIMER,             // read the timer wheel's timerfd
+    RING_SIGNAL,            // read a shutdown signal from signal_fd
+};
+
+typedef struct {
+    int fd;
+    unsigned entries;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sqRing;
+    void* cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    unsigned pending;           // Entries queued since the last io_uring_enter
+    char* slots;                // RING_SLOTS registered buffers of RING_SLOT_SIZE bytes
+    int freeSlots[RING_SLOTS];
+    int numFreeSlots;
+    int listenFd;
+    bool acceptArmed;           // An accept is in flight. It is not re-armed while every slot is taken
+} Ring;
+
+static Ring ring;
+
+static void ring_teardown(Ring* r)
+{
+    if(r->sqes != NULL && r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+    if(r->cqRing != NULL && r->cqRing != MAP_FAILED && r->cqRing != r->sqRing)
+        munmap(r->cqRing, r->cqRingSize);
+    if(r->sqRing != NULL && r->sqRing != MAP_FAILED)
+        munmap(r->sqRing, r->sqRingSize);
+    free(r->slots);
+    close(r->fd);
+    memset(r, 0, sizeof(*r));
+}
+
+// Create the ring and register the buffer slots. Returns -1 with errno set if io_uring can't be used
+static int ring_setup(Ring* r, int listenFd)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(r, 0, sizeof(*r));
+
+    r->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if(r->fd < 0)
+        return -1;
+    r->entries = params.sq_entries;
+
+    r->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(r->cqRingSize > r->sqRingSize)
+            r->sqRingSize = r->cqRingSize;
+        r->cqRingSize = r->sqRingSize;
+    }
+
+    r->sqRing = mmap(NULL, r->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if(r->sqRing == MAP_FAILED)
+        goto fail;
+    if(params.features & IORING_FEAT_SINGLE_MMAP)
+        r->cqRing = r->sqRing;
+    else
+        r->cqRing = mmap(NULL, r->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if(r->cqRing == MAP_FAILED)
+        goto fail;
+    r->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(r->sqes == MAP_FAILED)
+        goto fail;
+
+    char* sq = r->sqRing;
+    char* cq = r->cqRing;
+    r->sqHead = (unsigned*)(sq + params.sq_off.head);
+    r->sqTail = (unsigned*)(sq + params.sq_off.tail);
+    r->sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+    r->sqArray = (unsigned*)(sq + params.sq_off.array);
+    r->cqHead = (unsigned*)(cq + params.cq_off.head);
+    r->cqTail = (unsigned*)(cq + params.cq_off.tail);
+    r->cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    if(posix_memalign((void **)&r->slots, sysconf(_SC_PAGESIZE), (size_t)RING_SLOTS * RING_SLOT_SIZE)) {
+        r->slots = NULL;
+        errno = ENOMEM;
+        goto fail;
+    }
+    struct iovec* iov = calloc(RING_SLOTS, sizeof(struct iovec));
+    if(iov == NULL)
+        goto fail;
+    for(int i=0; i < RING_SLOTS; i++) {
+        iov[i].iov_base = &r->slots[(size_t)i * RING_SLOT_SIZE];
+        iov[i].iov_len = RING_SLOT_SIZE;
+        r->freeSlots[i] = RING_SLOTS - 1 - i;
+    }
+    int rc = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, RING_SLOTS);
+    free(iov);
+    if(rc < 0)
+        goto fail;
+    r->numFreeSlots = RING_SLOTS;
+
+    // The ring waits for connections itself, a non-blocking listener would only hand back EAGAIN
+    int flags = fcntl(listenFd, F_GETFL, 0);
+    if(flags == -1 || fcntl(listenFd, F_SETFL, flags & ~O_NONBLOCK) == -1)
+        goto fail;
+    r->listenFd = listenFd;
+    return 0;
+
+fail:
+    {
+        int saved = errno;
+        ring_teardown(r);
+        errno = saved;
+    }
+    return -1;
 }
 
-void session_start_put(Session* session, size_t cmdLen) {
-
-    size_t head_size = cmdLen + strlen(session->filename) + 2; // 2 for (' ' and '\n') in "PUT file.png\n"
-    session->headersize = head_size;
-    session->state = STATE_READING_PUT_SIZE;
-    continue_reading_put(session);
+// Submit what is queued and, if waitNr is set, wait for that many completions
+static int ring_enter(Ring* r, unsigned waitNr)
+{
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, r->fd, r->pending, waitNr, waitNr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while(ret < 0 && errno == EINTR);
+    if(ret > 0)
+        r->pending -= ret;
+    return ret;
 }
 
-Session* Session_create(int sock) {
-    Session* session = NULL;
-    session = calloc(1, sizeof(Session));
-    if(session == NULL) {
-        print_error_message("calloc failed");
-        return NULL;
+static struct io_uring_sqe* ring_get_sqe(Ring* r)
+{
+    unsigned tail = *r->sqTail;
+    if(tail - __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE) == r->entries) {
+        // Queue is full, hand what we have to the kernel first
+        if(ring_enter(r, 0) < 0) {
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
     }
-    Stream_Reset(&session->stream, sock);
-    memset(session->input, 0, BUFSIZ);
-    memset(session->filename, 0, BUFSIZ);
-    session->state = STATE_READING_HEADER;
-    session->inputPos = 0;
-    session->fd = NULL;
-    session->status = STATUS_SESSION_WAIT;
-    session->listData = NULL;
-    session->listDataPos = 0;
-    session->reading = true;
-    session->headersize = 0;
-    return session;
+    unsigned index = tail & *r->sqMask;
+    struct io_uring_sqe* sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sqArray[index] = index;
+    __atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+    r->pending++;
+    return sqe;
 }
 
-int Session_processNext(Session* session) {
-    bool running = false;
-    do
-    {
-        switch(session->state) {
-            case STATE_WRITING:
-                //running = continue_writing(session);
-                break;
-            case STATE_READING_HEADER:
-                running = continue_reading_header(session);
-                break;
-            case STATE_SENDING_GET: 
-                //running = continue_sending_get(session);
-                break;
-            case STATE_READING_PUT_SIZE:
-            case STATE_READING_PUT_DATA:
-                running = continue_reading_put(session);
-                break;
-            case STATE_WRITING_LIST:
-                //running = continue_writing_list(session);
-                break;
-            case STATE_INTERNAL_ERROR:
-                running = false;
-                break;
-            case STATE_DONE:
-                session->status = STATUS_SESSION_END;
-                break;
-            default:
-                assert(false); //Should never be in anything except the above states.
-        }
-    }while(running);
-    return session->status;
+static void ring_queue(Ring* r, int opcode, int fd, void* addr, unsigned len, uint64_t offset, int slot, int sock, int kind)
+{
+    struct io_uring_sqe* sqe = ring_get_sqe(r);
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = offset;
+    if(slot >= 0)
+        sqe->buf_index = slot;
+    sqe->user_data = ((uint64_t)(unsigned)sock << 8) | kind;
 }
 
-static int
-make_socket_non_blocking (int sfd)
+static char* ring_slot(Ring* r, Session* session)
 {
-    int flags, s;
+    return &r->slots[(size_t)session->ringSlot * RING_SLOT_SIZE];
+}
 
-    flags = fcntl (sfd, F_GETFL, 0);
-    if (flags == -1)
-    {
-        perror ("fcntl");
-        return -1;
+static void ring_queue_accept(Ring* r)
+{
+    if(r->acceptArmed || r->numFreeSlots == 0)
+        return;
+    if(admission_full()) {
+        METRIC_ADD(metrics.acceptPauses, 1);
+        return;
     }
+    ring_queue(r, IORING_OP_ACCEPT, r->listenFd, NULL, 0, 0, -1, r->listenFd, RING_ACCEPT);
+    r->acceptArmed = true;
+}
 
-    flags |= O_NONBLOCK;
-    s = fcntl (sfd, F_SETFL, flags);
-    if (s == -1)
-    {
-        perror ("fcntl");
-        return -1;
+static void ring_queue_recv(Ring* r, Session* session)
+{
+    size_t len = BUFSIZ;
+    if(session->state == STATE_READING_PUT_DATA) {
+        // Payload goes from the slot straight to the file, so it can use the whole slot
+        len = RING_SLOT_SIZE;
+        if(session->keepAlive && session->totalBytesForPut - session->totalWritten < len)
+            len = session->totalBytesForPut - session->totalWritten;
     }
+    ring_queue(r, IORING_OP_READ_FIXED, session->stream.socket, ring_slot(r, session), len, 0,
+               session->ringSlot, session->stream.socket, RING_RECV);
+}
 
-    return 0;
+static void ring_queue_put_write(Ring* r, Session* session)
+{
+    ring_queue(r, IORING_OP_WRITE_FIXED, session->fd, ring_slot(r, session) + session->ioPos,
+               session->ioLen - session->ioPos, session->putOffset, session->ringSlot,
+               session->stream.socket, RING_PUT_WRITE);
 }
 
-static int
-create_and_bind (int portNum)
+static void ring_queue_get_read(Ring* r, Session* session)
 {
+    size_t len = session->getLeft < RING_SLOT_SIZE ? session->getLeft : RING_SLOT_SIZE;
+    ring_queue(r, IORING_OP_READ_FIXED, session->getFd, ring_slot(r, session), len, session->getOffset,
+               session->ringSlot, session->stream.socket, RING_GET_READ);
+}
 
-    int sfd;
+static void ring_queue_get_send(Ring* r, Session* session)
+{
+    struct io_uring_sqe* sqe = ring_get_sqe(r);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = session->stream.socket;
+    sqe->addr = (uint64_t)(uintptr_t)(ring_slot(r, session) + session->ioPos);
+    sqe->len = session->ioLen - session->ioPos;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = ((uint64_t)(unsigned)session->stream.socket << 8) | RING_GET_SEND;
+}
 
-    struct sockaddr_in address;
+static void ring_queue_out_send(Ring* r, Session* session)
+{
+    struct io_uring_sqe* sqe = ring_get_sqe(r);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = session->stream.socket;
+    sqe->addr = (uint64_t)(uintptr_t)&session->outData[session->outPos];
+    sqe->len = session->outLen - session->outPos;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = ((uint64_t)(unsigned)session->stream.socket << 8) | RING_OUT_SEND;
+    wheel_reschedule(session);
+}
 
-    // Creating socket file descriptor
-    if ((sfd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-      perror("Socket creation failed");
-      exit(EXIT_FAILURE);
-    }
+static void ring_queue_get_open(Ring* r, Session* session)
+{
+    // The slot is free while the GET is being opened, so the path is built in it
+    char* path = ring_slot(r, session);
+    if(!stored_path(session->filename, path, RING_SLOT_SIZE))
+        path[0] = '\0';    // No file has a name that long, the open fails and the GET is answered as not found
+    struct io_uring_sqe* sqe = ring_get_sqe(r);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t)(uintptr_t)path;
+    sqe->open_flags = O_RDONLY;
+    sqe->user_data = ((uint64_t)(unsigned)session->stream.socket << 8) | RING_GET_OPEN;
+}
 
-    int enable = 1;
-    if(setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int))<0) {
-        perror(NULL);
-        exit(1);
+static void ring_close(Ring* r, Session* session)
+{
+    int sock = session->stream.socket;
+    int slot = session->ringSlot;
+    client_closed(sock, session);
+    if(hashtable_ts_get(&sock_to_session_hashtable, sock, (void **)&session) == HASH_TABLE_OK) {
+        // The response goes out first, ring_continue closes the connection after it
+        ring_queue_out_send(r, session);
+        return;
     }
-    if(setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int))<0) {
-        perror(NULL);
-        exit(1);
+    r->freeSlots[r->numFreeSlots++] = slot;
+    ring_queue_accept(r);
+}
+
+// Queue the next operation for a connection once its last one has been handled
+static void ring_continue(Ring* r, Session* session)
+{
+    if(session->outPos < session->outLen && !session->outFailed) {
+        ring_queue_out_send(r, session);
+    } else if(session->closeAfterSend || (session->keepAlive && session->status == STATUS_SESSION_ERROR)) {
+        ring_close(r, session);
+    } else if(session->state == STATE_SENDING_GET && session->getCached == NULL && session->getFd == -1) {
+        ring_queue_get_open(r, session);
+    } else {
+        ring_queue_recv(r, session);
     }
+}
 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(portNum);
+// The GET file has been sent completely, or could not be
+static void ring_get_done(Ring* r, Session* session, bool ok)
+{
+    close(session->getFd);
+    session->getFd = -1;
+    if(!ok) {
+        session->state = STATE_INTERNAL_ERROR;
+        session->status = STATUS_SESSION_ERROR;
+        ring_close(r, session);
+        return;
+    }
+    session->state = STATE_DONE;
+    session->status = STATUS_SESSION_END;
+    // Carries on with any request pipelined behind this one
+    Session_processNext(session);
+    ring_continue(r, session);
+}
 
-    // Binding to the specified port
-    if (bind(sfd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        print_error_message("Bind failed");
-        exit(EXIT_FAILURE);
+static void ring_accept_connection(Ring* r, int sock)
+{
+    Session* session = Session_create(sock);
+    if(session == NULL) {
+        close(sock);
+        return;
     }
+    session->ringSlot = r->freeSlots[--r->numFreeSlots];
+    hashtable_ts_insert(&sock_to_session_hashtable, sock, session);
+    METRIC_ADD(metrics.accepted, 1);
+    LOG("Accepted new connection (fd=%d)", sock);
+    ring_queue_recv(r, session);
+}
 
-    return sfd;
+static uint64_t ring_timer_expirations;
+
+static void ring_queue_timer(Ring* r)
+{
+    ring_queue(r, IORING_OP_READ, wheel.timerFd, &ring_timer_expirations, sizeof(ring_timer_expirations), 0,
+               -1, wheel.timerFd, RING_TIMER);
 }
 
+static struct signalfd_siginfo ring_signal;
 
-void printBuffer(const char *buffer, size_t size) {
-    for (size_t i = 0; i < size; i++) {
-        fprintf(stderr, "%02X ", (unsigned char)buffer[i]); // Prints in hexadecimal format
-    }
-    fprintf(stderr, "\n");
+static void ring_queue_signal(Ring* r)
+{
+    ring_queue(r, IORING_OP_READ, signal_fd, &ring_signal, sizeof(ring_signal), 0, -1, signal_fd, RING_SIGNAL);
 }
 
-void send_all(char* buffer, size_t size, int sock) {
-    size_t bytes_sent = 0;
-    do
-    {
-        int count;
-        count = send(sock, &buffer[bytes_sent], size - bytes_sent, 0);
-        if(count < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
-                continue;
-            
-            //print_error_message("Client socket:");
+static void ring_complete(Ring* r, int sock, int kind, int res)
+{
+    if(kind == RING_SIGNAL) {
+        if(res == sizeof(ring_signal))
+            server_shutdown(ring_signal.ssi_signo);
+        ring_queue_signal(r);
+        return;
+    }
+    if(kind == RING_TIMER) {
+        if(res == sizeof(ring_timer_expirations))
+            while(ring_timer_expirations--)
+                wheel_tick();
+        ring_queue_timer(r);
+        return;
+    }
+    if(kind == RING_ACCEPT) {
+        r->acceptArmed = false;
+        if(res >= 0)
+            ring_accept_connection(r, res);
+        else if(res != -EINTR && res != -EAGAIN && res != -ECONNABORTED)
+            log_message(LOG_ERROR, "accept failed: %s", strerror(-res));
+        ring_queue_accept(r);
+        return;
+    }
+
+    Session* session = NULL;
+    if(hashtable_ts_get(&sock_to_session_hashtable, sock, (void **)&session) != HASH_TABLE_OK)
+        return;
+    char* slot = ring_slot(r, session);
+    if(res > 0 && kind != RING_PUT_WRITE && kind != RING_GET_READ)
+        session->lastActivity = wheel.now;
+
+    switch(kind) {
+        case RING_RECV:
+            if(res <= 0) {
+                if(res < 0)
+                    log_message(LOG_ERROR, "read: %s", strerror(-res));
+                ring_close(r, session);
+                return;
+            }
+            METRIC_ADD(metrics.bytesIn, res);
+            if(session->state == STATE_READING_PUT_DATA) {
+                session->totalWritten += res;
+                size_t room = 0;
+                if(session->putOffset < session->totalBytesForPut)
+                    room = session->totalBytesForPut - session->putOffset;
+                if((size_t)res < room)
+                    room = res;
+                if(room > 0) {
+                    if(session->putHashing)
+                        sha256_update(&session->putHash, slot, room);
+                    session->ioPos = 0;
+                    session->ioLen = room;
+                    ring_queue_put_write(r, session);
+                    return;
+                }
+                // Only bytes past the announced size, which are counted but not written
+                ring_continue(r, session);
+                return;
+            }
+            memcpy(session->stream.buffer, slot, res);
+            session->stream.position = 0;
+            session->stream.bytesInBuffer = res;
+            Session_processNext(session);
+            ring_continue(r, session);
             return;
-        }
-        if(count == 0) {
-            //print_error_message("Client disconnected\n");
+
+        case RING_PUT_WRITE:
+            if(res <= 0) {
+                log_message(LOG_ERROR, "write: %s", res < 0 ? strerror(-res) : "no progress");
+                sending_put_response(session, "ERROR", "An internal error ocurred");
+                ring_continue(r, session);
+                return;
+            }
+            session->putOffset += res;
+            session->ioPos += res;
+            if(session->ioPos < session->ioLen) {
+                ring_queue_put_write(r, session);
+                return;
+            }
+            if(session->keepAlive && session->totalWritten == session->totalBytesForPut) {
+                finish_put(session);
+                Session_processNext(session);
+            }
+            ring_continue(r, session);
             return;
-        }
-        bytes_sent += count;
-    } while (bytes_sent < size);
-}
 
-void write_all(FILE* f, char* buffer, size_t size) {
-    size_t bytes_sent = 0;
-    do
-    {
-        int count;
-        count = fwrite(&buffer[bytes_sent], 1, size - bytes_sent, f);
-        if(count < 0) {
-            print_error_message("Output file");
+        case RING_GET_OPEN: {
+            struct stat file_info;
+            if(res < 0 || fstat(res, &file_info) == -1) {
+                if(res >= 0)
+                    close(res);
+                log_message(LOG_WARN, "Requested file not found");
+                send_header_response(session, "ERROR", err_no_such_file);
+                Session_processNext(session);
+                ring_continue(r, session);
+                return;
+            }
+            size_t start, count;
+            if(!get_range(session, file_info.st_size, &start, &count)) {
+                close(res);
+                send_header_response(session, "ERROR", err_bad_range);
+                Session_processNext(session);
+                ring_continue(r, session);
+                return;
+            }
+            session->getFd = res;
+            session->getLeft = count;
+            session->getOffset = start;
+
+            // The header goes out from the slot like the file after it
+            LOG("Writing header for response OK");
+            memcpy(slot, "OK\n", 3);
+            insert_size_into_mem(&slot[3], count);
+            session->ioPos = 0;
+            session->ioLen = 3 + sizeof(size_t);
+            ring_queue_get_send(r, session);
+            wheel_reschedule(session);
             return;
         }
-        if(count == 0) {
-            print_error_message("Output write failed");
+
+        case RING_GET_READ:
+            if(res <= 0) {
+                print_error_message("read failed");
+                ring_get_done(r, session, false);
+                return;
+            }
+            session->getLeft -= res;
+            session->getOffset += res;
+            session->ioPos = 0;
+            session->ioLen = res;
+            ring_queue_get_send(r, session);
             return;
-        }
-        bytes_sent += count;
-    } while (bytes_sent < size);
-}
 
-void insert_size_into_mem(char* pBuffer, size_t size) {
-    memcpy(pBuffer, &size, sizeof(size_t));
+        case RING_GET_SEND:
+            if(res <= 0) {
+                ring_get_done(r, session, false);
+                return;
+            }
+            METRIC_ADD(metrics.bytesOut, res);
+            session->ioPos += res;
+            if(session->ioPos < session->ioLen)
+                ring_queue_get_send(r, session);
+            else if(session->getLeft > 0)
+                ring_queue_get_read(r, session);
+            else
+                ring_get_done(r, session, true);
+            return;
+
+        case RING_OUT_SEND:
+            if(res <= 0) {
+                session->outFailed = true;
+                ring_close(r, session);
+                return;
+            }
+            METRIC_ADD(metrics.bytesOut, res);
+            session->outPos += res;
+            if(session->outPos < session->outLen) {
+                ring_queue_out_send(r, session);
+                return;
+            }
+            Session_processNext(session);
+            ring_continue(r, session);
+            return;
+    }
 }
 
-static void initialize()
+static void ring_loop(Ring* r)
 {
-    char base_path[] = "XXXXXX";
+    ring_queue_accept(r);
+    ring_queue_timer(r);
+    ring_queue_signal(r);
+    while (1) {
+        if(ring_enter(r, 1) < 0) {
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
 
-    char *tmp_dir = mkdtemp(base_path);
-    if(tmp_dir == NULL) {
-        print_error_message("mkdtemp faild");
-        exit(EXIT_FAILURE);
+        unsigned head = *r->cqHead;
+        unsigned tail = __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE);
+        while(head != tail) {
+            struct io_uring_cqe* cqe = &r->cqes[head & *r->cqMask];
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            head++;
+            __atomic_store_n(r->cqHead, head, __ATOMIC_RELEASE);
+            ring_complete(r, (int)(data >> 8), (int)(data & 0xff), res);
+        }
     }
-    print_temp_directory(tmp_dir);
-    
-    snprintf(base_temp_dir, sizeof(base_temp_dir), "%s", tmp_dir);
+}
+#endif
 
-    fprintf(stderr, "Storing files at '%s'\n", base_temp_dir);
+/*
+   Parser harness
+   Runs request bytes through the session state machine with no connection behind it, so the header and payload
+   handling can be fuzzed and timed. The session's socket is /dev/null: session_transmit takes every send and drops
+   the response, and session_recv serves its reads from parser_input, cut into pieces of the listed sizes. A size
+   of 0 stands for EAGAIN: the session waits for the next readable event, as it does between two packets.
+   "make server-fuzz" builds it for libFuzzer, "server --bench-parser" times it.
+*/
 
-    hashtable_ts_init(&sock_to_session_hashtable, NULL, "sock_to_session_hashtable");
+static void parser_teardown(void)
+{
+    remove_directory(base_temp_dir);
+}
 
-    directory = vector_create(NULL, NULL, NULL);
+// Set up the storage directory and catalog as the server does, without the chatter
+static void parser_setup(void)
+{
+    verbose_flag = 0;
+    log_start(LOG_ERROR, 0);
+    initialize();
+    atexit(parser_teardown);
 }
-static int parse_args(int argc, char* argv[])
+
+// Feed size bytes to a new session, in reads of the sizes in cuts (cycled, or as much as it asks for when numCuts
+// is 0), until it has seen EOF or closed the connection. Returns how many of the bytes it took
+static size_t parser_run(const uint8_t* data, size_t size, const uint8_t* cuts, size_t numCuts)
 {
-  int i;
-  for(i=2; i<argc; i++){
+    int sock = open("/dev/null", O_RDWR);
+    if(sock == -1)
+        return 0;
+    Session* session = Session_create(sock);
+    if(session == NULL) {
+        close(sock);
+        return 0;
+    }
+    hashtable_ts_insert(&sock_to_session_hashtable, sock, session);
 
-    char* arg = argv[i];
+    ParserInput input = { .data = data, .size = size, .cuts = cuts, .numCuts = numCuts };
+    parser_input = &input;
+    // One pass per readable event, end_session takes the session out of the table
+    while(hashtable_ts_get(&sock_to_session_hashtable, sock, (void **)&session) == HASH_TABLE_OK) {
+        session_readable(sock);
+        sched_run();
+        put_commit_flush();
+    }
+    parser_input = NULL;
+    return input.position;
+}
 
-    if(!strcmp(arg, "--noverbose")) {
-        verbose_flag = 0;
-    } else {
-      	fprintf(stderr, "%s: unknown parameter '%s'\n",argv[0],arg);
-      print_usage(argv[0]);
-      return -1;
+#ifdef SERVER_FUZZ
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+// libFuzzer entry point. The first byte says how many of the bytes after it are read sizes, the rest is what the
+// client sends
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    static bool ready = false;
+    if(!ready) {
+        parser_setup();
+        ready = true;
     }
-  }
-  return 0;
+    if(size == 0)
+        return 0;
+    size_t numCuts = data[0] % 16;
+    if(numCuts > size - 1)
+        numCuts = size - 1;
+    parser_run(data + 1 + numCuts, size - 1 - numCuts, data + 1, numCuts);
+    return 0;
 }
+#endif
 
-static void end_session(int sock)
+// Append one request to a bench buffer: the header line, then for an upload the 8 byte size and 64 bytes of
+// payload, as LZ frames for PUTZ
+static size_t parser_bench_request(char* buffer, const char* header, bool upload, bool frames)
 {
-    close (sock);
+    size_t len = strlen(header);
+    memcpy(buffer, header, len);
+    if(!upload)
+        return len;
+    size_t size = 64;
+    memcpy(&buffer[len], &size, sizeof(size));
+    len += sizeof(size);
+    if(frames) {
+        // One frame stored as is, coded length equal to the raw one, then the end frame
+        uint32_t lengths[2] = { size, size };
+        memcpy(&buffer[len], lengths, sizeof(lengths));
+        len += sizeof(lengths);
+    }
+    memset(&buffer[len], 'x', size);
+    len += size;
+    if(frames) {
+        memset(&buffer[len], 0, 2 * sizeof(uint32_t));
+        len += 2 * sizeof(uint32_t);
+    }
+    return len;
+}
 
-    uint32_t keyP = sock;
-    hashtable_ts_free(&sock_to_session_hashtable, keyP);
+// --bench-parser: push count requests of each verb through one pipelined connection and report how many the
+// state machine gets through a second, with whole reads and with the same bytes arriving a few at a time
+static int parser_bench(size_t count)
+{
+    static const struct {
+        const char* name;
+        const char* header;
+        bool upload;
+        bool frames;
+    } verbs[] = {
+        { "GET", "GET bench\n", false, false },
+        { "PUT", "PUT bench_put\n", true, false },
+        { "DELETE", "DELETE bench_missing\n", false, false },
+        { "LIST", "LIST\n", false, false },
+        { "STATS", "STATS\n", false, false },
+        { "GETRANGE", "GETRANGE 8 16 bench\n", false, false },
+        { "PUTFROM", "PUTFROM 0 bench_from\n", true, false },
+        { "PARTIAL", "PARTIAL bench\n", false, false },
+        { "GETZ", "GETZ bench\n", false, false },
+        { "PUTZ", "PUTZ bench_z\n", true, true },
+        { "LISTPAGE", "LISTPAGE 0 0\n", false, false },
+    };
+    static const uint8_t split[] = { 1, 7, 3, 0, 64, 2, 0, 5 };
+
+    parser_setup();
+    // The file the reading verbs ask for
+    char request[256];
+    parser_run((const uint8_t*)request, parser_bench_request(request, "PUT bench\n", true, false), NULL, 0);
+
+    printf("%-10s %10s %16s %16s\n", "verb", "requests", "whole reads/s", "split reads/s");
+    for(size_t v=0; v < sizeof(verbs) / sizeof(verbs[0]); v++) {
+        size_t requestLen = parser_bench_request(request, verbs[v].header, verbs[v].upload, verbs[v].frames);
+        size_t len = strlen("KEEPALIVE\n") + count * requestLen;
+        char* buffer = malloc(len);
+        if(buffer == NULL) {
+            print_error_message("malloc failed");
+            return -1;
+        }
+        memcpy(buffer, "KEEPALIVE\n", strlen("KEEPALIVE\n"));
+        for(size_t i=0; i < count; i++)
+            memcpy(&buffer[strlen("KEEPALIVE\n") + i * requestLen], request, requestLen);
 
+        double rates[2];
+        bool complete = true;
+        for(int pass=0; pass < 2; pass++) {
+            struct timespec started, finished;
+            clock_gettime(CLOCK_MONOTONIC, &started);
+            size_t taken = parser_run((const uint8_t*)buffer, len, pass ? split : NULL, pass ? sizeof(split) : 0);
+            clock_gettime(CLOCK_MONOTONIC, &finished);
+            complete = complete && taken == len;
+            double seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+            rates[pass] = count / seconds;
+        }
+        printf("%-10s %10zu %16.0f %16.0f%s\n", verbs[v].name, count, rates[0], rates[1],
+               complete ? "" : "  (connection closed early)");
+        free(buffer);
+    }
+    return 0;
 }
 
+#ifndef SERVER_FUZZ
 int main(int argc, char **argv) {
+    if(argc >= 2 && !strcmp(argv[1], "--bench-parser")) {
+        size_t count = argc > 2 ? strtoul(argv[2], NULL, 10) : 0;
+        return parser_bench(count ? count : PARSER_BENCH_REQUESTS);
+    }
     if(argc < 2) {
         print_usage(argv[0]);
         exit(-1);
@@ -786,6 +4303,10 @@ int main(int argc, char **argv) {
     if(set_sighandler(sig_usr_un))
             return -1;
 
+    // Keep writes to stderr off the event loop
+    if(log_start(log_level, log_rate))
+        fprintf(stderr, "Can't start the log writer, logging synchronously\n");
+
     int efd;
     struct epoll_event event;
     struct epoll_event *events = NULL;
@@ -803,19 +4324,65 @@ int main(int argc, char **argv) {
     if (s == -1)
       exit(EXIT_FAILURE);
 
+    listen_fd = server_fd;
+    if(wheel_start() == -1) {
+        print_error_message("timerfd failed");
+        exit(EXIT_FAILURE);
+    }
+
     // Listening for incoming connections
-    s = listen (server_fd, 3);
+    s = listen (server_fd, listen_backlog);
     if (s == -1) {
       print_error_message("Listen failed");
       exit(EXIT_FAILURE);
     }
 
 
+    if(io_uring_flag) {
+#ifdef HAVE_IO_URING
+        if(ring_setup(&ring, server_fd) == 0) {
+            fprintf(stderr, "Using io_uring event engine\n");
+            if(direct_io_flag) {
+                // Ring writes come straight from the slots, which are not block sized
+                fprintf(stderr, "--direct-io is ignored with --io-uring\n");
+                direct_io_flag = 0;
+            }
+            // Completions arrive one connection at a time, there is no loop iteration to batch the syncs over
+            if(group_commit_flag)
+                fprintf(stderr, "--group-commit syncs each PUT on its own with --io-uring\n");
+            if(client_rate)
+                fprintf(stderr, "--client-rate is ignored with --io-uring\n");
+            ring_active = true;
+            ring_loop(&ring);
+        }
+        fprintf(stderr, "io_uring unavailable (%s), using epoll\n", strerror(errno));
+#else
+        fprintf(stderr, "Built without io_uring support, using epoll\n");
+#endif
+    }
+
     efd = epoll_create1 (0);
     if (efd == -1) {
       print_error_message("epoll_create failed");
       exit(EXIT_FAILURE);
     }
+    epoll_fd = efd;
+
+    event.data.fd = wheel.timerFd;
+    event.events = EPOLLIN;
+    s = epoll_ctl (efd, EPOLL_CTL_ADD, wheel.timerFd, &event);
+    if (s == -1) {
+      print_error_message("epoll_ctl failed");
+      exit(EXIT_FAILURE);
+    }
+
+    event.data.fd = signal_fd;
+    event.events = EPOLLIN;
+    s = epoll_ctl (efd, EPOLL_CTL_ADD, signal_fd, &event);
+    if (s == -1) {
+      print_error_message("epoll_ctl failed");
+      exit(EXIT_FAILURE);
+    }
 
     event.data.fd = server_fd;
     event.events = EPOLLIN | EPOLLET;
@@ -832,152 +4399,47 @@ int main(int argc, char **argv) {
     while (1) {
         int n, i;
 
-        n = epoll_wait (efd, events, MAXEVENTS, -1);
+        n = epoll_wait (efd, events, MAXEVENTS, sched_timeout());
+        // Connections left with input by the last pass go before the new events
+        sched_run();
         for (i = 0; i < n; i++) {
             if ((events[i].events & EPOLLERR) ||
                 (events[i].events & EPOLLHUP) ||
                 (!(events[i].events & EPOLLIN) && !(events[i].events & EPOLLOUT)))
             {
               print_error_message ("epoll error");
-              close (events[i].data.fd);
+              end_session (events[i].data.fd);
               continue;
             }
 
+            else if (wheel.timerFd == events[i].data.fd)
+            {
+                wheel_advance();
+                continue;
+            }
+            else if (signal_fd == events[i].data.fd)
+            {
+                struct signalfd_siginfo info;
+                if(read(signal_fd, &info, sizeof(info)) == sizeof(info))
+                    server_shutdown(info.ssi_signo);
+                continue;
+            }
             else if (server_fd == events[i].data.fd)
             {
                 /* We have a notification on the listening socket, which
                  means one or more incoming connections. */
-                while (1) {
-                    struct sockaddr in_addr;
-                    socklen_t in_len;
-                    int infd;
-                    char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
-
-                    in_len = sizeof in_addr;
-                    infd = accept (server_fd, &in_addr, &in_len);
-                    if (infd == -1) {
-                        if ((errno == EAGAIN) ||
-                              (errno == EWOULDBLOCK))
-                        {
-                            /* We have processed all incoming
-                               connections. */
-                            break;
-                        }
-                        else
-                        {
-                            print_error_message ("accept failed");
-                            break;
-                        }
-                    }
-
-                    s = getnameinfo (&in_addr, in_len,
-                                     hbuf, sizeof hbuf,
-                                     sbuf, sizeof sbuf,
-                                     NI_NUMERICHOST | NI_NUMERICSERV);
-                    if (s == 0) {
-                      LOG("Accepted new connection (fd=%d, %s:%s)", infd, hbuf, sbuf);
-                    }
-
-                    /* Make the incoming socket non-blocking and add it to the
-                       list of fds to monitor. */
-                    s = make_socket_non_blocking (infd);
-                    if (s == -1)
-                      exit(EXIT_FAILURE);
-
-                    event.data.fd = infd;
-                    event.events = EPOLLIN | EPOLLET;
-                    s = epoll_ctl (efd, EPOLL_CTL_ADD, infd, &event);
-                    if (s == -1) {
-                      print_error_message ("epoll_ctl failed");
-                      exit(EXIT_FAILURE);
-                    }
-                }
+                accept_connections();
                 continue;
             }
             else {
-                if(events[i].events & EPOLLIN) {
-                    /* We have data on the fd waiting to be read. Read and
-                    display it. We must read whatever data is available
-                     completely, as we are running in edge-triggered mode
-                     and won't get a notification again for the same
-                     data. */
-                    int done = 0;
-                    Session* session = NULL;
-
-                    while (1)
-                    {
-                        ssize_t bytesRead;
-                        char *buffer;
-
-                        const uint32_t keyP = events[i].data.fd;
-                        hashtable_rc_t hash_rc0;
-                        hash_rc0 = hashtable_ts_get(&sock_to_session_hashtable, keyP, (void * *)&session);
-                        if (hash_rc0 != HASH_TABLE_OK) {
-                            session = Session_create(events[i].data.fd);
-                            hashtable_ts_insert(&sock_to_session_hashtable, keyP, session);
-                        }
-
-                        buffer = session->stream.buffer;
-                        session->stream.position = 0;
-
-                        bytesRead = recv(events[i].data.fd, buffer, BUFSIZ, 0);
-                        if (bytesRead == -1) {
-                            /* If errno == EAGAIN, that means we have read all
-                             data. So go back to the main loop. */
-                            if (errno != EAGAIN)
-                            {
-                                perror ("read");
-                                done = 1;
-                            }
-                            break;
-                        } else if (bytesRead == 0) {
-                            /* End of file. The remote has closed the
-                               connection. */
-                            done = 1;
-                            break;
-                        }
-
-                        session->stream.bytesInBuffer = bytesRead;
-
-                        Session_processNext(session);
-
-                        /* Write the buffer to standard output */
-                        /*s = write (1, buffer, bytesRead);
-                        if (s == -1) {
-                            perror ("write");
-                            exit(EXIT_FAILURE);
-                        }*/
-                        
-                    }
-
-                    if(session && session->state == STATE_READING_PUT_SIZE && done) {
-                        if(session->headersize == 0 || session->inputPos < session->headersize + 8) {
-                            fprintf(stderr, "File size was not a size_t\n");
-                            send_header_response(session, "ERROR", err_bad_request);
-                        }
-                        LOG("Connection closed by client (fd=%d)", events[i].data.fd);
-                        end_session(events[i].data.fd);
-                    } else if(session && session->state == STATE_READING_PUT_DATA && done) {
-                        if(session->totalWritten < session->totalBytesForPut) {
-                            print_too_little_data();
-                            sending_put_response(session, "ERROR", err_bad_file_size);
-                        } else if(session->totalWritten == session->totalBytesForPut) {
-                            sending_put_response(session, "OK", NULL);
-                        } else if(session->totalWritten > session->totalBytesForPut) {
-                            print_received_too_much_data();
-                            sending_put_response(session, "ERROR", err_bad_file_size);
-                        }
-                        LOG("Connection closed by client (fd=%d)", events[i].data.fd);
-                        end_session(events[i].data.fd);
-                    } else if (session && done)
-                    {
-                        LOG("Connection closed by client (fd=%d)", events[i].data.fd);
-                        end_session(events[i].data.fd);
-                    }
-                        
-                }
+                // A connection waiting to send the rest of a response reads again once it has
+                if(events[i].events & EPOLLOUT)
+                    session_writable(events[i].data.fd);
+                else if(events[i].events & EPOLLIN)
+                    session_readable(events[i].data.fd);
             }
         }
+        put_commit_flush();
     }
 
     free (events);
@@ -986,5 +4448,4 @@ int main(int argc, char **argv) {
 
     return 0;
 }
-
-
+#endif